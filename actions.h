@@ -36,6 +36,134 @@ static inline action_state copy_state(const action_state& action_st, const state
 	return r;
 }
 
+// Skips the payload of an action without executing it. It must consume
+// exactly as many bytes as action_functions::read_action.
+template<typename reader_T>
+void skip_action(int action_id, reader_T&& r) {
+	switch (action_id) {
+	case 9: case 10: case 11: {
+		size_t n = r.template get<uint8_t>();
+		if (n > 12) error("invalid selection of %d units", (int)n);
+		r.skip(n * 2);
+		break;
+	}
+	case 24: case 25: case 27: case 28: case 39: case 42: case 46: case 49: case 51: case 52: case 54: case 90:
+		break;
+	case 26: case 30: case 33: case 34: case 37: case 38: case 40: case 43: case 44: case 45: case 48: case 50: case 87:
+		r.skip(1);
+		break;
+	case 13: case 19: case 31: case 32: case 35: case 41: case 53:
+		r.skip(2);
+		break;
+	case 14: case 18: case 47: case 88:
+		r.skip(4);
+		break;
+	case 12:
+		r.skip(7);
+		break;
+	case 20:
+		r.skip(9);
+		break;
+	case 21:
+		r.skip(10);
+		break;
+	case 92:
+		r.skip(81);
+		break;
+	case 210: {
+		int type = r.template get<uint8_t>();
+		int subtype = r.template get<uint8_t>();
+		if (type == 0) {
+			if (subtype > 2) error("unknown ext cheat unit subtype %d", subtype);
+			r.skip(6);
+		} else if (type == 1) {
+			if (subtype > 3) error("unknown ext cheat player subtype %d", subtype);
+			r.skip(subtype < 2 ? 3 : 5);
+		} else error("unknown ext cheat type %d", type);
+		break;
+	}
+	default:
+		error("skip_action: unknown action %d", action_id);
+	}
+}
+
+// Every action in an actions data buffer, found by parsing it without
+// executing anything. Used to put the actions cursor at any frame, e.g.
+// after restoring a snapshot, and for statistics like actions per minute
+// or build orders that do not need the game to be simulated.
+struct action_index {
+	struct action {
+		int frame;
+		int owner;
+		int action_id;
+		// The offset of the action in the actions data; the payload follows
+		// the player and action id bytes.
+		size_t offset;
+	};
+	// A frame number and size header followed by the actions it contains.
+	struct block {
+		int frame;
+		size_t offset;
+		size_t first_action;
+	};
+	a_vector<action> actions;
+	a_vector<block> blocks;
+	// The index of the first block at or after each frame up to the end frame.
+	a_vector<size_t> frame_first_block;
+	size_t data_size = 0;
+
+	size_t block_at(int frame) const {
+		if (frame < 0) return 0;
+		if ((size_t)frame < frame_first_block.size()) return frame_first_block[frame];
+		return std::lower_bound(blocks.begin(), blocks.end(), frame, [](const block& b, int frame) {
+			return b.frame < frame;
+		}) - blocks.begin();
+	}
+
+	size_t block_first_action(size_t block_index) const {
+		return block_index == blocks.size() ? actions.size() : blocks[block_index].first_action;
+	}
+
+	// The range of indices into actions that are executed on frame.
+	std::pair<size_t, size_t> actions_at(int frame) const {
+		return {block_first_action(block_at(frame)), block_first_action(block_at(frame + 1))};
+	}
+};
+
+static inline action_index make_action_index(const uint8_t* actions_data_begin, const uint8_t* actions_data_end, const std::array<int, 12>& player_id, int end_frame) {
+	action_index r;
+	r.data_size = actions_data_end - actions_data_begin;
+	data_loading::data_reader_le br(actions_data_begin, actions_data_end);
+	while (br.left()) {
+		size_t offset = br.tell();
+		int frame = br.get<int32_t>();
+		if (frame < 0) error("make_action_index: invalid frame %d", frame);
+		if (!r.blocks.empty() && frame < r.blocks.back().frame) error("make_action_index: frame %d follows frame %d", frame, r.blocks.back().frame);
+		r.blocks.push_back({frame, offset, r.actions.size()});
+		size_t actions_size = br.get<uint8_t>();
+		const uint8_t* ptr = br.get_n(actions_size);
+		data_loading::data_reader_le r2(ptr, ptr + actions_size);
+		while (r2.left()) {
+			size_t action_offset = r2.ptr - actions_data_begin;
+			int id = r2.get<uint8_t>();
+			auto i = std::find(player_id.begin(), player_id.end(), id);
+			if (i == player_id.end()) error("make_action_index: player id %d not found", id);
+			int action_id = r2.get<uint8_t>();
+			skip_action(action_id, r2);
+			r.actions.push_back({frame, (int)(i - player_id.begin()), action_id, action_offset});
+		}
+	}
+	if (end_frame >= 0) {
+		r.frame_first_block.resize((size_t)end_frame + 1);
+		size_t block_index = 0;
+		for (size_t frame = 0; frame != r.frame_first_block.size(); ++frame) {
+			while (block_index != r.blocks.size() && (size_t)r.blocks[block_index].frame < frame) ++block_index;
+			r.frame_first_block[frame] = block_index;
+		}
+	}
+	return r;
+}
+
 struct action_functions: state_functions {
 	action_state& action_st;
 	explicit action_functions(state& st, action_state& action_st) : state_functions(st), action_st(action_st) {}
@@ -1473,6 +1601,19 @@ struct action_functions: state_functions {
 		}
 	}
 
+	// Puts the actions cursor where execute_actions would have it at the
+	// start of frame, so that the actions are executed from there on.
+	void seek_actions(const action_index& index, int frame) {
+		size_t block_index = index.block_at(frame);
+		if (block_index == index.blocks.size()) {
+			action_st.actions_data_position = index.data_size;
+			action_st.next_action_frame = index.blocks.empty() ? 0 : index.blocks.back().frame;
+		} else {
+			action_st.actions_data_position = index.blocks[block_index].offset;
+			action_st.next_action_frame = index.blocks[block_index].frame;
+		}
+	}
+
 };
 
 }
@@ -7,11 +7,13 @@
 #include "data_loading.h"
 #include "bwenums.h"
 #include "korean.h"
+#include "profiler.h"
 
 #include <algorithm>
 #include <utility>
 #include <cstdlib>
 #include <cmath>
+#include <cstring>
 #include <functional>
 
 namespace bwgame {
@@ -231,9 +233,6 @@ struct state_base_copyable {
 
 	std::array<uint32_t, 12> shared_vision;
 
-	a_vector<tile_t> tiles;
-	a_vector<uint16_t> tiles_mega_tile_index;
-
 	std::array<int, 0x100> random_counts;
 	int total_random_counts;
 	uint32_t lcg_rand_state;
@@ -308,6 +307,24 @@ struct state_base_non_copyable {
 
 	object_container<order_t, 2000, 20> orders_container;
 
+	// The tiles revealed by reveal_sight_at for a given tile, sight range and
+	// ground height (or air), as indices into the tiles. Which tiles are
+	// revealed only depends on the static terrain height flags of game, so
+	// entries are built on first use and dropped when the map is reloaded or
+	// game changes. It is not copied with the state, so the game_state can be
+	// shared by states simulated in parallel.
+	// The cache is cleared when tile_indices reaches max_tile_indices; a
+	// max_tile_indices of 0 disables it.
+	struct sight_footprint_cache_t {
+		const game_state* game = nullptr;
+		a_unordered_map<uint32_t, std::pair<size_t, size_t>> entries;
+		a_vector<uint32_t> tile_indices;
+		size_t max_tile_indices = 0x100000;
+		size_t hits = 0;
+		size_t misses = 0;
+	};
+	sight_footprint_cache_t sight_footprint_cache;
+
 	intrusive_list<path_t, default_link_f> free_paths;
 	a_list<path_t> paths;
 
@@ -319,14 +336,31 @@ struct state_base_non_copyable {
 		unit_t* u;
 		int value;
 	};
-	a_vector<unit_finder_entry> unit_finder_x;
-	a_vector<unit_finder_entry> unit_finder_y;
+	// Sorted by value.
+	using unit_finder_container = a_vector<unit_finder_entry>;
+	unit_finder_container unit_finder_x;
+	unit_finder_container unit_finder_y;
 
 	const unit_t* consider_collision_with_unit_bug;
 	const unit_t* prev_bullet_source_unit;
 };
 
-struct state : state_base_copyable, state_base_non_copyable {
+// The tile arrays are kept apart from state_base_copyable so that state
+// snapshots can store them in shared pages instead of copying them.
+// Each page of tile_page_size tiles has an id in tile_page_ids. It is set
+// when the page is stored in or restored from a snapshot, and reset to 0 by
+// mark_tile_written whenever a tile in the page changes, so snapshots find
+// the unchanged pages without comparing them. tiles_mega_tile_index does not
+// change after the map is loaded.
+struct state_base_tiles {
+	enum : size_t { tile_page_size = 1024 };
+	a_vector<tile_t> tiles;
+	a_vector<uint16_t> tiles_mega_tile_index;
+	a_vector<uint64_t> tile_page_ids;
+	a_vector<uint64_t> mega_tile_index_page_ids;
+};
+
+struct state : state_base_copyable, state_base_tiles, state_base_non_copyable {
 };
 
 struct state_functions {
@@ -356,6 +390,39 @@ struct state_functions {
 	unit_t* iscript_unit = nullptr;
 	mutable size_t unit_finder_search_index = 0;
 
+	struct pathfinder_long_node {
+		pathfinder_long_node* prev = nullptr;
+		xy_fp8 pos;
+		const regions_t::region* region = nullptr;
+		fp8 total_cost{};
+		fp8 estimated_remaining_cost{};
+		fp8 estimated_final_cost{};
+		bool visited = false;
+	};
+
+	// Buffers used by pathfinder_find_long_path and pathfinder_find_short_path.
+	// They are cleared but keep their capacity between searches, so that
+	// pathfinding does not allocate once they have grown large enough.
+	struct pathfinder_scratch_t {
+		a_vector<pathfinder_long_node> long_nodes;
+		a_vector<pathfinder_long_node*> long_open;
+		std::array<a_vector<regions_t::contour>, 4> local_edges;
+		a_vector<rect> visited_areas;
+		struct area_visited_t {
+			int x;
+			static_vector<std::pair<int, int>, 10> y;
+		};
+		a_vector<area_visited_t> area_visited;
+	};
+
+	mutable pathfinder_scratch_t pathfinder_scratch;
+	// If set, every reveal_sight_at also runs the uncached algorithm and
+	// fails on any difference from the sight footprint cache.
+	bool cross_check_sight_footprints = false;
+#ifdef OPENBW_ENABLE_PROFILER
+	profiler_state* profiler = nullptr;
+#endif
+
 	const order_type_t* get_order_type(Orders id) const {
 		if ((size_t)id >= 189) error("invalid order id %d", (size_t)id);
 		return &global_st.order_types.vec[(size_t)id];
@@ -764,6 +831,12 @@ struct state_functions {
 		return restrict_unit_pos_to_bounds(move_target, ut, map_bounds() + rect { { 0, 0 }, { 0, -32 } });
 	}
 
+	// Must be called for every tile the game writes to after the map has been
+	// loaded, so that snapshots know which pages of tiles have changed.
+	void mark_tile_written(size_t index) {
+		st.tile_page_ids[index / state::tile_page_size] = 0;
+	}
+
 	bool is_walkable(xy pos) const {
 		size_t index = tile_index(pos);
 		auto& tile = st.tiles[index];
@@ -787,6 +860,7 @@ struct state_functions {
 		for (size_t y = offset_y; y != offset_y + height; ++y) {
 			for (size_t x = offset_x; x != offset_x + width; ++x) {
 				st.tiles[x + y * game_st.map_tile_width].flags &= flags;
+				mark_tile_written(x + y * game_st.map_tile_width);
 			}
 		}
 	}
@@ -798,6 +872,7 @@ struct state_functions {
 		for (size_t y = offset_y; y != offset_y + height; ++y) {
 			for (size_t x = offset_x; x != offset_x + width; ++x) {
 				st.tiles[x + y * game_st.map_tile_width].flags |= flags;
+				mark_tile_written(x + y * game_st.map_tile_width);
 			}
 		}
 	}
@@ -3880,18 +3955,11 @@ struct state_functions {
 
 	bool set_creep_receding(xy_t<size_t> tile_pos) {
 		if (st.creep_life.free_list.empty()) return false;
-		auto* v = &st.creep_life.free_list.front();
-		st.creep_life.free_list.pop_front();
-		--st.creep_life.free_list_size;
-		size_t n_neighbors = count_neighboring_creep_tiles(tile_pos);
-		v->n_neighboring_creep_tiles = n_neighbors;
-		v->tile_pos = tile_pos;
-		st.creep_life.lists[n_neighbors].push_front(*v);
-		++st.creep_life.lists_size[n_neighbors];
-		st.creep_life.table.insert(v);
+		st.creep_life.add(tile_pos, count_neighboring_creep_tiles(tile_pos));
 
 		size_t index = tile_pos.y * game_st.map_tile_width + tile_pos.x;
 		st.tiles[index].flags |= tile_t::flag_creep_receding;
+		mark_tile_written(index);
 		return true;
 	}
 
@@ -3959,17 +4027,13 @@ struct state_functions {
 					int d = dx*dx * 25 + dy*dy * 64;
 					if (d > 320*320 * 25) continue;
 				}
-				auto* v = st.creep_life.table.find({tile_x, tile_y});
+				auto* v = st.creep_life.find({tile_x, tile_y});
 				if (!v) continue;
 				if (!v) error("add_creep_provider: receding creep not found");
-				st.creep_life.table.remove(v);
-				st.creep_life.lists[v->n_neighboring_creep_tiles].remove(*v);
-				--st.creep_life.lists_size[v->n_neighboring_creep_tiles];
-				v->n_neighboring_creep_tiles = 9;
-				st.creep_life.free_list.push_front(*v);
-				++st.creep_life.free_list_size;
+				st.creep_life.remove(v);
 
 				st.tiles[index].flags &= ~tile_t::flag_creep_receding;
+				mark_tile_written(index);
 			}
 		}
 	}
@@ -7614,6 +7678,7 @@ struct state_functions {
 	}
 
 	void execute_main_order(unit_t* u) {
+		OPENBW_PROFILE_SCOPE_INDEXED(*this, orders, u->order_type->id);
 		switch (u->order_type->id) {
 		case Orders::Die:
 			order_Die(u);
@@ -8983,20 +9048,13 @@ struct state_functions {
 		if (us_hidden(u)) return nullptr;
 		xy movement = ems.position - u->sprite->position;
 
-		auto cmp_u = [&](int a, auto& b) {
-			return a < b.value;
-		};
-		auto cmp_l = [&](auto& a, int b) {
-			return a.value < b;
-		};
-
 		auto new_bb = u->unit_finder_bounding_box;
 		new_bb.from += movement;
 		new_bb.to += movement;
 
 		if (movement.x < 0) {
 			auto& arr = st.unit_finder_x;
-			for (auto i = std::upper_bound(arr.begin(), arr.end(), u->unit_finder_bounding_box.from.x, cmp_u); i != arr.begin();) {
+			for (auto i = unit_finder_upper_bound(arr, u->unit_finder_bounding_box.from.x); i != arr.begin();) {
 				--i;
 				if (i->value < new_bb.from.x) break;
 				if (i->u->unit_finder_bounding_box.from.y <= new_bb.to.y && i->u->unit_finder_bounding_box.to.y >= new_bb.from.y) {
@@ -9007,7 +9065,7 @@ struct state_functions {
 			}
 		} else if (movement.x > 0) {
 			auto& arr = st.unit_finder_x;
-			for (auto i = std::lower_bound(arr.begin(), arr.end(), u->unit_finder_bounding_box.to.x, cmp_l); i != arr.end(); ++i) {
+			for (auto i = unit_finder_lower_bound(arr, u->unit_finder_bounding_box.to.x); i != arr.end(); ++i) {
 				if (i->value > new_bb.to.x) break;
 				if (i->u->unit_finder_bounding_box.from.y <= new_bb.to.y && i->u->unit_finder_bounding_box.to.y >= new_bb.from.y) {
 					if (unit_can_collide_with(u, i->u) && u_ground_unit(i->u)) {
@@ -9018,7 +9076,7 @@ struct state_functions {
 		}
 		if (movement.y < 0) {
 			auto& arr = st.unit_finder_y;
-			for (auto i = std::upper_bound(arr.begin(), arr.end(), u->unit_finder_bounding_box.from.y, cmp_u); i != arr.begin();) {
+			for (auto i = unit_finder_upper_bound(arr, u->unit_finder_bounding_box.from.y); i != arr.begin();) {
 				--i;
 				if (i->value < new_bb.from.y) break;
 				if (i->u->unit_finder_bounding_box.from.x <= new_bb.to.x && i->u->unit_finder_bounding_box.to.x >= new_bb.from.x) {
@@ -9029,7 +9087,7 @@ struct state_functions {
 			}
 		} else if (movement.y > 0) {
 			auto& arr = st.unit_finder_y;
-			for (auto i = std::lower_bound(arr.begin(), arr.end(), u->unit_finder_bounding_box.to.y, cmp_l); i != arr.end(); ++i) {
+			for (auto i = unit_finder_lower_bound(arr, u->unit_finder_bounding_box.to.y); i != arr.end(); ++i) {
 				if (i->value > new_bb.to.y) break;
 				if (i->u->unit_finder_bounding_box.from.x <= new_bb.to.x && i->u->unit_finder_bounding_box.to.x >= new_bb.from.x) {
 					if (unit_can_collide_with(u, i->u) && u_ground_unit(i->u)) {
@@ -9184,23 +9242,22 @@ struct state_functions {
 	bool pathfinder_find_long_path(pathfinder& pf) const {
 		if (pf.source_region == pf.destination_region) return false;
 
-		struct node_t {
-			node_t* prev = nullptr;
-			xy_fp8 pos;
-			const regions_t::region* region = nullptr;
-			fp8 total_cost{};
-			fp8 estimated_remaining_cost{};
-			fp8 estimated_final_cost{};
-			bool visited = false;
-		};
+		using node_t = pathfinder_long_node;
 		struct cmp_node {
 			bool operator()(const node_t* a, const node_t* b) const {
 				return a->estimated_final_cost < b->estimated_final_cost;
 			}
 		};
-		a_vector<node_t*> open;
+		auto& open = pathfinder_scratch.long_open;
+		open.clear();
 
-		a_list<node_t> all_nodes;
+		// Nodes are referenced by pointer, so all_nodes must never reallocate.
+		// Each search adds at most one node per region, and there are at most
+		// two searches.
+		auto& all_nodes = pathfinder_scratch.long_nodes;
+		all_nodes.clear();
+		size_t max_nodes = game_st.regions.regions.size() * 2;
+		if (all_nodes.capacity() < max_nodes) all_nodes.reserve(max_nodes);
 
 		node_t* goal_node = nullptr;
 
@@ -9214,6 +9271,7 @@ struct state_functions {
 
 			xy_fp8 to_pos = region_pos(to_region);
 
+			if (all_nodes.size() == all_nodes.capacity()) error("pathfinder_find_long_path: too many nodes");
 			all_nodes.emplace_back();
 			node_t* start_node = &all_nodes.back();
 			start_node->pos = region_pos(from_region);
@@ -9248,6 +9306,7 @@ struct state_functions {
 					fp8 total_cost = cur->total_cost + cost;
 					node_t* n = (node_t*)r->pathfinder_node;
 					if (!n) {
+						if (all_nodes.size() == all_nodes.capacity()) error("pathfinder_find_long_path: too many nodes");
 						all_nodes.emplace_back();
 						n = &all_nodes.back();
 						n->prev = cur;
@@ -9437,7 +9496,7 @@ struct state_functions {
 			xy cur_pos_max;
 			xy cur_pos_min;
 
-			std::array<a_vector<regions_t::contour>, 4> local_edges;
+			std::array<a_vector<regions_t::contour>, 4>& local_edges;
 
 			std::array<const regions_t::contour*, 4> nearest_edge;
 
@@ -9448,10 +9507,14 @@ struct state_functions {
 			};
 			static_vector<neighbor_t, 32> neighbors;
 
-			a_vector<rect> visited_areas;
+			a_vector<rect>& visited_areas;
+
+			pf_search(std::array<a_vector<regions_t::contour>, 4>& local_edges, a_vector<rect>& visited_areas) : local_edges(local_edges), visited_areas(visited_areas) {}
 		};
 
-		pf_search w;
+		pf_search w(pathfinder_scratch.local_edges, pathfinder_scratch.visited_areas);
+		for (auto& v : w.local_edges) v.clear();
+		w.visited_areas.clear();
 
 		w.u = pf.u;
 		w.target_unit = pf.target_unit;
@@ -9499,12 +9562,8 @@ struct state_functions {
 		open.push_back(start_node);
 		binary_heap_up(std::prev(open.end()), open.begin(), open.end(), cmp_node());
 
-		struct visited {
-			int x;
-			a_vector<std::pair<int, int>> y;
-		};
-
-		a_vector<visited> pf_area_visited;
+		auto& pf_area_visited = pathfinder_scratch.area_visited;
+		pf_area_visited.clear();
 		pf_area_visited.push_back({0, {}});
 		pf_area_visited.push_back({(int)game_st.map_width, {}});
 
@@ -9638,10 +9697,7 @@ struct state_functions {
 		};
 
 		auto pf_add_local_units = [&]() {
-			auto cmp_l = [&](auto& a, int b) {
-				return a.value < b;
-			};
-			for (auto i = std::lower_bound(st.unit_finder_y.begin(), st.unit_finder_y.end(), w.cur_pos_min.y - w.inner[0] - 1, cmp_l); i != st.unit_finder_y.end(); ++i) {
+			for (auto i = unit_finder_lower_bound(st.unit_finder_y, w.cur_pos_min.y - w.inner[0] - 1); i != st.unit_finder_y.end(); ++i) {
 				auto& bb = i->u->unit_finder_bounding_box;
 				if (i->value >= w.cur_pos.y - w.inner[0]) break;
 				if (i->value == bb.to.y) {
@@ -9658,7 +9714,7 @@ struct state_functions {
 					}
 				}
 			}
-			for (auto i = std::lower_bound(st.unit_finder_x.begin(), st.unit_finder_x.end(), w.cur_pos.x - w.inner[1], cmp_l); i != st.unit_finder_x.end(); ++i) {
+			for (auto i = unit_finder_lower_bound(st.unit_finder_x, w.cur_pos.x - w.inner[1]); i != st.unit_finder_x.end(); ++i) {
 				auto& bb = i->u->unit_finder_bounding_box;
 				if (i->value > w.cur_pos_max.x - w.inner[1] + 1) break;
 				if (i->value == bb.from.x) {
@@ -9675,7 +9731,7 @@ struct state_functions {
 					}
 				}
 			}
-			for (auto i = std::lower_bound(st.unit_finder_y.begin(), st.unit_finder_y.end(), w.cur_pos.y - w.inner[2], cmp_l); i != st.unit_finder_y.end(); ++i) {
+			for (auto i = unit_finder_lower_bound(st.unit_finder_y, w.cur_pos.y - w.inner[2]); i != st.unit_finder_y.end(); ++i) {
 				auto& bb = i->u->unit_finder_bounding_box;
 				if (i->value > w.cur_pos_max.y - w.inner[2] + 1) break;
 				if (i->value == bb.from.y) {
@@ -9692,7 +9748,7 @@ struct state_functions {
 					}
 				}
 			}
-			for (auto i = std::lower_bound(st.unit_finder_x.begin(), st.unit_finder_x.end(), w.cur_pos_min.x - w.inner[3] - 1, cmp_l); i != st.unit_finder_x.end(); ++i) {
+			for (auto i = unit_finder_lower_bound(st.unit_finder_x, w.cur_pos_min.x - w.inner[3] - 1); i != st.unit_finder_x.end(); ++i) {
 				auto& bb = i->u->unit_finder_bounding_box;
 				if (i->value >= w.cur_pos.x - w.inner[3]) break;
 				if (i->value == bb.to.x) {
@@ -10718,6 +10774,7 @@ struct state_functions {
 	}
 
 	bool pathfinder_find(pathfinder& pf, bool short_path_only = false) {
+		OPENBW_PROFILE_SCOPE(*this, pathfinder_find);
 		pf.source_region = get_region_at(pf.source);
 		pf.destination_region = get_region_at(pf.destination);
 		pf.unit_bb = unit_type_inner_bounding_box(pf.u->unit_type);
@@ -12299,7 +12356,7 @@ struct state_functions {
 		return 0;
 	}
 
-	void reveal_sight_at(xy pos, int range, int reveal_to, bool in_air) {
+	void reveal_sight_at_uncached(xy pos, int range, int reveal_to, bool in_air) {
 		int visibility_mask = ~reveal_to;
 		int height_mask = 0;
 		if (!in_air) {
@@ -12326,6 +12383,7 @@ struct state_functions {
 				auto& tile = base_tile[cur.relative_tile_index];
 				tile.visible &= visibility_mask;
 				tile.explored &= visibility_mask;
+				mark_tile_written(&tile - st.tiles.data());
 				vision_propagation[index] = (uint32_t)tile.flags << 16 | (uint32_t)tile.explored << 8 | (uint32_t)tile.visible;
 			}
 			end += sight_vals.ext_masked_count;
@@ -12340,6 +12398,7 @@ struct state_functions {
 				auto& tile = base_tile[cur.relative_tile_index];
 				tile.visible &= visibility_mask;
 				tile.explored &= visibility_mask;
+				mark_tile_written(&tile - st.tiles.data());
 				vision_propagation[index] = (uint32_t)tile.flags << 16 | (uint32_t)tile.explored << 8 | (uint32_t)tile.visible;
 			}
 		} else {
@@ -12353,8 +12412,125 @@ struct state_functions {
 				auto& tile = base_tile[cur->relative_tile_index];
 				tile.visible &= visibility_mask;
 				tile.explored &= visibility_mask;
+				mark_tile_written(&tile - st.tiles.data());
+			}
+		}
+	}
+
+	// Returns the indices of the tiles that reveal_sight_at_uncached reveals.
+	// Tiles that have been revealed always have the reveal_to bits cleared,
+	// so whether vision propagates past a tile only depends on its height
+	// flags, and the result is the same for any non-zero reveal_to.
+	iterators_range<const uint32_t*> sight_footprint(xy pos, int range, bool in_air) const {
+		const auto& sight_vals = game_st.sight_values.at(range);
+		size_t tile_x = (size_t)pos.x / 32;
+		size_t tile_y = (size_t)pos.y / 32;
+		size_t tile_index = tile_x + tile_y*game_st.map_tile_width;
+		int height = in_air ? 3 : get_ground_height_at(pos);
+		uint32_t key = (uint32_t)tile_index << 6 | (uint32_t)range << 2 | (uint32_t)height;
+
+		auto& cache = st.sight_footprint_cache;
+		if (cache.game != &game_st) {
+			cache.entries.clear();
+			cache.tile_indices.clear();
+			cache.game = &game_st;
+		}
+		auto i = cache.entries.find(key);
+		if (i != cache.entries.end()) {
+			++cache.hits;
+			const uint32_t* data = cache.tile_indices.data();
+			return make_iterators_range(data + i->second.first, data + i->second.second);
+		}
+		++cache.misses;
+		if (!cache.max_tile_indices || cache.tile_indices.size() >= cache.max_tile_indices) {
+			cache.entries.clear();
+			cache.tile_indices.clear();
+		}
+		size_t begin = cache.tile_indices.size();
+
+		if (!in_air) {
+			int height_mask = 0;
+			if (height == 2) height_mask = tile_t::flag_very_high;
+			else if (height == 1) height_mask = tile_t::flag_very_high | tile_t::flag_high;
+			else height_mask = tile_t::flag_very_high | tile_t::flag_high | tile_t::flag_middle;
+			const size_t max_width = 11 * 2 + 3;
+			std::array<bool, max_width * max_width> blocked;
+			size_t min_end = sight_vals.min_mask_size;
+			size_t end = min_end + sight_vals.ext_masked_count;
+			for (size_t index = 0; index != end; ++index) {
+				const auto& cur = sight_vals.maskdat[index];
+				blocked[index] = true;
+				if (tile_x + cur.x >= game_st.map_tile_width) continue;
+				if (tile_y + cur.y >= game_st.map_tile_height) continue;
+				if (index >= min_end && blocked[cur.prev]) {
+					if (cur.prev2 == (size_t)~0 || blocked[cur.prev2]) continue;
+				}
+				size_t index_here = tile_index + cur.relative_tile_index;
+				blocked[index] = (st.tiles[index_here].flags & height_mask) != 0;
+				cache.tile_indices.push_back((uint32_t)index_here);
+			}
+		} else {
+			auto* cur = sight_vals.maskdat.data();
+			auto* end = cur + sight_vals.ext_masked_count;
+			for (; cur != end; ++cur) {
+				if (tile_x + cur->x >= game_st.map_tile_width) continue;
+				if (tile_y + cur->y >= game_st.map_tile_height) continue;
+				cache.tile_indices.push_back((uint32_t)(tile_index + cur->relative_tile_index));
 			}
 		}
+		if (cache.max_tile_indices) cache.entries[key] = {begin, cache.tile_indices.size()};
+		const uint32_t* data = cache.tile_indices.data();
+		return make_iterators_range(data + begin, data + cache.tile_indices.size());
+	}
+
+	// Runs reveal_sight_at_uncached and the cached footprint on the same tiles
+	// and fails if they produce different results.
+	void reveal_sight_at_cross_check(xy pos, int range, int reveal_to, bool in_air) {
+		const auto& sight_vals = game_st.sight_values.at(range);
+		size_t tile_x = (size_t)pos.x / 32;
+		size_t tile_y = (size_t)pos.y / 32;
+		size_t tile_index = tile_x + tile_y*game_st.map_tile_width;
+		a_vector<std::pair<size_t, tile_t>> saved;
+		auto* end = sight_vals.maskdat.data() + sight_vals.min_mask_size + sight_vals.ext_masked_count;
+		for (auto* cur = sight_vals.maskdat.data(); cur != end; ++cur) {
+			if (tile_x + cur->x >= game_st.map_tile_width) continue;
+			if (tile_y + cur->y >= game_st.map_tile_height) continue;
+			size_t index = tile_index + cur->relative_tile_index;
+			saved.emplace_back(index, st.tiles[index]);
+		}
+		reveal_sight_at_uncached(pos, range, reveal_to, in_air);
+		a_vector<tile_t> expected;
+		for (auto& v : saved) {
+			expected.push_back(st.tiles[v.first]);
+			st.tiles[v.first] = v.second;
+			mark_tile_written(v.first);
+		}
+		reveal_sight_at_cached(pos, range, reveal_to, in_air);
+		for (size_t i = 0; i != saved.size(); ++i) {
+			auto& t = st.tiles[saved[i].first];
+			auto& e = expected[i];
+			if (t.visible != e.visible || t.explored != e.explored || t.flags != e.flags) {
+				error("reveal_sight_at: cached footprint differs at tile %d (pos %d %d, range %d, reveal_to %d, in_air %d)", saved[i].first, pos.x, pos.y, range, reveal_to, in_air);
+			}
+		}
+	}
+
+	void reveal_sight_at_cached(xy pos, int range, int reveal_to, bool in_air) {
+		uint8_t visibility_mask = (uint8_t)~reveal_to;
+		if (visibility_mask == 0xff) return;
+		tile_t* tiles = st.tiles.data();
+		for (uint32_t index : sight_footprint(pos, range, in_air)) {
+			auto& tile = tiles[index];
+			tile.visible &= visibility_mask;
+			tile.explored &= visibility_mask;
+			mark_tile_written(index);
+		}
+	}
+
+	void reveal_sight_at(xy pos, int range, int reveal_to, bool in_air) {
+		OPENBW_PROFILE_SCOPE(*this, reveal_sight_at);
+		if (cross_check_sight_footprints) reveal_sight_at_cross_check(pos, range, reveal_to, in_air);
+		else reveal_sight_at_cached(pos, range, reveal_to, in_air);
 	}
 
 	void refresh_unit_vision(unit_t* u) {
@@ -13015,21 +13191,13 @@ struct state_functions {
 			return;
 		}
 		std::array<int, 9> lut{1, 3, 5, 6, 7, 8, 9, 9, 9};
-		st.creep_life.recede_timer = lut.at(st.creep_life.free_list_size >> 7);
+		st.creep_life.recede_timer = lut.at(st.creep_life.free_list_size() >> 7);
 
 		for (size_t i = 0; i != st.creep_life.lists.size(); ++i) {
 			auto& list = st.creep_life.lists[i];
-			auto& size = st.creep_life.lists_size[i];
 			if (list.empty()) continue;
-			auto it = list.begin();
-			std::advance(it, lcg_rand(27, 0, (int)size - 1));
-			auto* v = &*it;
-			list.remove(*v);
-			--size;
-			st.creep_life.table.remove(v);
-			v->n_neighboring_creep_tiles = 9;
-			st.creep_life.free_list.push_front(*v);
-			++st.creep_life.free_list_size;
+			auto* v = st.creep_life.list_at(i, lcg_rand(27, 0, (int)list.size - 1));
+			st.creep_life.remove(v);
 
 			size_t index = v->tile_pos.y * game_st.map_tile_width + v->tile_pos.x;
 			st.tiles[index].flags &= ~tile_t::flag_creep_receding;
@@ -13075,9 +13243,7 @@ struct state_functions {
 		}
 	}
 
-	void process_frame() {
-		recede_creep();
-
+	void update_tiles_timer() {
 		if (st.update_tiles_countdown == 0) st.update_tiles_countdown = 100;
 		--st.update_tiles_countdown;
 		update_tiles = st.update_tiles_countdown == 0;
@@ -13086,8 +13252,13 @@ struct state_functions {
 			for (auto& v : st.tiles) {
 				v.visible = 0xff;
 			}
+			std::fill(st.tile_page_ids.begin(), st.tile_page_ids.end(), 0);
 		}
+	}
 
+	void process_frame() {
+		recede_creep();
+		update_tiles_timer();
 		update_units();
 		update_bullets();
 		update_thingies();
@@ -14703,11 +14874,17 @@ struct state_functions {
 			p += n;
 		};
 
+		// Jump targets are resolved when the iscript is loaded and are never
+		// null, so the program counter only needs to be checked on entry and
+		// on return.
+		if (p == program_data) error("iscript: program counter is null");
+
+		OPENBW_PROFILE_SEQUENCE(*this, iscript_opcodes);
+
 		while (true) {
 			using namespace iscript_opcodes;
-			size_t pc = p - program_data;
-			if (pc == 0) error("iscript: program counter is null");
 			int opc = *p++ - 0x808091;
+			OPENBW_PROFILE_SEQUENCE_NEXT(iscript_opcodes, opc);
 			int a, b, c;
 			switch (opc) {
 			case opc_playfram:
@@ -15033,6 +15210,7 @@ struct state_functions {
 				p = program_data + a;
 				break;
 			case opc_return:
+				if (!state.return_address) error("iscript: program counter is null");
 				p = program_data + state.return_address;
 				break;
 
@@ -15473,6 +15651,20 @@ struct state_functions {
 		if (st.unit_counts[u->owner][u->unit_type->id] < 0) st.unit_counts[u->owner][u->unit_type->id] = 0;
 	}
 
+	static state::unit_finder_container::iterator unit_finder_lower_bound(state::unit_finder_container& vec, int value) {
+		auto cmp_l = [&](const state::unit_finder_entry& a, int b) {
+			return a.value < b;
+		};
+		return std::lower_bound(vec.begin(), vec.end(), value, cmp_l);
+	}
+
+	static state::unit_finder_container::iterator unit_finder_upper_bound(state::unit_finder_container& vec, int value) {
+		auto cmp_u = [&](int a, const state::unit_finder_entry& b) {
+			return a < b.value;
+		};
+		return std::upper_bound(vec.begin(), vec.end(), value, cmp_u);
+	}
+
 	void unit_finder_insert(unit_t* u) {
 		if (ut_turret(u)) return;
 
@@ -15490,10 +15682,7 @@ struct state_functions {
 		if (u->unit_finder_bounding_box.from.x == -1) return;
 		if (unit_finder_search_index) error("attempt to modify unit finder while search is active");
 		auto remove = [&](auto& vec, int value) {
-			auto cmp_l = [&](auto& a, int b) {
-				return a.value < b;
-			};
-			auto i = std::lower_bound(vec.begin(), vec.end(), value, cmp_l);
+			auto i = unit_finder_lower_bound(vec, value);
 			while (i->u != u) ++i;
 			vec.erase(i);
 		};
@@ -15507,13 +15696,8 @@ struct state_functions {
 	void unit_finder_insert(unit_t* u, rect bb) {
 		if (unit_finder_search_index) error("attempt to modify unit finder while search is active");
 		auto insert = [&](auto& vec, int from_value, int to_value) {
-			auto cmp_l = [&](auto& a, int b) {
-				return a.value < b;
-			};
-			auto from_i = std::lower_bound(vec.begin(), vec.end(), from_value, cmp_l);
-			vec.insert(from_i, {u, from_value});
-			auto to_i = std::lower_bound(vec.begin(), vec.end(), to_value, cmp_l);
-			vec.insert(to_i, {u, to_value});
+			vec.insert(unit_finder_lower_bound(vec, from_value), {u, from_value});
+			vec.insert(unit_finder_lower_bound(vec, to_value), {u, to_value});
 		};
 		insert(st.unit_finder_x, bb.from.x, bb.to.x);
 		insert(st.unit_finder_y, bb.from.y, bb.to.y);
@@ -15523,10 +15707,7 @@ struct state_functions {
 		if (unit_finder_search_index) error("attempt to modify unit finder while search is active");
 		auto reinsert = [&](auto& vec, int old_value, int new_value) {
 			if (old_value == new_value) return;
-			auto cmp_l = [&](auto& a, int b) {
-				return a.value < b;
-			};
-			auto i = std::lower_bound(vec.begin(), vec.end(), old_value, cmp_l);
+			auto i = unit_finder_lower_bound(vec, old_value);
 			while (i->u != u) ++i;
 			if (new_value > old_value) {
 				auto ni = std::next(i);
@@ -15575,9 +15756,9 @@ struct state_functions {
 			using iterator_category = std::forward_iterator_tag;
 		private:
 			const unit_finder_search* search;
-			a_vector<state::unit_finder_entry>::iterator i;
+			state::unit_finder_container::iterator i;
 			friend unit_finder_search;
-			iterator(const unit_finder_search* search, a_vector<state::unit_finder_entry>::iterator i) : search(search), i(i) {}
+			iterator(const unit_finder_search* search, state::unit_finder_container::iterator i) : search(search), i(i) {}
 			bool in_bounds() {
 				unit_t* u = i->u;
 				if (u->unit_finder_bounding_box.from.x >= search->area.to.x) return false;
@@ -15621,18 +15802,16 @@ struct state_functions {
 	private:
 		friend state_functions;
 		const state_functions& funcs;
-		a_vector<state::unit_finder_entry>::iterator i_begin;
-		a_vector<state::unit_finder_entry>::iterator i_end;
+		state::unit_finder_container::iterator i_begin;
+		state::unit_finder_container::iterator i_end;
 		rect area;
 		size_t search_index;
 		unit_finder_search(const state_functions& funcs, rect area, bool expand) : funcs(funcs), area(area) {
+			OPENBW_PROFILE_SCOPE(funcs, unit_finder_search);
 			if (funcs.unit_finder_search_index == 4) error("unit_finder_search maximum recursive depth reached");
 			search_index = funcs.unit_finder_search_index;
 			++funcs.unit_finder_search_index;
 
-			auto cmp_l = [&](auto& a, int b) {
-				return a.value < b;
-			};
 			int begin_x = area.from.x;
 			int end_x = area.to.x;
 			if (expand) {
@@ -15644,8 +15823,8 @@ struct state_functions {
 					++this->area.to.y;
 				}
 			}
-			i_begin = std::lower_bound(funcs.st.unit_finder_x.begin(), funcs.st.unit_finder_x.end(), begin_x, cmp_l);
-			i_end = std::lower_bound(funcs.st.unit_finder_x.begin(), funcs.st.unit_finder_x.end(), end_x, cmp_l);
+			i_begin = unit_finder_lower_bound(funcs.st.unit_finder_x, begin_x);
+			i_end = unit_finder_lower_bound(funcs.st.unit_finder_x, end_x);
 		}
 	public:
 		~unit_finder_search() {
@@ -15692,31 +15871,27 @@ struct state_functions {
 		return nullptr;
 	}
 
+	// Walks outward from the given unit finder positions, calling visit for
+	// every unit whose sprite position is within search_area. Whenever visit
+	// lowers distance_bound, the area is shrunk to that distance around pos.
 	template<typename F, typename i_T>
-	unit_t* find_nearest_unit(xy pos, rect search_area, i_T left_i, i_T up_i, i_T right_i, i_T down_i, F&& predicate) const {
+	void unit_finder_walk_outward(xy pos, rect search_area, i_T left_i, i_T up_i, i_T right_i, i_T down_i, int& distance_bound, F&& visit) const {
 
 		const auto x_begin = st.unit_finder_x.begin();
 		const auto y_begin = st.unit_finder_y.begin();
 		const auto x_end = st.unit_finder_x.end();
 		const auto y_end = st.unit_finder_y.end();
 
-		int best_distance = xy_length({std::max(pos.x - search_area.from.x, search_area.to.x - pos.x), std::max(pos.y - search_area.from.y, search_area.to.y - pos.y)});
-		unit_t* best_unit = nullptr;
-
 		while (true) {
 			bool done = true;
-			int prev_best_distance = best_distance;
+			int prev_distance_bound = distance_bound;
 			if (left_i != x_begin) {
 				--left_i;
 				done = false;
 				unit_t* u = left_i->u;
 				if (u->sprite->position.x >= search_area.from.x) {
 					if (u->sprite->position.y >= search_area.from.y && u->sprite->position.y < search_area.to.y) {
-						int d = xy_length(pos - u->sprite->position);
-						if (d < best_distance && predicate(u)) {
-							best_distance = d;
-							best_unit = u;
-						}
+						visit(u);
 					}
 				} else {
 					left_i = x_begin;
@@ -15727,11 +15902,7 @@ struct state_functions {
 				unit_t* u = right_i->u;
 				if (u->sprite->position.x < search_area.to.x) {
 					if (u->sprite->position.y >= search_area.from.y && u->sprite->position.y < search_area.to.y) {
-						int d = xy_length(pos - u->sprite->position);
-						if (d < best_distance && predicate(u)) {
-							best_distance = d;
-							best_unit = u;
-						}
+						visit(u);
 					}
 					++right_i;
 				} else {
@@ -15744,11 +15915,7 @@ struct state_functions {
 				unit_t* u = up_i->u;
 				if (u->sprite->position.y >= search_area.from.y) {
 					if (u->sprite->position.x >= search_area.from.x && u->sprite->position.x < search_area.to.x) {
-						int d = xy_length(pos - u->sprite->position);
-						if (d < best_distance && predicate(u)) {
-							best_distance = d;
-							best_unit = u;
-						}
+						visit(u);
 					}
 				} else {
 					up_i = y_begin;
@@ -15759,50 +15926,32 @@ struct state_functions {
 				unit_t* u = down_i->u;
 				if (u->sprite->position.y < search_area.to.y) {
 					if (u->sprite->position.x >= search_area.from.x && u->sprite->position.x < search_area.to.x) {
-						int d = xy_length(pos - u->sprite->position);
-						if (d < best_distance && predicate(u)) {
-							best_distance = d;
-							best_unit = u;
-						}
+						visit(u);
 					}
 					++down_i;
 				} else {
 					down_i = y_end;
 				}
 			}
-			if (best_distance != prev_best_distance) {
-				if (search_area.from.x < pos.x - best_distance) search_area.from.x = pos.x - best_distance;
-				if (search_area.from.y < pos.y - best_distance) search_area.from.y = pos.y - best_distance;
-				if (search_area.to.x > pos.x + best_distance) search_area.to.x = pos.x + best_distance;
-				if (search_area.to.y > pos.y + best_distance) search_area.to.y = pos.y + best_distance;
+			if (distance_bound != prev_distance_bound) {
+				if (search_area.from.x < pos.x - distance_bound) search_area.from.x = pos.x - distance_bound;
+				if (search_area.from.y < pos.y - distance_bound) search_area.from.y = pos.y - distance_bound;
+				if (search_area.to.x > pos.x + distance_bound) search_area.to.x = pos.x + distance_bound;
+				if (search_area.to.y > pos.y + distance_bound) search_area.to.y = pos.y + distance_bound;
 			}
 			if (done) break;
 		}
-		return best_unit;
 	}
 
 	template<typename F>
-	unit_t* find_nearest_unit(xy pos, rect search_area, F&& predicate) const {
-
-		auto cmp_l = [&](auto& a, int b) {
-			return a.value < b;
-		};
-		auto x_i = std::lower_bound(st.unit_finder_x.begin(), st.unit_finder_x.end(), pos.x, cmp_l);
-		auto y_i = std::lower_bound(st.unit_finder_y.begin(), st.unit_finder_y.end(), pos.y, cmp_l);
-
-		return find_nearest_unit(pos, search_area, x_i, y_i, x_i, y_i, predicate);
-	}
-
-	template<typename F>
-	unit_t* find_nearest_unit(const unit_t* u, rect search_area, F&& predicate) const {
+	void unit_finder_walk_outward(const unit_t* u, rect search_area, int& distance_bound, F&& visit) const {
 		if (us_hidden(u)) {
-			return find_nearest_unit(u->sprite->position, search_area, std::forward<F>(predicate));
+			auto x_i = unit_finder_lower_bound(st.unit_finder_x, u->sprite->position.x);
+			auto y_i = unit_finder_lower_bound(st.unit_finder_y, u->sprite->position.y);
+			unit_finder_walk_outward(u->sprite->position, search_area, x_i, y_i, x_i, y_i, distance_bound, std::forward<F>(visit));
 		} else {
-			auto cmp_l = [&](auto& a, int b) {
-				return a.value < b;
-			};
 			auto get = [&](auto& vec, int value) {
-				auto i = std::lower_bound(vec.begin(), vec.end(), value, cmp_l);
+				auto i = unit_finder_lower_bound(vec, value);
 				while (i->u != u) ++i;
 				return i;
 			};
@@ -15810,10 +15959,92 @@ struct state_functions {
 			auto up_i = get(st.unit_finder_y, u->unit_finder_bounding_box.to.y);
 			auto right_i = std::next(get(st.unit_finder_x, u->unit_finder_bounding_box.from.x));
 			auto down_i = std::next(get(st.unit_finder_y, u->unit_finder_bounding_box.from.y));
-			return find_nearest_unit(u->sprite->position, search_area, left_i, up_i, right_i, down_i, std::forward<F>(predicate));
+			unit_finder_walk_outward(u->sprite->position, search_area, left_i, up_i, right_i, down_i, distance_bound, std::forward<F>(visit));
 		}
 	}
 
+	template<typename F>
+	void unit_finder_walk_outward(xy pos, rect search_area, int& distance_bound, F&& visit) const {
+		auto x_i = unit_finder_lower_bound(st.unit_finder_x, pos.x);
+		auto y_i = unit_finder_lower_bound(st.unit_finder_y, pos.y);
+		unit_finder_walk_outward(pos, search_area, x_i, y_i, x_i, y_i, distance_bound, std::forward<F>(visit));
+	}
+
+	int nearest_unit_initial_distance(xy pos, rect search_area) const {
+		return xy_length({std::max(pos.x - search_area.from.x, search_area.to.x - pos.x), std::max(pos.y - search_area.from.y, search_area.to.y - pos.y)});
+	}
+
+	template<typename pos_T, typename F>
+	unit_t* find_nearest_unit_impl(xy pos, const pos_T& from, rect search_area, F&& predicate) const {
+		int best_distance = nearest_unit_initial_distance(pos, search_area);
+		unit_t* best_unit = nullptr;
+		unit_finder_walk_outward(from, search_area, best_distance, [&](unit_t* u) {
+			xy rel = pos - u->sprite->position;
+			// xy_length is never less than the larger component, so most
+			// candidates can be rejected without computing it.
+			if (std::max(std::abs(rel.x), std::abs(rel.y)) >= best_distance) return;
+			int d = xy_length(rel);
+			if (d < best_distance && predicate(u)) {
+				best_distance = d;
+				best_unit = u;
+			}
+		});
+		return best_unit;
+	}
+
+	template<typename F>
+	unit_t* find_nearest_unit(xy pos, rect search_area, F&& predicate) const {
+		return find_nearest_unit_impl(pos, pos, search_area, predicate);
+	}
+
+	template<typename F>
+	unit_t* find_nearest_unit(const unit_t* u, rect search_area, F&& predicate) const {
+		return find_nearest_unit_impl(u->sprite->position, u, search_area, predicate);
+	}
+
+	template<typename pos_T, typename F>
+	a_vector<unit_t*> find_nearest_units_impl(xy pos, const pos_T& from, rect search_area, size_t count, F&& predicate) const {
+		a_vector<std::pair<int, unit_t*>> nearest;
+		if (count == 0) return {};
+		nearest.reserve(count);
+		int distance_bound = nearest_unit_initial_distance(pos, search_area);
+		unit_finder_walk_outward(from, search_area, distance_bound, [&](unit_t* u) {
+			xy rel = pos - u->sprite->position;
+			if (std::max(std::abs(rel.x), std::abs(rel.y)) >= distance_bound) return;
+			int d = xy_length(rel);
+			if (d >= distance_bound) return;
+			for (auto& v : nearest) {
+				if (v.second == u) return;
+			}
+			if (!predicate(u)) return;
+			size_t index = std::upper_bound(nearest.begin(), nearest.end(), d, [&](int a, auto& b) {
+				return a < b.first;
+			}) - nearest.begin();
+			if (nearest.size() == count) nearest.pop_back();
+			nearest.insert(nearest.begin() + index, {d, u});
+			if (nearest.size() == count) distance_bound = nearest.back().first;
+		});
+		a_vector<unit_t*> r;
+		r.reserve(nearest.size());
+		for (auto& v : nearest) r.push_back(v.second);
+		return r;
+	}
+
+	// Returns up to count units within search_area for which predicate
+	// returns true, nearest first (by xy_length of the sprite positions).
+	// Units at equal distance are in the order they were found. The search
+	// is the same outward walk as find_nearest_unit, and with a count of 1
+	// it returns the same unit.
+	template<typename F>
+	a_vector<unit_t*> find_nearest_units(xy pos, rect search_area, size_t count, F&& predicate) const {
+		return find_nearest_units_impl(pos, pos, search_area, count, predicate);
+	}
+
+	template<typename F>
+	a_vector<unit_t*> find_nearest_units(const unit_t* u, rect search_area, size_t count, F&& predicate) const {
+		return find_nearest_units_impl(u->sprite->position, u, search_area, count, predicate);
+	}
+
 	bool unit_is_factory(const unit_t* u) const {
 		if (unit_is(u, UnitTypes::Terran_Command_Center)) return true;
 		if (unit_is(u, UnitTypes::Terran_Barracks)) return true;
@@ -19375,6 +19606,7 @@ struct state_functions {
 		size_t index = tile_pos.y * game_st.map_tile_width + tile_pos.x;
 		if (has_creep) st.tiles[index].flags |= tile_t::flag_has_creep;
 		else st.tiles[index].flags &= ~tile_t::flag_has_creep;
+		mark_tile_written(index);
 
 		size_t width = game_st.map_tile_width;
 		size_t height = game_st.map_tile_height;
@@ -19385,16 +19617,11 @@ struct state_functions {
 		auto test = [&]() {
 			if (~st.tiles[index].flags & tile_t::flag_has_creep) return;
 			if (~st.tiles[index].flags & tile_t::flag_creep_receding) return;
-			auto* v = st.creep_life.table.find(tile_pos);
+			auto* v = st.creep_life.find(tile_pos);
 			if (!v) error("set_tile_creep: receding creep not found");
 			size_t n_neighbors = count_neighboring_creep_tiles(tile_pos);
 			if (v->n_neighboring_creep_tiles == n_neighbors) return;
-
-			st.creep_life.lists[v->n_neighboring_creep_tiles].remove(*v);
-			--st.creep_life.lists_size[v->n_neighboring_creep_tiles];
-			v->n_neighboring_creep_tiles = n_neighbors;
-			st.creep_life.lists[n_neighbors].push_front(*v);
-			++st.creep_life.lists_size[n_neighbors];
+			st.creep_life.set_n_neighbors(v, n_neighbors);
 		};
 		if (tile_pos.y < height) {
 			if (tile_pos.x < width) test();
@@ -19544,62 +19771,76 @@ struct state_copier {
 	const state& st;
 	state& r;
 	state_functions funcs;
+	bool copy_tiles = true;
 	state_copier(const state&st, state& r) : st(st), r(r), funcs(r) {}
 
-	std::array<bool, 1700> unit_copied{};
-	std::array<bool, 100> bullet_copied{};
-	std::array<bool, 2500> sprite_copied{};
-	std::array<bool, 5000> image_copied{};
-	std::array<bool, 2000> order_copied{};
-	unit_t* unit(const unit_t* v) {
-		size_t index = v->index;
-		auto* u = r.units_container.get(index, false);
-		if (!unit_copied[index]) {
-			unit_copied[index] = true;
-			memcpy(u, v, sizeof(*v));
-			remap_sprite(u->sprite);
-			remap_unit(u->move_target.unit);
-			remap_unit(u->order_target.unit);
-			remap_unit(u->subunit);
-			assemble(u->order_queue, v->order_queue, &state_copier::order);
-			remap_unit(u->auto_target_unit);
-			remap_unit(u->connected_unit);
-			new (&u->build_queue) static_vector<const unit_type_t*, 5>(v->build_queue);
-			if (u->unit_type) {
-				if (funcs.unit_is(u, UnitTypes::Protoss_Interceptor) || funcs.unit_is(u, UnitTypes::Protoss_Scarab)) {
-					remap_unit(u->fighter.parent);
-				} else if (funcs.unit_is_carrier(u)) {
-					assemble(u->carrier.inside_units, v->carrier.inside_units, &state_copier::unit);
-					assemble(u->carrier.outside_units, v->carrier.outside_units, &state_copier::unit);
-				} else if (funcs.unit_is_reaver(u)) {
-					assemble(u->reaver.inside_units, v->reaver.inside_units, &state_copier::unit);
-					assemble(u->reaver.outside_units, v->reaver.outside_units, &state_copier::unit);
-				} else if (funcs.unit_is_ghost(u)) {
-					u->ghost.nuke_dot = thingy(u->ghost.nuke_dot);
-				}
-			}
-			remap_unit(u->worker.powerup);
-			remap_unit(u->worker.target_resource_unit);
-			remap_unit(u->worker.gather_target);
-			remap_unit(u->building.addon);
-			remap_unit(u->building.rally.unit);
-			if (u->unit_type) {
-				if (funcs.ut_resource(u)) {
-					assemble(u->building.resource.gather_queue, v->building.resource.gather_queue, &state_copier::unit);
-				} else if (funcs.unit_is_nydus(u)) {
-					remap_unit(u->building.nydus.exit);
-				} else if (funcs.unit_is(u, UnitTypes::Terran_Nuclear_Silo)) {
-					remap_unit(u->building.silo.nuke);
-				} else if (funcs.unit_is(u, UnitTypes::Protoss_Pylon)) {
-					remap_sprite(u->building.pylon.psi_field_sprite);
-				}
-			}
-			remap_unit(u->current_build_unit);
-			u->path = path(u->path);
-			remap_unit(u->irradiated_by);
+	// Objects are copied in bulk, one allocation_granularity block at a
+	// time, and the pointers in the copies are then remapped by index, since
+	// an object has the same index in both states. The remapping visits every
+	// slot, including objects that have never been used, which relies on
+	// object_container::grow zeroing new objects.
+	// The objects only hold plain values, pointers and intrusive links, so
+	// copying their bytes is the same as copy-assigning them.
+	template<typename T, size_t max_size, size_t allocation_granularity>
+	void copy_objects(object_container<T, max_size, allocation_granularity>& dst, const object_container<T, max_size, allocation_granularity>& src) {
+		dst.list.resize(src.list.size());
+		for (size_t i = 0; i != src.list.size(); ++i) {
+			memcpy((void*)dst.list[i].data(), (const void*)src.list[i].data(), sizeof(src.list[i]));
+		}
+		dst.size = src.size;
+	}
+	template<typename T, size_t max_size, size_t allocation_granularity, typename F>
+	void remap_objects(object_container<T, max_size, allocation_granularity>& dst, const object_container<T, max_size, allocation_granularity>& src, F&& f) {
+		for (size_t i = 0; i != src.size; ++i) {
+			f(&dst.list[i / allocation_granularity][i % allocation_granularity], &src.list[i / allocation_granularity][i % allocation_granularity]);
+		}
+	}
+
+	void remap_unit_members(unit_t* u, const unit_t* v) {
+		remap_sprite(u->sprite);
+		remap_unit(u->move_target.unit);
+		remap_unit(u->order_target.unit);
+		remap_unit(u->subunit);
+		assemble(u->order_queue, v->order_queue, &state_copier::order);
+		remap_unit(u->auto_target_unit);
+		remap_unit(u->connected_unit);
+		new (&u->build_queue) static_vector<const unit_type_t*, 5>(v->build_queue);
+		if (u->unit_type) {
+			if (funcs.unit_is(u, UnitTypes::Protoss_Interceptor) || funcs.unit_is(u, UnitTypes::Protoss_Scarab)) {
+				remap_unit(u->fighter.parent);
+			} else if (funcs.unit_is_carrier(u)) {
+				assemble(u->carrier.inside_units, v->carrier.inside_units, &state_copier::unit);
+				assemble(u->carrier.outside_units, v->carrier.outside_units, &state_copier::unit);
+			} else if (funcs.unit_is_reaver(u)) {
+				assemble(u->reaver.inside_units, v->reaver.inside_units, &state_copier::unit);
+				assemble(u->reaver.outside_units, v->reaver.outside_units, &state_copier::unit);
+			} else if (funcs.unit_is_ghost(u)) {
+				u->ghost.nuke_dot = thingy(u->ghost.nuke_dot);
+			}
+		}
+		remap_unit(u->worker.powerup);
+		remap_unit(u->worker.target_resource_unit);
+		remap_unit(u->worker.gather_target);
+		remap_unit(u->building.addon);
+		remap_unit(u->building.rally.unit);
+		if (u->unit_type) {
+			if (funcs.ut_resource(u)) {
+				assemble(u->building.resource.gather_queue, v->building.resource.gather_queue, &state_copier::unit);
+			} else if (funcs.unit_is_nydus(u)) {
+				remap_unit(u->building.nydus.exit);
+			} else if (funcs.unit_is(u, UnitTypes::Terran_Nuclear_Silo)) {
+				remap_unit(u->building.silo.nuke);
+			} else if (funcs.unit_is(u, UnitTypes::Protoss_Pylon)) {
+				remap_sprite(u->building.pylon.psi_field_sprite);
+			}
+		}
+		remap_unit(u->current_build_unit);
+		u->path = path(u->path);
+		remap_unit(u->irradiated_by);
+	}
 
-		}
-		return u;
+	unit_t* unit(const unit_t* v) {
+		return r.units_container.get(v->index, false);
 	}
 	template<typename T>
 	void remap_unit(T& v) {
@@ -19607,30 +19848,11 @@ struct state_copier {
 	}
 	bullet_t* bullet(const bullet_t* v) {
 		if (!v) return nullptr;
-		size_t index = v->index;
-		auto* rv = r.bullets_container.get(index, false);
-		if (!bullet_copied[index]) {
-			bullet_copied[index] = true;
-			memcpy(rv, v, sizeof(*v));
-			remap_sprite(rv->sprite);
-			remap_unit(rv->move_target.unit);
-			remap_unit(rv->bullet_target);
-			remap_unit(rv->bullet_owner_unit);
-			remap_unit(rv->prev_bounce_unit);
-		}
-		return rv;
+		return r.bullets_container.get(v->index, false);
 	}
 	sprite_t* sprite(const sprite_t* v) {
 		if (!v) return nullptr;
-		size_t index = v->index;
-		auto* rv = r.sprites_container.get(index, false);
-		if (!sprite_copied[index]) {
-			sprite_copied[index] = true;
-			memcpy(rv, v, sizeof(*v));
-			remap_image(rv->main_image);
-			assemble(rv->images, v->images, &state_copier::image);
-		}
-		return rv;
+		return r.sprites_container.get(v->index, false);
 	}
 	template<typename T>
 	void remap_sprite(T& v) {
@@ -19638,14 +19860,7 @@ struct state_copier {
 	}
 	image_t* image(const image_t* v) {
 		if (!v) return nullptr;
-		size_t index = v->index;
-		auto* rv = r.images_container.get(index, false);
-		if (!image_copied[index]) {
-			image_copied[index] = true;
-			*rv = *v;
-			remap_sprite(rv->sprite);
-		}
-		return rv;
+		return r.images_container.get(v->index, false);
 	}
 	template<typename T>
 	void remap_image(T& v) {
@@ -19653,39 +19868,44 @@ struct state_copier {
 	}
 	order_t* order(const order_t* v) {
 		if (!v) return nullptr;
-		size_t index = v->index;
-		auto* rv = r.orders_container.get(index, false);
-		if (!order_copied[index]) {
-			order_copied[index] = true;
-			*rv = *v;
-			remap_unit(rv->target.unit);
-		}
-		return rv;
+		return r.orders_container.get(v->index, false);
 	}
 	template<typename T>
 	void remap_order(T& v) {
 		if (v) v = order(v);
 	}
-	a_unordered_map<const path_t*, path_t*> path_remap;
+
+	// Paths and thingies have no index; they are copied as whole lists and
+	// looked up by their address in the source list.
+	template<typename T>
+	struct list_remap {
+		a_vector<std::pair<const T*, T*>> map;
+		void copy(a_list<T>& dst, const a_list<T>& src) {
+			dst = src;
+			map.clear();
+			map.reserve(src.size());
+			auto di = dst.begin();
+			for (auto& v : src) {
+				map.emplace_back(&v, &*di);
+				++di;
+			}
+			std::sort(map.begin(), map.end());
+		}
+		T* operator()(const T* v) const {
+			auto i = std::lower_bound(map.begin(), map.end(), std::make_pair(v, (T*)nullptr));
+			if (i == map.end() || i->first != v) error("state_copier: object not found");
+			return i->second;
+		}
+	};
+	list_remap<path_t> path_remap;
 	path_t* path(const path_t* v) {
 		if (!v) return nullptr;
-		auto*& rv = path_remap[v];
-		if (!rv) {
-			r.paths.emplace_back(*v);
-			rv = &r.paths.back();
-		}
-		return rv;
+		return path_remap(v);
 	}
-	a_unordered_map<const thingy_t*, thingy_t*> thingy_remap;
+	list_remap<thingy_t> thingy_remap;
 	thingy_t* thingy(const thingy_t* v) {
 		if (!v) return nullptr;
-		auto*& rv = thingy_remap[v];
-		if (!rv) {
-			r.thingies.emplace_back(*v);
-			rv = &r.thingies.back();
-			remap_sprite(rv->sprite);
-		}
-		return rv;
+		return thingy_remap(v);
 	}
 	template<typename list_T, typename F>
 	void assemble(list_T& dst_list, const list_T& src_list, F&& func) {
@@ -19698,6 +19918,37 @@ struct state_copier {
 
 	void operator()() {
 		(state_base_copyable&)r = (state_base_copyable&)st;
+		if (copy_tiles) (state_base_tiles&)r = (state_base_tiles&)st;
+
+		copy_objects(r.units_container, st.units_container);
+		copy_objects(r.bullets_container, st.bullets_container);
+		copy_objects(r.sprites_container, st.sprites_container);
+		copy_objects(r.images_container, st.images_container);
+		copy_objects(r.orders_container, st.orders_container);
+		path_remap.copy(r.paths, st.paths);
+		thingy_remap.copy(r.thingies, st.thingies);
+
+		remap_objects(r.units_container, st.units_container, [&](unit_t* u, const unit_t* v) {
+			remap_unit_members(u, v);
+		});
+		remap_objects(r.bullets_container, st.bullets_container, [&](bullet_t* b, const bullet_t*) {
+			remap_sprite(b->sprite);
+			remap_unit(b->move_target.unit);
+			remap_unit(b->bullet_target);
+			remap_unit(b->bullet_owner_unit);
+			remap_unit(b->prev_bounce_unit);
+		});
+		remap_objects(r.sprites_container, st.sprites_container, [&](sprite_t* s, const sprite_t* v) {
+			remap_image(s->main_image);
+			assemble(s->images, v->images, &state_copier::image);
+		});
+		remap_objects(r.images_container, st.images_container, [&](image_t* i, const image_t*) {
+			remap_sprite(i->sprite);
+		});
+		remap_objects(r.orders_container, st.orders_container, [&](order_t* o, const order_t*) {
+			remap_unit(o->target.unit);
+		});
+		for (auto& v : r.thingies) remap_sprite(v.sprite);
 
 		assemble(r.free_thingies, st.free_thingies, &state_copier::thingy);
 		assemble(r.active_thingies, st.active_thingies, &state_copier::thingy);
@@ -19746,6 +19997,12 @@ static inline state copy_state(const state& st) {
 	return r;
 }
 
+// Copies st into r, reusing the memory r already has. This is cheaper than
+// copy_state(st) when taking many snapshots.
+static inline void copy_state(const state& st, state& r) {
+	state_copier(st, r)();
+}
+
 
 struct game_load_functions : state_functions {
 
@@ -19753,6 +20010,10 @@ struct game_load_functions : state_functions {
 
 	game_state& game_st = *st.game;
 
+	// If set, load_map_file looks up the scenario here before opening the
+	// map file.
+	data_loading::decompressed_file_cache* map_file_cache = nullptr;
+
 	struct setup_info_t {
 		std::array<bool, 12> create_melee_units_for_player{};
 		int victory_condition = 0;
@@ -19923,8 +20184,13 @@ struct game_load_functions : state_functions {
 			v.visible = 0xff;
 			v.explored = 0xff;
 		}
+		st.sight_footprint_cache.entries.clear();
+		st.sight_footprint_cache.tile_indices.clear();
 		st.tiles_mega_tile_index.clear();
 		st.tiles_mega_tile_index.resize(st.tiles.size());
+		size_t tile_page_count = (st.tiles.size() + state::tile_page_size - 1) / state::tile_page_size;
+		st.tile_page_ids.assign(tile_page_count, 0);
+		st.mega_tile_index_page_ids.assign(tile_page_count, 0);
 
 		st.update_tiles_countdown = 1;
 
@@ -21203,7 +21469,14 @@ struct game_load_functions : state_functions {
 	};
 
 	void load_map_file(a_string filename, std::function<void()> setup_f = {}, bool initial_processing = true) {
-		load_map(data_loading::mpq_file<>(std::move(filename)), std::move(setup_f), initial_processing);
+		if (map_file_cache) {
+			load_map([&](a_vector<uint8_t>& dst, a_string name) {
+				map_file_cache->get(dst, filename, name, [&](a_vector<uint8_t>& dst) {
+					data_loading::default_mpq_file mpq(filename);
+					mpq(dst, name);
+				});
+			}, std::move(setup_f), initial_processing);
+		} else load_map(data_loading::default_mpq_file(std::move(filename)), std::move(setup_f), initial_processing);
 	}
 
 	template<typename load_data_file_F>
@@ -21895,8 +22168,11 @@ struct game_load_functions : state_functions {
 	}
 };
 
+// Reads a grp file. If load_pixel_data is false, only the dimensions and
+// offsets of the frames are read, which is all the game logic uses;
+// line_data_offset and data_container are left empty.
 template<typename reader_T>
-grp_t read_grp(reader_T&& r) {
+grp_t read_grp(reader_T&& r, bool load_pixel_data = true) {
 	auto base_r = r;
 	grp_t grp;
 	size_t frame_count = r.template get<uint16_t>();
@@ -21910,6 +22186,7 @@ grp_t read_grp(reader_T&& r) {
 		f.size.x = r.template get<uint8_t>();
 		f.size.y = r.template get<uint8_t>();
 		size_t file_offset = r.template get<uint32_t>();
+		if (!load_pixel_data) continue;
 		auto line_offset_r = base_r;
 		line_offset_r.skip(file_offset);
 		f.line_data_offset.reserve(f.size.y);
@@ -21961,8 +22238,11 @@ struct string_table_data {
 	}
 };
 
+// Loads the data files into st. If load_grp_pixel_data is false, the grps
+// only hold the frame geometry (see read_grp), which is enough to run the
+// game but not to draw it.
 template<typename load_data_file_F>
-void global_init(global_state& st, load_data_file_F&& load_data_file) {
+void global_init(global_state& st, load_data_file_F&& load_data_file, bool load_grp_pixel_data = true) {
 
 	auto get_sprite_type = [&](SpriteTypes id) {
 		if ((size_t)id >= 517) error("invalid sprite id %d", (size_t)id);
@@ -22188,7 +22468,7 @@ void global_init(global_state& st, load_data_file_F&& load_data_file) {
 
 		auto load_grp = [&](data_reader_le r) {
 			size_t index = grps.size();
-			grps.push_back(read_grp(r));
+			grps.push_back(read_grp(r, load_grp_pixel_data));
 			return index;
 		};
 		auto load_offsets = [&](data_reader_le r) {
@@ -9,6 +9,15 @@
 #include <array>
 #include <cstring>
 #include <cstdio>
+#include <mutex>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BWGAME_DATA_LOADING_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace bwgame {
 namespace data_loading {
@@ -20,6 +29,12 @@ struct is_std_array : std::false_type {};
 template<typename T, size_t N>
 struct is_std_array<std::array<T, N>> : std::true_type{};
 
+// Readers over memory have a get_n that returns the data in place.
+template<typename reader_T, typename = void>
+struct has_get_n : std::false_type {};
+template<typename reader_T>
+struct has_get_n<reader_T, decltype((void)std::declval<reader_T&>().get_n(0))> : std::true_type {};
+
 // todo: Nothing here should throw exceptions. We should instead have a type to report errors,
 //       and all functions should set it through a reference or similar (optional/variant?).
 //  (allocators can still throw exceptions if they want to)
@@ -290,6 +305,108 @@ struct file_reader {
 
 };
 
+// The contents of a whole file, read-only. The file is memory mapped where
+// mmap is available, so only the pages that are used are read, and read into
+// memory otherwise.
+struct mapped_file {
+	a_string filename;
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+#ifdef BWGAME_DATA_LOADING_MMAP
+	void* mapping = nullptr;
+#else
+	a_vector<uint8_t> buffer;
+#endif
+	mapped_file() = default;
+	explicit mapped_file(a_string filename) {
+		open(std::move(filename));
+	}
+	~mapped_file() {
+		close();
+	}
+	mapped_file(const mapped_file&) = delete;
+	mapped_file(mapped_file&& n) {
+		*this = std::move(n);
+	}
+	mapped_file& operator=(const mapped_file&) = delete;
+	mapped_file& operator=(mapped_file&& n) {
+		std::swap(filename, n.filename);
+		std::swap(data, n.data);
+		std::swap(size, n.size);
+#ifdef BWGAME_DATA_LOADING_MMAP
+		std::swap(mapping, n.mapping);
+#else
+		std::swap(buffer, n.buffer);
+#endif
+		return *this;
+	}
+
+	void open(a_string filename) {
+		close();
+#ifdef BWGAME_DATA_LOADING_MMAP
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd == -1) error("mapped_file: failed to open %s for reading", filename.c_str());
+		struct stat st;
+		if (fstat(fd, &st)) {
+			::close(fd);
+			error("mapped_file: %s: stat failed", filename.c_str());
+		}
+		if (st.st_size) {
+			void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED) {
+				::close(fd);
+				error("mapped_file: %s: mmap failed", filename.c_str());
+			}
+			mapping = p;
+			data = (const uint8_t*)p;
+			size = (size_t)st.st_size;
+		}
+		::close(fd);
+#else
+		file_reader<> r(filename);
+		buffer.resize(r.size());
+		if (!buffer.empty()) r.get_bytes(buffer.data(), buffer.size());
+		data = buffer.data();
+		size = buffer.size();
+#endif
+		this->filename = std::move(filename);
+	}
+
+	void close() {
+#ifdef BWGAME_DATA_LOADING_MMAP
+		if (mapping) munmap(mapping, size);
+		mapping = nullptr;
+#else
+		buffer.clear();
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	data_reader<> reader() const {
+		return data_reader<>(data, data + size);
+	}
+};
+
+// A data_reader over a mapped_file, for reading files without going through
+// stdio. Since it reads from memory, readers layered on it (like
+// mpq_archive_reader) can use the data in place.
+template<bool default_little_endian = true>
+struct mapped_file_reader : data_reader<default_little_endian> {
+	mapped_file file;
+	mapped_file_reader() = default;
+	explicit mapped_file_reader(a_string filename) {
+		open(std::move(filename));
+	}
+	void open(a_string filename) {
+		file.open(std::move(filename));
+		(data_reader<default_little_endian>&)*this = data_reader<default_little_endian>(file.data, file.data + file.size);
+	}
+	bool eof() const {
+		return this->left() == 0;
+	}
+};
+
 using crypt_table_t = std::array<uint32_t, 256 * 5>;
 static auto get_crypt_table() {
 	uint32_t n = 0x100001;
@@ -448,222 +565,156 @@ auto make_bit_reader(base_reader_T& reader) {
 	return bit_reader<base_reader_T, little_endian>(reader);
 }
 
-template<bool little_endian = true>
-void decompress(uint8_t* input, size_t input_size, uint8_t* output, size_t output_size) {
-	data_reader<little_endian> source_r(input, input + input_size);
-	auto r = make_bit_reader(source_r);
-	int type = r.template get<uint8_t>();
-	int distance_bits = r.template get<uint8_t>();
+// Implode (PKWare DCL) code tables, indexed by the next 8 bits of input.
+// Length codes are followed by extra bits, which are added to base.
+struct implode_length_code {
+	uint8_t bits;
+	uint8_t extra_bits;
+	uint16_t base;
+};
+static const implode_length_code implode_length_table[256] = {
+	{7, 8, 262}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 1, 8}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 3, 14}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 5, 38}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 0, 7}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 2, 10}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 6, 70}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 1, 8}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 3, 14}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 4, 22}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 0, 7}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 2, 10}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{7, 7, 134}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 1, 8}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 3, 14}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 5, 38}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 0, 7}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 2, 10}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 6, 70}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 1, 8}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 3, 14}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 4, 22}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 0, 7}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 2, 10}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{7, 8, 262}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 1, 8}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 3, 14}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 5, 38}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 0, 7}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 2, 10}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 6, 70}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 1, 8}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 3, 14}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 4, 22}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 0, 7}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 2, 10}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{7, 7, 134}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 1, 8}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 3, 14}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 5, 38}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 0, 7}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 2, 10}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 6, 70}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 1, 8}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 3, 14}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{6, 4, 22}, {3, 0, 2}, {4, 0, 5}, {2, 0, 1}, {5, 0, 7}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1},
+	{5, 2, 10}, {3, 0, 2}, {4, 0, 4}, {2, 0, 1}, {4, 0, 6}, {3, 0, 0}, {3, 0, 3}, {2, 0, 1}
+};
+// The value of a distance code is the high bits of the distance.
+struct implode_distance_code {
+	uint8_t bits;
+	uint8_t value;
+};
+static const implode_distance_code implode_distance_table[256] = {
+	{8, 63}, {5, 6}, {7, 23}, {2, 0}, {7, 39}, {4, 2}, {6, 14}, {2, 0},
+	{7, 47}, {5, 4}, {6, 18}, {2, 0}, {7, 31}, {4, 1}, {6, 10}, {2, 0},
+	{8, 55}, {5, 5}, {6, 20}, {2, 0}, {7, 35}, {4, 2}, {6, 12}, {2, 0},
+	{7, 43}, {5, 3}, {6, 16}, {2, 0}, {7, 27}, {4, 1}, {6, 8}, {2, 0},
+	{8, 59}, {5, 6}, {6, 21}, {2, 0}, {7, 37}, {4, 2}, {6, 13}, {2, 0},
+	{7, 45}, {5, 4}, {6, 17}, {2, 0}, {7, 29}, {4, 1}, {6, 9}, {2, 0},
+	{8, 51}, {5, 5}, {6, 19}, {2, 0}, {7, 33}, {4, 2}, {6, 11}, {2, 0},
+	{7, 41}, {5, 3}, {6, 15}, {2, 0}, {7, 25}, {4, 1}, {6, 7}, {2, 0},
+	{8, 61}, {5, 6}, {7, 22}, {2, 0}, {7, 38}, {4, 2}, {6, 14}, {2, 0},
+	{7, 46}, {5, 4}, {6, 18}, {2, 0}, {7, 30}, {4, 1}, {6, 10}, {2, 0},
+	{8, 53}, {5, 5}, {6, 20}, {2, 0}, {7, 34}, {4, 2}, {6, 12}, {2, 0},
+	{7, 42}, {5, 3}, {6, 16}, {2, 0}, {7, 26}, {4, 1}, {6, 8}, {2, 0},
+	{8, 57}, {5, 6}, {6, 21}, {2, 0}, {7, 36}, {4, 2}, {6, 13}, {2, 0},
+	{7, 44}, {5, 4}, {6, 17}, {2, 0}, {7, 28}, {4, 1}, {6, 9}, {2, 0},
+	{8, 49}, {5, 5}, {6, 19}, {2, 0}, {7, 32}, {4, 2}, {6, 11}, {2, 0},
+	{7, 40}, {5, 3}, {6, 15}, {2, 0}, {7, 24}, {4, 1}, {6, 7}, {2, 0},
+	{8, 62}, {5, 6}, {7, 23}, {2, 0}, {7, 39}, {4, 2}, {6, 14}, {2, 0},
+	{7, 47}, {5, 4}, {6, 18}, {2, 0}, {7, 31}, {4, 1}, {6, 10}, {2, 0},
+	{8, 54}, {5, 5}, {6, 20}, {2, 0}, {7, 35}, {4, 2}, {6, 12}, {2, 0},
+	{7, 43}, {5, 3}, {6, 16}, {2, 0}, {7, 27}, {4, 1}, {6, 8}, {2, 0},
+	{8, 58}, {5, 6}, {6, 21}, {2, 0}, {7, 37}, {4, 2}, {6, 13}, {2, 0},
+	{7, 45}, {5, 4}, {6, 17}, {2, 0}, {7, 29}, {4, 1}, {6, 9}, {2, 0},
+	{8, 50}, {5, 5}, {6, 19}, {2, 0}, {7, 33}, {4, 2}, {6, 11}, {2, 0},
+	{7, 41}, {5, 3}, {6, 15}, {2, 0}, {7, 25}, {4, 1}, {6, 7}, {2, 0},
+	{8, 60}, {5, 6}, {7, 22}, {2, 0}, {7, 38}, {4, 2}, {6, 14}, {2, 0},
+	{7, 46}, {5, 4}, {6, 18}, {2, 0}, {7, 30}, {4, 1}, {6, 10}, {2, 0},
+	{8, 52}, {5, 5}, {6, 20}, {2, 0}, {7, 34}, {4, 2}, {6, 12}, {2, 0},
+	{7, 42}, {5, 3}, {6, 16}, {2, 0}, {7, 26}, {4, 1}, {6, 8}, {2, 0},
+	{8, 56}, {5, 6}, {6, 21}, {2, 0}, {7, 36}, {4, 2}, {6, 13}, {2, 0},
+	{7, 44}, {5, 4}, {6, 17}, {2, 0}, {7, 28}, {4, 1}, {6, 9}, {2, 0},
+	{8, 48}, {5, 5}, {6, 19}, {2, 0}, {7, 32}, {4, 2}, {6, 11}, {2, 0},
+	{7, 40}, {5, 3}, {6, 15}, {2, 0}, {7, 24}, {4, 1}, {6, 7}, {2, 0}
+};
 
-	if (distance_bits != 4 && distance_bits != 5 && distance_bits != 6) error("decompress: invalid distance bits %d", distance_bits);
+template<bool little_endian = true>
+void decompress(const uint8_t* input, size_t input_size, uint8_t* output, size_t output_size) {
+	const uint8_t* in = input;
+	const uint8_t* in_end = input + input_size;
+	uint64_t bits = 0;
+	size_t bits_n = 0;
 
-	auto get_length = [&]() {
-		switch (r.template get_bits<2>()) {
-		case 3: return 1;
-		case 0:
-			switch (r.template get_bits<2>()) {
-			case 3: return 6;
-			case 0:
-				switch (r.template get_bits<6>()) {
-				case 3: return 22;
-				case 7: return 23;
-				case 11: return 24;
-				case 15: return 25;
-				case 19: return 26;
-				case 23: return 27;
-				case 27: return 28;
-				case 31: return 29;
-				case 35: return 30;
-				case 39: return 31;
-				case 43: return 32;
-				case 47: return 33;
-				case 51: return 34;
-				case 55: return 35;
-				case 59: return 36;
-				case 63: return 37;
-				case 0: return 262 + 8 * r.template get_bits<5>();
-				case 1: return r.template get_bits<1>() ? 54 : 38;
-				case 2: return 70 + 16 * r.template get_bits<2>();
-				case 4: return 134 + 8 * r.template get_bits<4>();
-				case 5: return r.template get_bits<1>() ? 55 : 39;
-				case 6: return 71 + 16 * r.template get_bits<2>();
-				case 8: return 263 + 8 * r.template get_bits<5>();
-				case 9: return r.template get_bits<1>() ? 56 : 40;
-				case 10: return 72 + 16 * r.template get_bits<2>();
-				case 12: return 135 + 8 * r.template get_bits<4>();
-				case 13: return r.template get_bits<1>() ? 57 : 41;
-				case 14: return 73 + 16 * r.template get_bits<2>();
-				case 16: return 264 + 8 * r.template get_bits<5>();
-				case 17: return r.template get_bits<1>() ? 58 : 42;
-				case 18: return 74 + 16 * r.template get_bits<2>();
-				case 20: return 136 + 8 * r.template get_bits<4>();
-				case 21: return r.template get_bits<1>() ? 59 : 43;
-				case 22: return 75 + 16 * r.template get_bits<2>();
-				case 24: return 265 + 8 * r.template get_bits<5>();
-				case 25: return r.template get_bits<1>() ? 60 : 44;
-				case 26: return 76 + 16 * r.template get_bits<2>();
-				case 28: return 137 + 8 * r.template get_bits<4>();
-				case 29: return r.template get_bits<1>() ? 61 : 45;
-				case 30: return 77 + 16 * r.template get_bits<2>();
-				case 32: return 266 + 8 * r.template get_bits<5>();
-				case 33: return r.template get_bits<1>() ? 62 : 46;
-				case 34: return 78 + 16 * r.template get_bits<2>();
-				case 36: return 138 + 8 * r.template get_bits<4>();
-				case 37: return r.template get_bits<1>() ? 63 : 47;
-				case 38: return 79 + 16 * r.template get_bits<2>();
-				case 40: return 267 + 8 * r.template get_bits<5>();
-				case 41: return r.template get_bits<1>() ? 64 : 48;
-				case 42: return 80 + 16 * r.template get_bits<2>();
-				case 44: return 139 + 8 * r.template get_bits<4>();
-				case 45: return r.template get_bits<1>() ? 65 : 49;
-				case 46: return 81 + 16 * r.template get_bits<2>();
-				case 48: return 268 + 8 * r.template get_bits<5>();
-				case 49: return r.template get_bits<1>() ? 66 : 50;
-				case 50: return 82 + 16 * r.template get_bits<2>();
-				case 52: return 140 + 8 * r.template get_bits<4>();
-				case 53: return r.template get_bits<1>() ? 67 : 51;
-				case 54: return 83 + 16 * r.template get_bits<2>();
-				case 56: return 269 + 8 * r.template get_bits<5>();
-				case 57: return r.template get_bits<1>() ? 68 : 52;
-				case 58: return 84 + 16 * r.template get_bits<2>();
-				case 60: return 141 + 8 * r.template get_bits<4>();
-				case 61: return r.template get_bits<1>() ? 69 : 53;
-				case 62: return 85 + 16 * r.template get_bits<2>();
-				}
-			case 1:
-				switch (r.template get_bits<1>()) {
-				case 1: return 7;
-				case 0: return r.template get_bits<1>() ? 9 : 8;
-				}
-			case 2:
-				switch (r.template get_bits<3>()) {
-				case 1: return 10;
-				case 3: return 11;
-				case 5: return 12;
-				case 7: return 13;
-				case 0: return r.template get_bits<1>() ? 18 : 14;
-				case 2: return r.template get_bits<1>() ? 19 : 15;
-				case 4: return r.template get_bits<1>() ? 20 : 16;
-				case 6: return r.template get_bits<1>() ? 21 : 17;
-				}
-			}
-		case 1: return r.template get_bits<1>() ? 0 : 2;
-		case 2:
-			switch (r.template get_bits<1>()) {
-			case 1: return 3;
-			case 0: return r.template get_bits<1>() ? 4 : 5;
+	// Tops bits up to at least 56 bits, or to what is left of the input.
+	// No token takes more than 30 bits, so one refill per token is enough.
+	auto refill = [&]() {
+		if (in_end - in >= 8) {
+			bits |= value_at<uint64_t, true>(in) << bits_n;
+			in += (63 - bits_n) / 8;
+			bits_n |= 56;
+		} else {
+			while (bits_n <= 56 && in != in_end) {
+				bits |= (uint64_t)*in++ << bits_n;
+				bits_n += 8;
 			}
 		}
-		return -1;
 	};
-
-	auto get_distance = [&]() {
-		switch (r.template get_bits<2>()) {
-		case 3: return 0;
-		case 0:
-			switch (r.template get_bits<5>()) {
-			case 1: return 39;
-			case 2: return 47;
-			case 3: return 31;
-			case 5: return 35;
-			case 6: return 43;
-			case 7: return 27;
-			case 9: return 37;
-			case 10: return 45;
-			case 11: return 29;
-			case 13: return 33;
-			case 14: return 41;
-			case 15: return 25;
-			case 17: return 38;
-			case 18: return 46;
-			case 19: return 30;
-			case 21: return 34;
-			case 22: return 42;
-			case 23: return 26;
-			case 25: return 36;
-			case 26: return 44;
-			case 27: return 28;
-			case 29: return 32;
-			case 30: return 40;
-			case 31: return 24;
-			case 0: return r.template get_bits<1>() ? 62 : 63;
-			case 4: return r.template get_bits<1>() ? 54 : 55;
-			case 8: return r.template get_bits<1>() ? 58 : 59;
-			case 12: return r.template get_bits<1>() ? 50 : 51;
-			case 16: return r.template get_bits<1>() ? 60 : 61;
-			case 20: return r.template get_bits<1>() ? 52 : 53;
-			case 24: return r.template get_bits<1>() ? 56 : 57;
-			case 28: return r.template get_bits<1>() ? 48 : 49;
-			}
-		case 1:
-			switch (r.template get_bits<2>()) {
-			case 1: return 2;
-			case 3: return 1;
-			case 0: return r.template get_bits<1>() ? 5 : 6;
-			case 2: return r.template get_bits<1>() ? 3 : 4;
-			}
-		case 2:
-			switch (r.template get_bits<4>()) {
-			case 1: return 14;
-			case 2: return 18;
-			case 3: return 10;
-			case 4: return 20;
-			case 5: return 12;
-			case 6: return 16;
-			case 7: return 8;
-			case 8: return 21;
-			case 9: return 13;
-			case 10: return 17;
-			case 11: return 9;
-			case 12: return 19;
-			case 13: return 11;
-			case 14: return 15;
-			case 15: return 7;
-			case 0: return r.template get_bits<1>() ? 22 : 23;
-			}
-		}
-		return -1;
+	auto get_bits = [&](size_t n) {
+		if (bits_n < n) error("decompress: attempt to read past end");
+		size_t r = (size_t)(bits & (((uint64_t)1 << n) - 1));
+		bits >>= n;
+		bits_n -= n;
+		return r;
 	};
 
+	refill();
+	int type = (int)get_bits(8);
+	size_t distance_bits = get_bits(8);
+
+	if (distance_bits != 4 && distance_bits != 5 && distance_bits != 6) error("decompress: invalid distance bits %d", distance_bits);
 
 	size_t out_pos = 0;
 
 	if (type == 0) {
 
 		while (out_pos != output_size) {
-			if (r.template get_bits<1>()) {
+			refill();
+			if (get_bits(1)) {
 
-				size_t len = 2 + get_length();
-				size_t distance = 0;
+				auto& lc = implode_length_table[bits & 0xff];
+				get_bits(lc.bits);
+				size_t len = 2 + lc.base + get_bits(lc.extra_bits);
 
 				if (len == 519) error("decompress: eof marker found too early");
 
-				if (len == 2) {
-					distance = get_distance() << 2;
-					distance |= r.template get_bits<2>();
-				} else {
-					distance = get_distance() << distance_bits;
-					if (distance_bits == 4) distance |= r.template get_bits<4>();
-					else if (distance_bits == 5) distance |= r.template get_bits<5>();
-					else distance |= r.template get_bits<6>();
-				}
+				auto& dc = implode_distance_table[bits & 0xff];
+				get_bits(dc.bits);
+				size_t distance;
+				if (len == 2) distance = (size_t)dc.value << 2 | get_bits(2);
+				else distance = (size_t)dc.value << distance_bits | get_bits(distance_bits);
+
+				if (distance >= out_pos) error("decompress: distance %d out of range at offset %d", distance, out_pos);
 				size_t src_pos = out_pos - 1 - distance;
-				if (src_pos > output_size) {
-					len = 0;
-				}
-				if (src_pos + len > output_size) {
-					len = output_size - src_pos;
-				}
-				if (out_pos + len > output_size) {
-					len = output_size - out_pos;
-				}
-				for (size_t i = 0; i != len; ++i) {
-					output[out_pos + i] = output[src_pos + i];
+				if (len > output_size - out_pos) len = output_size - out_pos;
+				if (distance + 1 >= len) {
+					if (len) memcpy(output + out_pos, output + src_pos, len);
+				} else {
+					for (size_t i = 0; i != len; ++i) {
+						output[out_pos + i] = output[src_pos + i];
+					}
 				}
 				out_pos += len;
 
 			} else {
-				output[out_pos] = r.template get<uint8_t>();
+				output[out_pos] = (uint8_t)get_bits(8);
 				++out_pos;
 			}
 		}
@@ -827,106 +878,226 @@ static const uint8_t huffman_weight_tables[9][256 + 2] = {
 	0x00, 0x00 }
 };
 
-template<bool little_endian = true>
-size_t decompress_huffman(uint8_t* input, size_t input_size, uint8_t* output, size_t output_size) {
-	data_reader<little_endian> source_r(input, input + input_size);
-	auto r = make_bit_reader(source_r);
-	size_t weights_index = r.template get<uint8_t>();
-	if (weights_index >= 9) error("decompress_huffman: invalid weights index %d", weights_index);
-	const uint8_t* weights = huffman_weight_tables[weights_index];
-	
-	struct tree_node;
-	using tree_node_iterator = typename a_list<tree_node>::iterator;
-	struct tree_node {
-		tree_node_iterator left;
-		tree_node_iterator parent;
-		int weight;
+// The adaptive Huffman tree used by decompress_huffman. The nodes are kept
+// in order of weight, and a node's right child is the one right after its
+// left child in that order. Leaves for new symbols are added at the front
+// of the order, so it keeps some room there. Weights are stored by position
+// in the order, so that finding where a node moves to when its weight is
+// incremented is a search over one array.
+struct huffman_tree {
+	struct node {
 		int symbol;
+		uint32_t parent;
+		std::array<uint32_t, 2> child;
+		uint32_t rank;
 	};
-	a_list<tree_node> all_nodes;
-	auto end = all_nodes.end();
-	all_nodes.push_back({end, end, 1, 0x101});
-	all_nodes.push_back({end, end, 1, 0x100});
-	for (int i = 256; i != 0;) {
-		--i;
-		int w = weights[i];
-		if (w == 0) continue;
-		all_nodes.push_back({end, end, w, i});
+	enum : uint32_t { none = 0xffffffff };
+	a_vector<node> nodes;
+	a_vector<uint32_t> order;
+	a_vector<int> weights;
+	size_t begin = 0;
+	// Bumped whenever the shape of the tree changes.
+	uint32_t generation = 1;
+
+	uint32_t root() const {
+		return order.back();
+	}
+
+	uint32_t push_front(int weight, int symbol, uint32_t parent) {
+		if (begin == 0) {
+			size_t n = order.size();
+			order.insert(order.begin(), n, none);
+			weights.insert(weights.begin(), n, 0);
+			for (auto& v : nodes) v.rank += (uint32_t)n;
+			begin = n;
+		}
+		--begin;
+		uint32_t n = (uint32_t)nodes.size();
+		nodes.push_back({symbol, parent, {none, none}, (uint32_t)begin});
+		order[begin] = n;
+		weights[begin] = weight;
+		return n;
+	}
+
+	void increment_weight(uint32_t n) {
+		for (; n != none; n = nodes[n].parent) {
+			size_t rank = nodes[n].rank;
+			int w = ++weights[rank];
+			if (rank + 1 == order.size() || weights[rank + 1] >= w) continue;
+			// The weights are sorted, so this finds the last node with a
+			// lower weight, which swaps places with n.
+			size_t swap_rank = std::lower_bound(weights.begin() + rank + 1, weights.end(), w) - weights.begin() - 1;
+			uint32_t swap_n = order[swap_rank];
+			order[rank] = swap_n;
+			order[swap_rank] = n;
+			std::swap(weights[rank], weights[swap_rank]);
+			nodes[swap_n].rank = (uint32_t)rank;
+			nodes[n].rank = (uint32_t)swap_rank;
+
+			auto& child = nodes[nodes[n].parent].child;
+			auto& swap_child = nodes[nodes[swap_n].parent].child;
+			size_t index = child[0] == n ? 0 : 1;
+			size_t swap_index = swap_child[0] == swap_n ? 0 : 1;
+			child[index] = swap_n;
+			swap_child[swap_index] = n;
+			std::swap(nodes[n].parent, nodes[swap_n].parent);
+			++generation;
+		}
 	}
-	
-	all_nodes.sort([&](auto& a, auto& b) {
-		return a.weight < b.weight;
-	});
-	
-	for (auto a = all_nodes.begin(); a != end;) {
-		auto b = std::next(a);
-		if (b == end) break;
-		
-		int w = a->weight + b->weight;
-		auto it = std::find_if(all_nodes.begin(), all_nodes.end(), [&](auto& v) {
-			return v.weight >= w;
+
+	// Splits the lowest weight leaf to add a leaf for symbol, and returns it.
+	uint32_t add_symbol(int symbol) {
+		uint32_t n = order[begin];
+		int n_symbol = nodes[n].symbol;
+		nodes[n].symbol = -1;
+		uint32_t right = push_front(1, n_symbol, n);
+		uint32_t left = push_front(0, symbol, n);
+		nodes[n].child = {left, right};
+		++generation;
+		return left;
+	}
+
+	static huffman_tree build(const uint8_t* symbol_weights) {
+		huffman_tree r;
+		a_vector<int> node_weights;
+		a_vector<uint32_t> list;
+		auto add = [&](int weight, int symbol) {
+			r.nodes.push_back({symbol, none, {none, none}, 0});
+			node_weights.push_back(weight);
+			return (uint32_t)r.nodes.size() - 1;
+		};
+		list.push_back(add(1, 0x101));
+		list.push_back(add(1, 0x100));
+		for (int i = 256; i != 0;) {
+			--i;
+			int w = symbol_weights[i];
+			if (w == 0) continue;
+			list.push_back(add(w, i));
+		}
+		std::stable_sort(list.begin(), list.end(), [&](uint32_t a, uint32_t b) {
+			return node_weights[a] < node_weights[b];
 		});
-		it = all_nodes.insert(it, {a, end, w, -1});
-		
-		a->parent = it;
-		b->parent = it;
-		
-		a = std::next(b);
-	}
-	
-	auto increment_weight = [&](tree_node_iterator n) {
-		for (; n != end; n = n->parent) {
-			++n->weight;
-			int w = n->weight;
-			auto swap_n_next = std::find_if(std::next(n), end, [&](auto& v) {
-				return v.weight >= w;
+		// Every weight is at least 1, so the parent always goes after b.
+		for (size_t i = 0; i + 1 < list.size(); i += 2) {
+			uint32_t a = list[i];
+			uint32_t b = list[i + 1];
+			int w = node_weights[a] + node_weights[b];
+			auto it = std::find_if(list.begin(), list.end(), [&](uint32_t v) {
+				return node_weights[v] >= w;
 			});
-			auto swap_n = std::prev(swap_n_next);
-			if (swap_n == n) continue;
-			all_nodes.splice(n, all_nodes, swap_n);
-			all_nodes.splice(swap_n_next, all_nodes, n);
-			
-			if (n->parent->left == n) {
-				if (swap_n->parent->left == swap_n) swap_n->parent->left = n;
-				n->parent->left = swap_n;
-			} else if (swap_n->parent->left == swap_n) swap_n->parent->left = n;
-			std::swap(n->parent, swap_n->parent);
+			uint32_t n = add(w, -1);
+			r.nodes[n].child = {a, b};
+			list.insert(it, n);
+			r.nodes[a].parent = n;
+			r.nodes[b].parent = n;
+		}
+		// Room for a leaf for every symbol.
+		r.begin = 512;
+		r.order.resize(r.begin, none);
+		r.weights.resize(r.begin, 0);
+		for (uint32_t v : list) {
+			r.nodes[v].rank = (uint32_t)r.order.size();
+			r.order.push_back(v);
+			r.weights.push_back(node_weights[v]);
+		}
+		return r;
+	}
+
+	static const huffman_tree& initial(size_t weights_index) {
+		static const std::array<huffman_tree, 9> trees = []() {
+			std::array<huffman_tree, 9> r;
+			for (size_t i = 0; i != 9; ++i) r[i] = build(huffman_weight_tables[i]);
+			return r;
+		}();
+		return trees[weights_index];
+	}
+};
+
+template<bool little_endian = true>
+size_t decompress_huffman(const uint8_t* input, size_t input_size, uint8_t* output, size_t output_size) {
+	const uint8_t* in = input;
+	const uint8_t* in_end = input + input_size;
+	uint64_t bits = 0;
+	size_t bits_n = 0;
+
+	auto refill = [&]() {
+		if (in_end - in >= 8) {
+			bits |= value_at<uint64_t, true>(in) << bits_n;
+			in += (63 - bits_n) / 8;
+			bits_n |= 56;
+		} else {
+			while (bits_n <= 56 && in != in_end) {
+				bits |= (uint64_t)*in++ << bits_n;
+				bits_n += 8;
+			}
 		}
 	};
-	
+	auto get_bits = [&](size_t n) {
+		if (bits_n < n) error("decompress_huffman: attempt to read past end");
+		size_t r = (size_t)(bits & (((uint64_t)1 << n) - 1));
+		bits >>= n;
+		bits_n -= n;
+		return r;
+	};
+
+	refill();
+	size_t weights_index = get_bits(8);
+	if (weights_index >= 9) error("decompress_huffman: invalid weights index %d", weights_index);
+	huffman_tree tree = huffman_tree::initial(weights_index);
+
+	// The node reached from the root by each 8 bit prefix, while the tree
+	// has the same shape as when it was looked up. With weights index 0,
+	// the tree changes after nearly every symbol, and walking it bit by bit
+	// is faster.
+	struct prefix_entry {
+		uint32_t generation;
+		uint32_t node;
+		size_t bits;
+	};
+	std::array<prefix_entry, 256> prefixes{};
+	bool use_prefixes = weights_index != 0;
+
 	size_t out_pos = 0;
-	
+
 	while (out_pos < output_size) {
-		tree_node_iterator n = std::prev(end);
-		while (n->symbol == -1) {
-			int bit = r.template get_bits<1>();
-			if (bit == 0) n = n->left;
-			else n = std::next(n->left);
+		refill();
+		uint32_t n = tree.root();
+		if (use_prefixes) {
+			size_t key = (size_t)bits & 0xff;
+			if (prefixes[key].generation != tree.generation) {
+				size_t depth = 0;
+				for (; depth != 8 && tree.nodes[n].symbol == -1; ++depth) n = tree.nodes[n].child[(bits >> depth) & 1];
+				// Every key that starts with the same depth bits leads to n.
+				for (size_t i = key & ((1 << depth) - 1); i < 256; i += (size_t)1 << depth) prefixes[i] = {tree.generation, n, depth};
+			}
+			get_bits(prefixes[key].bits);
+			n = prefixes[key].node;
+		}
+		size_t depth = 0;
+		while (tree.nodes[n].symbol == -1) {
+			if (depth == bits_n) {
+				get_bits(depth);
+				depth = 0;
+				refill();
+				if (bits_n == 0) error("decompress_huffman: attempt to read past end");
+			}
+			n = tree.nodes[n].child[(bits >> depth) & 1];
+			++depth;
 		}
-		if (n->symbol == 256) break;
-		uint8_t value;
-		if (n->symbol == 257) {
-			int symbol = r.template get_bits<8>();
-			value = symbol;
-			
-			n = all_nodes.begin();
-			int n_symbol = n->symbol;
-			
-			n->symbol = -1;
-			
-			all_nodes.push_front({end, n, 1, n_symbol});
-			all_nodes.push_front({end, n, 0, symbol});
-			n->left = all_nodes.begin();
-			n = n->left;
-			
-			increment_weight(n);
-			if (weights_index != 0) increment_weight(n);
-			
-		} else value = n->symbol;
-		output[out_pos] = value;
+		get_bits(depth);
+		int symbol = tree.nodes[n].symbol;
+		if (symbol == 256) break;
+		if (symbol == 257) {
+			if (bits_n < 8) refill();
+			symbol = (int)get_bits(8);
+			n = tree.add_symbol(symbol);
+			tree.increment_weight(n);
+			if (weights_index != 0) tree.increment_weight(n);
+		}
+		output[out_pos] = (uint8_t)symbol;
 		++out_pos;
-		
-		if (weights_index == 0) increment_weight(n);
+
+		if (weights_index == 0) tree.increment_weight(n);
 	}
 	return out_pos;
 }
@@ -949,29 +1120,53 @@ static const int32_t adpcm_step_table[89] = {
 	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767 
 };
 
+// The step index that follows each step index and sample code, so that
+// decompress_adpcm does not need to add and clamp.
+static inline const std::array<std::array<uint8_t, 32>, 89>& adpcm_next_step_index_table() {
+	static const auto table = []() {
+		std::array<std::array<uint8_t, 32>, 89> r;
+		for (int i = 0; i != 89; ++i) {
+			for (int v = 0; v != 32; ++v) {
+				int index = i + adpcm_index_add_table[v];
+				if (index < 0) index = 0;
+				else if (index > 88) index = 88;
+				r[i][v] = (uint8_t)index;
+			}
+		}
+		return r;
+	}();
+	return table;
+}
+
 template<bool little_endian = true>
-size_t decompress_adpcm(uint8_t* input, size_t input_size, uint8_t* output, size_t output_size, size_t channels) {
-	data_reader<little_endian> r(input, input + input_size);
-	
-	size_t out_pos = 0;
-	
-	a_vector<int16_t> previous_sample(channels);
-	a_vector<int> step_index(channels, 44);
-	
-	r.template get<uint8_t>();
-	auto shift = r.template get<uint8_t>();
-	
+size_t decompress_adpcm(const uint8_t* input, size_t input_size, uint8_t* output, size_t output_size, size_t channels) {
+	if (channels != 1 && channels != 2) error("decompress_adpcm: unsupported channel count %d", channels);
+	const uint8_t* in = input;
+	const uint8_t* in_end = input + input_size;
+	uint8_t* out = output;
+	uint8_t* out_end = output + output_size;
+
+	auto& next_step_index = adpcm_next_step_index_table();
+	std::array<int32_t, 2> previous_sample;
+	std::array<int, 2> step_index = {44, 44};
+
+	if ((size_t)(in_end - in) < 2 + 2 * channels) error("decompress_adpcm: attempt to read past end");
+	int shift = in[1];
+	in += 2;
+
 	for (size_t i = 0; i != channels; ++i) {
-		auto sample = r.template get<int16_t>();
+		int16_t sample = value_at<int16_t, little_endian>(in);
+		in += 2;
 		previous_sample[i] = sample;
-		if (out_pos - output_size < 2) error("decompress_adpcm: attempt to write past end");
-		set_value_at<little_endian, int16_t>(output + out_pos, sample);
-		out_pos += 2;
+		if (out_end - out < 2) error("decompress_adpcm: attempt to write past end");
+		set_value_at<little_endian, int16_t>(out, sample);
+		out += 2;
 	}
-	
-	while (r.left()) {
+
+	while (in != in_end) {
 		for (size_t channel = 0; channel != channels; ++channel) {
-			auto in_value = r.template get<uint8_t>();
+			if (in == in_end) error("decompress_adpcm: attempt to read past end");
+			int in_value = *in++;
 			if (~in_value & 0x80) {
 				int index = step_index[channel];
 				int32_t step = adpcm_step_table[index];
@@ -989,23 +1184,20 @@ size_t decompress_adpcm(uint8_t* input, size_t input_size, uint8_t* output, size
 					sample = previous_sample[channel] + sample;
 					if (sample > 32767) sample = 32767;
 				}
-				
+
 				previous_sample[channel] = sample;
-				if (out_pos - output_size < 2) error("decompress_adpcm: attempt to write past end");
-				set_value_at<true, int16_t>(output + out_pos, sample);
-				out_pos += 2;
-				
-				index += adpcm_index_add_table[in_value & 0x1f];
-				if (index < 0) index = 0;
-				else if (index > 88) index = 88;
-				step_index[channel] = index;
+				if (out_end - out < 2) error("decompress_adpcm: attempt to write past end");
+				set_value_at<true, int16_t>(out, (int16_t)sample);
+				out += 2;
+
+				step_index[channel] = next_step_index[index][in_value & 0x1f];
 			} else {
 				int n = in_value & 0x7f;
 				if (n == 0) {
 					if (step_index[channel] != 0) --step_index[channel];
-					if (out_pos - output_size < 2) error("decompress_adpcm: attempt to write past end");
-					set_value_at<little_endian, int16_t>(output + out_pos, previous_sample[channel]);
-					out_pos += 2;
+					if (out_end - out < 2) error("decompress_adpcm: attempt to write past end");
+					set_value_at<little_endian, int16_t>(out, (int16_t)previous_sample[channel]);
+					out += 2;
 				} else if (n == 1) {
 					if (step_index[channel] >= 88 - 8) step_index[channel] = 88;
 					else step_index[channel] += 8;
@@ -1018,8 +1210,8 @@ size_t decompress_adpcm(uint8_t* input, size_t input_size, uint8_t* output, size
 			}
 		}
 	}
-	
-	return out_pos;
+
+	return out - output;
 }
 
 struct hash_table_entry {
@@ -1046,14 +1238,20 @@ struct mpq_archive_file_reader {
 	size_t current_sector = ~(size_t)0;
 	a_vector<uint8_t> compressed_data;
 	a_vector<uint8_t> sector_data;
+	const uint8_t* sector = nullptr;
 	size_t file_position = 0;
 	mpq_archive_file_reader(a_string arg_filename, base_reader_T& r, size_t sector_size, block_table_entry be, uint32_t key, const crypt_table_t& crypt_table) : filename(std::move(arg_filename)), r(r), sector_size(sector_size), be(be), key(key), crypt_table(crypt_table) {
 
+		sector_data.resize(sector_size);
+
 		if (~be.flags & 0x200 && ~be.flags & 0x100) {
-			error("mpq: %s: file is not compressed", filename);
+			// Stored files have no sector offset table; every sector is
+			// stored as is.
+			for (size_t offset = 0; offset < be.size; offset += sector_size) compressed_sectors.push_back(offset);
+			compressed_sectors.push_back(be.size);
+			return;
 		}
 
-		sector_data.resize(sector_size);
 		r.seek(be.data_offset);
 
 		auto read_sectors = [&](auto&& sectors_r) {
@@ -1071,6 +1269,21 @@ struct mpq_archive_file_reader {
 			read_sectors(r);
 		}
 	}
+
+	// Returns the next n bytes of r. Readers over memory return them in
+	// place, so sectors are decompressed straight from the archive data;
+	// other readers copy them into compressed_data.
+	template<typename reader_T, typename std::enable_if<has_get_n<reader_T>::value>::type* = nullptr>
+	const uint8_t* read_sector_data(reader_T& r, size_t n) {
+		return r.get_n(n);
+	}
+	template<typename reader_T, typename std::enable_if<!has_get_n<reader_T>::value>::type* = nullptr>
+	const uint8_t* read_sector_data(reader_T& r, size_t n) {
+		if (compressed_data.size() < n) compressed_data.resize(n);
+		r.get_bytes(compressed_data.data(), n);
+		return compressed_data.data();
+	}
+
 	void read_sector() {
 		current_sector = file_position / sector_size;
 		if (current_sector >= compressed_sectors.size() - 1) error("mpq: %s: attempt to read past end", filename);
@@ -1078,66 +1291,63 @@ struct mpq_archive_file_reader {
 		size_t sector_data_size = compressed_sectors[current_sector + 1] - compressed_sectors[current_sector];
 		r.seek(be.data_offset + compressed_sectors[current_sector]);
 
-		int compression_flags;
-		auto get_data = [&](auto&& sector_data_r) {
-			if (~be.flags & 0x200) {
-				compression_flags = 8;
-				if (compressed_data.size() < sector_data_size) compressed_data.resize(sector_data_size);
-				sector_data_r.get_bytes(compressed_data.data(), sector_data_size);
-			} else {
-				compression_flags = sector_data_r.template get<uint8_t>();
-	
-				if (compressed_data.size() < sector_data_size) compressed_data.resize(sector_data_size);
-				sector_data_r.get_bytes(compressed_data.data(), sector_data_size - 1);
-			}
-		};
+		size_t current_sector_size = std::min(sector_size, be.size - current_sector * sector_size);
 
-		size_t current_sector_size = sector_data.size();
-		if (current_sector == compressed_sectors.size() - 2) current_sector_size = be.size % sector_size;
+		const uint8_t* input;
+		if (be.flags & 0x10000) {
+			if (compressed_data.size() < sector_data_size) compressed_data.resize(sector_data_size);
+			make_encrypted_reader(r, sector_data_size, key + (uint32_t)current_sector, crypt_table).get_bytes(compressed_data.data(), sector_data_size);
+			input = compressed_data.data();
+		} else input = read_sector_data(r, sector_data_size);
 
-		if (sector_data_size == current_sector_size && sector_data_size <= sector_size) {
-			if (be.flags & 0x10000) make_encrypted_reader(r, sector_data_size, key + (uint32_t)current_sector, crypt_table).get_bytes(sector_data.data(), sector_data_size);
-			else r.get_bytes(sector_data.data(), sector_data_size);
-		} else {
-			if (be.flags & 0x10000) get_data(make_encrypted_reader(r, sector_data_size, key + (uint32_t)current_sector, crypt_table));
-			else get_data(r);
-			if (compression_flags == 8) decompress(compressed_data.data(), sector_data_size, sector_data.data(), current_sector_size);
-			else {
-				size_t input_size = sector_data_size;
-				auto swap_buffers = [&](size_t new_input_size) {
-					input_size = new_input_size;
-					std::swap(compressed_data, sector_data);
-					if (compressed_data.size() < sector_data_size) compressed_data.resize(sector_data_size);
-					if (sector_data.size() < current_sector_size) sector_data.resize(current_sector_size);
-				};
-				if (compression_flags & 1) {
-					compression_flags &= ~1;
-					size_t out_size = decompress_huffman(compressed_data.data(), input_size, sector_data.data(), current_sector_size);
-					if (compression_flags) swap_buffers(out_size);
-				}
-				if (compression_flags & 0x40) {
-					compression_flags &= ~0x40;
-					size_t out_size = decompress_adpcm(compressed_data.data(), input_size, sector_data.data(), current_sector_size, 1);
-					if (compression_flags) swap_buffers(out_size);
-				}
-				if (compression_flags & 0x80) {
-					compression_flags &= ~0x80;
-					size_t out_size = decompress_adpcm(compressed_data.data(), input_size, sector_data.data(), current_sector_size, 2);
-					if (compression_flags) swap_buffers(out_size);
-				}
-				if (compression_flags != 0) error("mpq: %s: unsupported compression flags %d", filename, compression_flags);
-			}
+		if (sector_data_size == current_sector_size) {
+			sector = input;
+			return;
 		}
 
+		int compression_flags = 8;
+		if (be.flags & 0x200) {
+			if (sector_data_size == 0) error("mpq: %s: empty sector", filename);
+			compression_flags = *input++;
+			--sector_data_size;
+		}
+		if (compression_flags == 8) decompress(input, sector_data_size, sector_data.data(), current_sector_size);
+		else {
+			size_t input_size = sector_data_size;
+			auto swap_buffers = [&](size_t new_input_size) {
+				input_size = new_input_size;
+				std::swap(compressed_data, sector_data);
+				input = compressed_data.data();
+				if (sector_data.size() < current_sector_size) sector_data.resize(current_sector_size);
+			};
+			if (compression_flags & 1) {
+				compression_flags &= ~1;
+				size_t out_size = decompress_huffman(input, input_size, sector_data.data(), current_sector_size);
+				if (compression_flags) swap_buffers(out_size);
+			}
+			if (compression_flags & 0x40) {
+				compression_flags &= ~0x40;
+				size_t out_size = decompress_adpcm(input, input_size, sector_data.data(), current_sector_size, 1);
+				if (compression_flags) swap_buffers(out_size);
+			}
+			if (compression_flags & 0x80) {
+				compression_flags &= ~0x80;
+				size_t out_size = decompress_adpcm(input, input_size, sector_data.data(), current_sector_size, 2);
+				if (compression_flags) swap_buffers(out_size);
+			}
+			if (compression_flags != 0) error("mpq: %s: unsupported compression flags %d", filename, compression_flags);
+		}
+		sector = sector_data.data();
 	}
 
 	void get_bytes(uint8_t* dst, size_t n) {
 		if (file_position + n > be.size) error("mpq: %s: attempt to read past end", filename);
+		if (!n) return;
 		if (file_position / sector_size != current_sector) read_sector();
 		size_t sector_offset = file_position % sector_size;
 		while (sector_size - sector_offset < n) {
 			size_t n_read = sector_size - sector_offset;
-			memcpy(dst, &sector_data[sector_offset], n_read);
+			memcpy(dst, sector + sector_offset, n_read);
 			dst += n_read;
 			n -= n_read;
 			file_position += n_read;
@@ -1145,7 +1355,7 @@ struct mpq_archive_file_reader {
 			sector_offset = 0;
 		}
 		if (n && sector_size - sector_offset >= n) {
-			memcpy(dst, &sector_data[sector_offset], n);
+			memcpy(dst, sector + sector_offset, n);
 			file_position += n;
 		}
 	}
@@ -1296,20 +1506,118 @@ struct mpq_file {
 	}
 };
 
-template<typename mpq_file_T = mpq_file<>>
+// An mpq_file that reads the archive through a mapped_file_reader, so
+// sectors are decompressed straight from the mapping.
+struct mapped_mpq_file {
+	mapped_file_reader<> file;
+	mpq_archive_reader<mapped_file_reader<>> mpq;
+	explicit mapped_mpq_file(a_string filename) : file(std::move(filename)), mpq(file) {}
+	// mpq refers to file, so neither can be moved.
+	mapped_mpq_file(const mapped_mpq_file&) = delete;
+	mapped_mpq_file(mapped_mpq_file&&) = delete;
+	mapped_mpq_file& operator=(const mapped_mpq_file&) = delete;
+	mapped_mpq_file& operator=(mapped_mpq_file&&) = delete;
+	void operator()(a_vector<uint8_t>& dst, a_string filename) {
+		auto file_r = mpq.open(std::move(filename));
+		size_t len = file_r.size();
+		dst.resize(len);
+		file_r.get_bytes(dst.data(), len);
+	}
+};
+
+// Without mmap, mapped_file reads the whole file into memory, which is not
+// what we want for the large data archives.
+#ifdef BWGAME_DATA_LOADING_MMAP
+using default_mpq_file = mapped_mpq_file;
+#else
+using default_mpq_file = mpq_file<>;
+#endif
+
+// A bounded cache of decompressed files, keyed by archive and file name.
+// When it holds more than max_size bytes, the least recently used files are
+// dropped. It can be shared between loaders and threads. Archives are only
+// identified by name, so the cache must be cleared if they change on disk.
+struct decompressed_file_cache {
+	struct entry {
+		a_string key;
+		a_vector<uint8_t> data;
+	};
+	size_t max_size = 64 * 1024 * 1024;
+	size_t size = 0;
+	size_t hits = 0;
+	size_t misses = 0;
+	// Most recently used first.
+	a_list<entry> entries;
+	a_unordered_map<a_string, a_list<entry>::iterator> index;
+	std::mutex mut;
+
+	decompressed_file_cache() = default;
+	explicit decompressed_file_cache(size_t max_size) : max_size(max_size) {}
+
+	// Copies the file into dst from the cache, or loads it with
+	// load(dst) and adds it to the cache.
+	template<typename load_F>
+	void get(a_vector<uint8_t>& dst, const a_string& archive, const a_string& filename, load_F&& load) {
+		a_string key = archive;
+		key += '\0';
+		key += filename;
+		{
+			std::lock_guard<std::mutex> l(mut);
+			auto i = index.find(key);
+			if (i != index.end()) {
+				++hits;
+				entries.splice(entries.begin(), entries, i->second);
+				dst = i->second->data;
+				return;
+			}
+			++misses;
+		}
+		load(dst);
+		if (dst.size() > max_size) return;
+		std::lock_guard<std::mutex> l(mut);
+		if (index.find(key) != index.end()) return;
+		entries.push_front({key, dst});
+		index[std::move(key)] = entries.begin();
+		size += dst.size();
+		while (size > max_size) {
+			auto& e = entries.back();
+			size -= e.data.size();
+			index.erase(e.key);
+			entries.pop_back();
+		}
+	}
+
+	void clear() {
+		std::lock_guard<std::mutex> l(mut);
+		entries.clear();
+		index.clear();
+		size = 0;
+	}
+};
+
+template<typename mpq_file_T = default_mpq_file>
 struct data_files_loader {
 	a_list<mpq_file_T> mpqs;
+	a_vector<a_string> mpq_filenames;
+	// If set, files are looked up here before they are decompressed.
+	decompressed_file_cache* cache = nullptr;
 
 	void add_mpq_file(a_string filename) {
-		mpqs.emplace_back(std::move(filename));
+		mpqs.emplace_back(filename);
+		mpq_filenames.push_back(std::move(filename));
 	}
 
 	void operator()(a_vector<uint8_t>& dst, a_string filename) {
+		size_t index = 0;
 		for (auto& v : mpqs) {
 			if (v.mpq.file_exists(filename)) {
-				v(dst, std::move(filename));
+				if (cache) cache->get(dst, mpq_filenames[index], filename, [&](a_vector<uint8_t>& dst) {
+					v(dst, filename);
+				});
+				else v(dst, std::move(filename));
 				return;
 			}
+			++index;
 		}
 		error("data_files_loader: %s: file not found", filename);
 	}
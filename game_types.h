@@ -5,6 +5,8 @@
 #include "data_types.h"
 #include "containers.h"
 
+#include <cstring>
+
 namespace bwgame {
 
 struct sprite_t;
@@ -80,6 +82,14 @@ struct object_container {
 		size_t n = std::min(allocation_granularity, max_size - size);
 		for (size_t i = 0; i != n; ++i) {
 			T* obj = &list.back()[i];
+			// unit_t has a user-provided constructor that leaves most of it
+			// uninitialized, so new objects are zeroed to make the fields of
+			// objects that have never been used well-defined, as they are in
+			// Broodwar's static arrays. state_copier remaps the pointers of
+			// every object, used or not, and state files save them all.
+			obj->~T();
+			memset((void*)obj, 0, sizeof(T));
+			new (obj) T();
 			obj->index = size == 0 ? 0 : max_size - size;
 			if (add_new_to_free) free_list.push_back(*obj);
 			++size;
@@ -309,73 +319,154 @@ struct regions_t {
 struct creep_life_t {
 	int recede_timer = 0;
 	int check_dead_unit_timer = 0;
-	
+
+	enum : uint16_t { none = 0xffff };
+
 	struct entry {
-		std::pair<entry*, entry*> hash_link;
-		std::pair<entry*, entry*> list_link;
 		xy_t<size_t> tile_pos;
 		size_t n_neighboring_creep_tiles = 0;
+		uint16_t hash_next = none;
+		uint16_t list_slot = none;
 	};
-	struct entry_hash_table {
-		std::array<intrusive_list<entry, void, &entry::hash_link>, 0x200> buckets;
-		entry* find(xy_t<size_t> tile_pos) {
-			size_t index = (tile_pos.y * 7 + tile_pos.x) % buckets.size();
-			for (auto& v : buckets[index]) {
-				if (v.tile_pos == tile_pos) return &v;
-			}
-			return nullptr;
-		}
-		void remove(entry* v) {
-			size_t index = (v->tile_pos.y * 7 + v->tile_pos.x) % buckets.size();
-			buckets[index].remove(*v);
-		}
-		void insert(entry* v) {
-			size_t index = (v->tile_pos.y * 7 + v->tile_pos.x) % buckets.size();
-			buckets[index].push_front(*v);
+	// Receding creep tiles with the same number of neighboring creep tiles.
+	// recede_creep picks an entry by its position counted from the most
+	// recently added one, so the entries are kept in the order they were
+	// added. Removing an entry leaves its slot empty instead of moving the
+	// others, and count_tree is a Fenwick tree over the number of entries
+	// in the slots, so the entry at any position is found in O(log n).
+	// The slots are compacted when they run out.
+	struct list_t {
+		a_vector<uint16_t> slots;
+		a_vector<uint16_t> count_tree = a_vector<uint16_t>(1);
+		size_t size = 0;
+		bool empty() const {
+			return size == 0;
 		}
 	};
-	std::array<intrusive_list<entry, void, &entry::list_link>, 9> lists;
-	std::array<size_t, 9> lists_size{};
-	intrusive_list<entry, void, &entry::list_link> free_list;
-	size_t free_list_size = 0;
-	entry_hash_table table;
-	
+	std::array<list_t, 9> lists;
+	// Unused entry indices, the next one to be used last.
+	a_vector<uint16_t> free_list;
+	// Heads of the hash chains of entries, linked through hash_next.
+	std::array<uint16_t, 0x200> table;
+
 	a_vector<entry> entry_container = a_vector<entry>(1024);
-	
+
 	creep_life_t() {
-		for (auto& v : entry_container) {
-			free_list.push_back(v);
-			++free_list_size;
+		free_list.reserve(entry_container.size());
+		for (size_t i = entry_container.size(); i;) free_list.push_back((uint16_t)--i);
+		table.fill(none);
+	}
+
+	size_t free_list_size() const {
+		return free_list.size();
+	}
+
+	entry* find(xy_t<size_t> tile_pos) {
+		for (uint16_t i = table[table_index(tile_pos)]; i != none; i = entry_container[i].hash_next) {
+			if (entry_container[i].tile_pos == tile_pos) return &entry_container[i];
 		}
+		return nullptr;
 	}
-	creep_life_t(creep_life_t&&) = default;
-	creep_life_t(const creep_life_t& n) {
-		*this = n;
+
+	// Returns the entry at the given index from the front (the most recently
+	// added end) of the list of entries with n_neighbors neighboring creep
+	// tiles.
+	entry* list_at(size_t n_neighbors, size_t index) {
+		auto& list = lists[n_neighbors];
+		return &entry_container[list.slots[list_find(list, list.size - 1 - index)]];
 	}
-	creep_life_t& operator=(creep_life_t&&) = default;
-	creep_life_t& operator=(const creep_life_t& n) {
-		recede_timer = n.recede_timer;
-		check_dead_unit_timer = n.check_dead_unit_timer;
-		for (size_t i = 0; i != entry_container.size(); ++i) {
-			entry_container[i].tile_pos = n.entry_container[i].tile_pos;
-			entry_container[i].n_neighboring_creep_tiles = n.entry_container[i].n_neighboring_creep_tiles;
+
+	entry* add(xy_t<size_t> tile_pos, size_t n_neighbors) {
+		if (free_list.empty()) return nullptr;
+		uint16_t index = free_list.back();
+		free_list.pop_back();
+		auto* v = &entry_container[index];
+		v->tile_pos = tile_pos;
+		v->n_neighboring_creep_tiles = n_neighbors;
+		list_push(n_neighbors, index);
+		auto& head = table[table_index(tile_pos)];
+		v->hash_next = head;
+		head = index;
+		return v;
+	}
+
+	void remove(entry* v) {
+		uint16_t index = (uint16_t)(v - entry_container.data());
+		list_remove(v);
+		uint16_t* i = &table[table_index(v->tile_pos)];
+		while (*i != index) i = &entry_container[*i].hash_next;
+		*i = v->hash_next;
+		v->hash_next = none;
+		v->n_neighboring_creep_tiles = 9;
+		free_list.push_back(index);
+	}
+
+	void set_n_neighbors(entry* v, size_t n_neighbors) {
+		list_remove(v);
+		v->n_neighboring_creep_tiles = n_neighbors;
+		list_push(n_neighbors, (uint16_t)(v - entry_container.data()));
+	}
+
+	// Rebuilds count_tree from the slots, with room for capacity slots.
+	// capacity must be a power of two.
+	static void list_build_counts(list_t& list, size_t capacity) {
+		list.count_tree.assign(capacity + 1, 0);
+		for (size_t i = 1; i <= capacity; ++i) {
+			if (i <= list.slots.size() && list.slots[i - 1] != none) ++list.count_tree[i];
+			size_t parent = i + (i & (0 - i));
+			if (parent <= capacity) list.count_tree[parent] = (uint16_t)(list.count_tree[parent] + list.count_tree[i]);
+		}
+	}
+
+private:
+	static size_t table_index(xy_t<size_t> tile_pos) {
+		return (tile_pos.y * 7 + tile_pos.x) % std::tuple_size<decltype(table)>::value;
+	}
+	static void list_count_add(list_t& list, size_t slot, int n) {
+		for (size_t i = slot + 1; i < list.count_tree.size(); i += i & (0 - i)) {
+			list.count_tree[i] = (uint16_t)(list.count_tree[i] + n);
 		}
-		auto assemble = [&](auto& dst, auto& src) {
-			dst.clear();
-			for (auto& v : src) {
-				dst.push_back(entry_container[&v - n.entry_container.data()]);
+	}
+	// Returns the slot of the entry with n entries before it.
+	static size_t list_find(const list_t& list, size_t n) {
+		size_t capacity = list.count_tree.size() - 1;
+		size_t r = 0;
+		for (size_t step = capacity; step; step /= 2) {
+			if (r + step <= capacity && list.count_tree[r + step] <= n) {
+				r += step;
+				n -= list.count_tree[r];
 			}
-		};
-		for (size_t i = 0; i != lists.size(); ++i) {
-			assemble(lists[i], n.lists[i]);
-			lists_size[i] = n.lists_size[i];
 		}
-		assemble(free_list, n.free_list);
-		free_list_size = n.free_list_size;
-		for (size_t i = 0; i != table.buckets.size(); ++i) {
-			assemble(table.buckets[i], n.table.buckets[i]);
+		return r;
+	}
+	void list_compact(list_t& list) {
+		size_t capacity = 32;
+		while (capacity < list.size * 2) capacity *= 2;
+		size_t n = 0;
+		for (uint16_t index : list.slots) {
+			if (index == none) continue;
+			list.slots[n] = index;
+			entry_container[index].list_slot = (uint16_t)n;
+			++n;
 		}
-		return *this;
+		list.slots.resize(n);
+		list.slots.reserve(capacity);
+		list_build_counts(list, capacity);
+	}
+	void list_push(size_t n_neighbors, uint16_t index) {
+		auto& list = lists[n_neighbors];
+		if (list.slots.size() == list.count_tree.size() - 1) list_compact(list);
+		entry_container[index].list_slot = (uint16_t)list.slots.size();
+		list_count_add(list, list.slots.size(), 1);
+		list.slots.push_back(index);
+		++list.size;
+	}
+	void list_remove(entry* v) {
+		auto& list = lists[v->n_neighboring_creep_tiles];
+		list.slots[v->list_slot] = none;
+		list_count_add(list, v->list_slot, -1);
+		--list.size;
+		v->list_slot = none;
 	}
 };
 
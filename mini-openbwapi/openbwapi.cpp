@@ -3,6 +3,8 @@
 #include "../bwgame.h"
 #include "../actions.h"
 #include "../replay.h"
+#include "../replay_saver.h"
+#include "../state_file.h"
 #ifdef OPENBW_ENABLE_UI
 #include "../ui/ui.h"
 #endif
@@ -989,20 +991,31 @@ int Bullet::getType() const {
 
 
 struct full_state {
-	bwgame::global_state& global_st = *g_global_st;
+	// The shared g_global_st, until a global state is loaded into this game.
+	// Other games hold pointers into g_global_st, so a loaded global state
+	// goes into own_global_st instead.
+	bwgame::global_state* global_st = &*g_global_st;
+	std::unique_ptr<bwgame::global_state> own_global_st;
 	bwgame::game_state game_st;
 	bwgame::state st;
 	bwgame::action_state action_st;
 	bwgame::replay_state replay_st;
 	full_state() {
-		st.global = &global_st;
+		st.global = global_st;
 		st.game = &game_st;
 	}
 	void global_init() {
-		if (&global_st == &*g_global_st) {
+		if (global_st == &*g_global_st) {
 			g_global_init();
 		}
 	}
+	template<typename reader_T>
+	void load_global_state(reader_T& r) {
+		auto new_global_st = std::make_unique<bwgame::global_state>();
+		bwgame::load_global_state(r, *new_global_st);
+		own_global_st = std::move(new_global_st);
+		global_st = &*own_global_st;
+	}
 };
 
 struct saved_state {
@@ -1053,7 +1066,7 @@ struct Game_impl {
 
 		fst.game_st = bwgame::game_state();
 		st = bwgame::state();
-		st.global = &fst.global_st;
+		st.global = fst.global_st;
 		st.game = &fst.game_st;
 
 		fst.global_init();
@@ -1243,6 +1256,64 @@ struct Game_impl {
 		for (auto& v : snapshots) r.push_back(v.first);
 		return r;
 	}
+
+	// The global state, the game state and the state are saved to separate
+	// files, so that many states can share one game state. They must be
+	// loaded in that order, as each refers to the ones before it; loading
+	// one discards the ones after it.
+	void save_global_state(const std::string& filename) {
+		fst.global_init();
+		bwgame::data_loading::file_writer<> w(filename.c_str());
+		bwgame::save_global_state(w, *fst.global_st);
+	}
+	void load_global_state(const std::string& filename) {
+		bwgame::data_loading::file_reader<> r(filename.c_str());
+		fst.game_st = bwgame::game_state();
+		st = bwgame::state();
+		fst.load_global_state(r);
+		st.global = fst.global_st;
+		st.game = &fst.game_st;
+		funcs.reset_bwapi();
+	}
+	void save_game_state(const std::string& filename) {
+		bwgame::data_loading::file_writer<> w(filename.c_str());
+		bwgame::save_game_state(w, fst.game_st, *fst.global_st);
+	}
+	void load_game_state(const std::string& filename) {
+		fst.global_init();
+		bwgame::data_loading::file_reader<> r(filename.c_str());
+		st = bwgame::state();
+		st.global = fst.global_st;
+		st.game = &fst.game_st;
+		bwgame::load_game_state(r, fst.game_st, *fst.global_st);
+		funcs.reset_bwapi();
+	}
+	void save_state(const std::string& filename) {
+		bwgame::data_loading::file_writer<> w(filename.c_str());
+		w.put<int32_t>(vars.local_player_id);
+		w.put<int32_t>(vars.enemy_player_id);
+		w.put<uint8_t>(vars.is_replay);
+		w.put<uint8_t>(vars.game_type_melee);
+		w.put<int32_t>(vars.local_player_race);
+		w.put<int32_t>(vars.enemy_player_race);
+		bwgame::save_state(w, st);
+		bwgame::save_action_state(w, action_st, st);
+		if (vars.is_replay) bwgame::save_replay_state(w, fst.replay_st);
+	}
+	void load_state(const std::string& filename) {
+		bwgame::data_loading::file_reader<> r(filename.c_str());
+		vars.local_player_id = r.get<int32_t>();
+		vars.enemy_player_id = r.get<int32_t>();
+		vars.is_replay = r.get<uint8_t>() != 0;
+		vars.game_type_melee = r.get<uint8_t>() != 0;
+		vars.local_player_race = r.get<int32_t>();
+		vars.enemy_player_race = r.get<int32_t>();
+		bwgame::load_state(r, st);
+		bwgame::load_action_state(r, action_st, st);
+		if (vars.is_replay) bwgame::load_replay_state(r, fst.replay_st);
+
+		funcs.reset_bwapi();
+	}
 	
 	void set_random_seed(uint32_t value) {
 		funcs.st.lcg_rand_state = value;
@@ -1415,6 +1486,30 @@ std::vector<std::string> Game::listSnapshots() {
   return impl->list_snapshots();
 }
 
+void Game::saveGlobalState(const std::string& filename) {
+	impl->save_global_state(filename);
+}
+
+void Game::loadGlobalState(const std::string& filename) {
+	impl->load_global_state(filename);
+}
+
+void Game::saveGameState(const std::string& filename) {
+	impl->save_game_state(filename);
+}
+
+void Game::loadGameState(const std::string& filename) {
+	impl->load_game_state(filename);
+}
+
+void Game::saveState(const std::string& filename) {
+	impl->save_state(filename);
+}
+
+void Game::loadState(const std::string& filename) {
+	impl->load_state(filename);
+}
+
 Unit Game::createUnit(Player player, int type, Position pos)
 {
   return impl->create_unit(player->getID(), type, pos);
@@ -0,0 +1,128 @@
+#ifndef BWGAME_PROFILER_H
+#define BWGAME_PROFILER_H
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+#ifdef OPENBW_ENABLE_PROFILER
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#else
+#include <chrono>
+#endif
+#endif
+
+namespace bwgame {
+
+// Call and cycle counters for a few hot paths in state_functions.
+// The hooks are only compiled in when OPENBW_ENABLE_PROFILER is defined,
+// and only record anything while state_functions::profiler is set.
+// Times are inclusive; a nested call (eg. iscript_execute from within an
+// order) is counted towards both.
+
+struct profiler_counter {
+	uint64_t calls = 0;
+	uint64_t cycles = 0;
+};
+
+struct profiler_state {
+	std::array<profiler_counter, 189> orders;
+	std::array<profiler_counter, 69> iscript_opcodes;
+	profiler_counter pathfinder_find;
+	profiler_counter reveal_sight_at;
+	profiler_counter unit_finder_search;
+
+	void clear() {
+		*this = profiler_state();
+	}
+
+	void add(const profiler_state& n) {
+		auto add_counter = [](profiler_counter& a, const profiler_counter& b) {
+			a.calls += b.calls;
+			a.cycles += b.cycles;
+		};
+		for (size_t i = 0; i != orders.size(); ++i) add_counter(orders[i], n.orders[i]);
+		for (size_t i = 0; i != iscript_opcodes.size(); ++i) add_counter(iscript_opcodes[i], n.iscript_opcodes[i]);
+		add_counter(pathfinder_find, n.pathfinder_find);
+		add_counter(reveal_sight_at, n.reveal_sight_at);
+		add_counter(unit_finder_search, n.unit_finder_search);
+	}
+};
+
+#ifdef OPENBW_ENABLE_PROFILER
+
+static inline uint64_t profiler_timestamp() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+	return __rdtsc();
+#else
+	return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+struct profiler_scope {
+	profiler_counter* counter;
+	uint64_t start = 0;
+	explicit profiler_scope(profiler_counter* counter) : counter(counter) {
+		if (counter) start = profiler_timestamp();
+	}
+	~profiler_scope() {
+		if (counter) {
+			++counter->calls;
+			counter->cycles += profiler_timestamp() - start;
+		}
+	}
+	profiler_scope(const profiler_scope&) = delete;
+	profiler_scope& operator=(const profiler_scope&) = delete;
+};
+
+// Attributes the time between consecutive calls to next() to the index
+// passed to the previous call; the last index gets the remainder when
+// the timer goes out of scope.
+template<size_t N>
+struct profiler_sequence_timer {
+	std::array<profiler_counter, N>* counters;
+	size_t index = N;
+	uint64_t start = 0;
+	explicit profiler_sequence_timer(std::array<profiler_counter, N>* counters) : counters(counters) {}
+	void next(size_t new_index) {
+		if (!counters) return;
+		uint64_t now = profiler_timestamp();
+		if (index < N) {
+			auto& c = (*counters)[index];
+			++c.calls;
+			c.cycles += now - start;
+		}
+		index = new_index;
+		start = now;
+	}
+	~profiler_sequence_timer() {
+		next(N);
+	}
+	profiler_sequence_timer(const profiler_sequence_timer&) = delete;
+	profiler_sequence_timer& operator=(const profiler_sequence_timer&) = delete;
+};
+
+#define OPENBW_PROFILE_SCOPE(funcs, name) \
+	::bwgame::profiler_scope profiler_scope_##name((funcs).profiler ? &(funcs).profiler->name : nullptr)
+#define OPENBW_PROFILE_SCOPE_INDEXED(funcs, name, index) \
+	::bwgame::profiler_scope profiler_scope_##name((funcs).profiler && (size_t)(index) < (funcs).profiler->name.size() ? &(funcs).profiler->name[(size_t)(index)] : nullptr)
+#define OPENBW_PROFILE_SEQUENCE(funcs, name) \
+	::bwgame::profiler_sequence_timer<std::tuple_size<decltype(::bwgame::profiler_state::name)>::value> profiler_sequence_##name((funcs).profiler ? &(funcs).profiler->name : nullptr)
+#define OPENBW_PROFILE_SEQUENCE_NEXT(name, index) \
+	profiler_sequence_##name.next((size_t)(index))
+
+#else
+
+#define OPENBW_PROFILE_SCOPE(funcs, name)
+#define OPENBW_PROFILE_SCOPE_INDEXED(funcs, name, index)
+#define OPENBW_PROFILE_SEQUENCE(funcs, name)
+#define OPENBW_PROFILE_SEQUENCE_NEXT(name, index)
+
+#endif
+
+}
+
+#endif
@@ -6,43 +6,162 @@
 #include "korean.h"
 #include "bwgame.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BWGAME_CRC32_PCLMUL
+#include <immintrin.h>
+#endif
+
 namespace bwgame {
 
 namespace data_loading {
 
-struct crc32_t {
-	std::array<uint32_t, 256> table;
-	crc32_t() {
+// The tables for slicing-by-8: tables[0] is the usual byte at a time table,
+// and tables[k][i] is the crc of byte i followed by k zero bytes.
+static inline const std::array<std::array<uint32_t, 256>, 8>& crc32_tables() {
+	static const auto tables = []() {
+		std::array<std::array<uint32_t, 256>, 8> r;
 		for (uint32_t i = 0; i != 256; ++i) {
 			uint32_t v = i;
 			for (size_t b = 0; b != 8; ++b) {
 				v = (v >> 1) ^ (v & 1 ? 0xedb88320 : 0);
 			}
-			table[i] = v;
+			r[0][i] = v;
 		}
-	}
-	uint32_t operator()(const uint8_t* data, size_t data_size) {
+		for (size_t k = 1; k != 8; ++k) {
+			for (size_t i = 0; i != 256; ++i) r[k][i] = (r[k - 1][i] >> 8) ^ r[0][r[k - 1][i] & 0xff];
+		}
+		return r;
+	}();
+	return tables;
+}
+
+static inline bool crc32_has_pclmul() {
+#ifdef BWGAME_CRC32_PCLMUL
+	static const bool r = []() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("pclmul") != 0;
+	}();
+	return r;
+#else
+	return false;
+#endif
+}
+
+// Computes the crc32 of data. The result is not inverted, which is what
+// replays use. Large inputs are folded with carry-less multiplication if
+// the cpu supports it, and the rest is done 8 bytes at a time with tables.
+struct crc32_t {
+	bool use_pclmul = crc32_has_pclmul();
+
+	uint32_t operator()(const uint8_t* data, size_t data_size) const {
 		uint32_t r = 0xffffffff;
+#ifdef BWGAME_CRC32_PCLMUL
+		if (use_pclmul && data_size >= 64) {
+			size_t n = data_size & ~(size_t)15;
+			r = update_pclmul(r, data, n);
+			data += n;
+			data_size -= n;
+		}
+#endif
+		return update_slicing_by_8(r, data, data_size);
+	}
+
+	static uint32_t update_bytewise(uint32_t r, const uint8_t* data, size_t data_size) {
+		auto& table = crc32_tables()[0];
 		const uint8_t* end = data + data_size;
 		for (; data != end; ++data) {
 			r = (r >> 8) ^ table[(r ^ *data) & 0xff];
 		}
 		return r;
 	}
+
+	static uint32_t update_slicing_by_8(uint32_t r, const uint8_t* data, size_t data_size) {
+		auto& t = crc32_tables();
+		for (; data_size >= 8; data_size -= 8, data += 8) {
+			uint32_t a = r ^ value_at<uint32_t, true>(data);
+			uint32_t b = value_at<uint32_t, true>(data + 4);
+			r = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24];
+			r ^= t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+		}
+		return update_bytewise(r, data, data_size);
+	}
+
+#ifdef BWGAME_CRC32_PCLMUL
+	__attribute__((target("pclmul")))
+	static __m128i pclmul_fold(__m128i x, __m128i k, __m128i next) {
+		__m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+		__m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+		return _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+	}
+
+	// Folds 64 bytes at a time with carry-less multiplication, as described
+	// in Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+	// Instruction". data_size must be a multiple of 16, and at least 64.
+	__attribute__((target("pclmul")))
+	static uint32_t update_pclmul(uint32_t r, const uint8_t* data, size_t data_size) {
+		const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+		const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+		const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+		const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+		const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+		const __m128i* p = (const __m128i*)data;
+
+		__m128i x1 = _mm_xor_si128(_mm_loadu_si128(p), _mm_cvtsi32_si128((int)r));
+		__m128i x2 = _mm_loadu_si128(p + 1);
+		__m128i x3 = _mm_loadu_si128(p + 2);
+		__m128i x4 = _mm_loadu_si128(p + 3);
+		p += 4;
+		data_size -= 64;
+
+		for (; data_size >= 64; data_size -= 64, p += 4) {
+			x1 = pclmul_fold(x1, k1k2, _mm_loadu_si128(p));
+			x2 = pclmul_fold(x2, k1k2, _mm_loadu_si128(p + 1));
+			x3 = pclmul_fold(x3, k1k2, _mm_loadu_si128(p + 2));
+			x4 = pclmul_fold(x4, k1k2, _mm_loadu_si128(p + 3));
+		}
+
+		x1 = pclmul_fold(x1, k3k4, x2);
+		x1 = pclmul_fold(x1, k3k4, x3);
+		x1 = pclmul_fold(x1, k3k4, x4);
+		for (; data_size >= 16; data_size -= 16, ++p) {
+			x1 = pclmul_fold(x1, k3k4, _mm_loadu_si128(p));
+		}
+
+		// Fold 128 bits to 64, then reduce to 32 (Barrett reduction).
+		__m128i x = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+		x = _mm_xor_si128(_mm_srli_si128(x, 4), _mm_clmulepi64_si128(_mm_and_si128(x, mask32), k5k0, 0x00));
+		__m128i t = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), poly, 0x10);
+		t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+		x = _mm_xor_si128(x, t);
+		return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x, 4));
+	}
+#endif
 };
 
 template<typename base_reader_T, bool default_little_endian = true>
 struct replay_file_reader {
 	crc32_t crc32;
 	base_reader_T& r;
+	a_vector<uint8_t> compressed_data;
 	replay_file_reader(base_reader_T& r) : r(r) {
 	}
 
+	// Readers over memory return the compressed data in place; other
+	// readers copy it into compressed_data.
+	template<typename reader_T, typename std::enable_if<data_loading::has_get_n<reader_T>::value>::type* = nullptr>
+	const uint8_t* read_compressed(reader_T& r, size_t n) {
+		return r.get_n(n);
+	}
+	template<typename reader_T, typename std::enable_if<!data_loading::has_get_n<reader_T>::value>::type* = nullptr>
+	const uint8_t* read_compressed(reader_T& r, size_t n) {
+		compressed_data.resize(n);
+		r.get_bytes(compressed_data.data(), n);
+		return compressed_data.data();
+	}
+
 	void get_bytes(uint8_t* output, size_t output_size) {
 		uint32_t crc32_sum = r.template get<uint32_t>();
 		size_t segments = r.template get<uint32_t>();
-		
-		a_vector<uint8_t> compressed_data;
 
 		size_t output_pos = 0;
 		for (size_t i = 0; i != segments; ++i) {
@@ -55,9 +174,7 @@ struct replay_file_reader {
 			if (segment_input_size == segment_output_size) {
 				r.get_bytes(output + output_pos, segment_input_size);
 			} else {
-				compressed_data.resize(segment_input_size);
-				r.get_bytes(compressed_data.data(), segment_input_size);
-				decompress(compressed_data.data(), segment_input_size, output + output_pos, segment_output_size);
+				decompress(read_compressed(r, segment_input_size), segment_input_size, output + output_pos, segment_output_size);
 			}
 			output_pos += segment_output_size;
 		}
@@ -89,12 +206,155 @@ struct replay_state {
 	int game_type = 0;
 };
 
+// The game info section at the start of a replay: the players, the map
+// and the game settings. Only the first two sections of the replay are
+// decompressed to read it, so it is much cheaper than loading the replay.
+struct replay_info {
+	struct slot_t {
+		int player_id = 0;
+		int controller = 0;
+		int race = 0;
+		int force = 0;
+		a_string name;
+	};
+	bool is_broodwar = false;
+	int frame_count = 0;
+	uint32_t random_seed = 0;
+	a_string creator_name;
+	a_string game_name;
+	a_string map_name;
+	int map_width = 0;
+	int map_height = 0;
+	int game_speed = 0;
+	int game_type = 0;
+	int game_sub_type = 0;
+	int tileset = 0;
+	int victory_condition = 0;
+	int resource_type = 0;
+	int create_initial_units = 0;
+	int tournament_mode = 0;
+	uint32_t starting_minerals = 0;
+	uint32_t starting_gas = 0;
+	std::array<slot_t, 12> slots;
+	std::array<uint32_t, 8> player_color{};
+	std::array<uint8_t, 8> create_melee_units_for_player{};
+};
+
+static inline replay_info parse_replay_game_info(const std::array<uint8_t, 633>& game_info_buffer) {
+	replay_info r;
+
+	data_loading::data_reader_le gir(game_info_buffer.data(), game_info_buffer.data() + game_info_buffer.size());
+	
+	r.is_broodwar = gir.get<uint8_t>() != 0;
+	r.frame_count = gir.get<uint32_t>();
+	gir.get<uint16_t>(); // campaign id
+	gir.get<uint8_t>(); // command byte ?
+	r.random_seed = gir.get<uint32_t>();
+	gir.get<std::array<uint8_t, 8>>(); // player bytes ?
+	gir.get<uint32_t>(); // ?
+	auto creator_name = gir.get<std::array<char, 24>>();
+	gir.get<uint32_t>(); // game flags?
+	r.map_width = gir.get<uint16_t>();
+	r.map_height = gir.get<uint16_t>();
+	gir.get<uint8_t>(); // active player acount
+	gir.get<uint8_t>(); // slot count
+	r.game_speed = gir.get<uint8_t>();
+	gir.get<uint8_t>(); // game state ?
+	r.game_type = gir.get<uint16_t>(); // game type ?
+	r.game_sub_type = gir.get<uint16_t>(); // game sub type ?
+	gir.get<uint32_t>(); // ?
+	r.tileset = gir.get<uint16_t>();
+	gir.get<uint8_t>(); // replay autosaved
+	gir.get<uint8_t>(); // computer player count?
+	auto game_name = gir.get<std::array<char, 25>>();
+	auto map_name = gir.get<std::array<char, 32>>();
+	gir.get<uint16_t>(); // game type ?
+	gir.get<uint16_t>(); // game sub type ?
+	gir.get<uint16_t>(); // sub type display ?
+	gir.get<uint16_t>(); // sub type label ?
+	r.victory_condition = gir.get<uint8_t>();
+	r.resource_type = gir.get<uint8_t>();
+	gir.get<uint8_t>(); // use standard unit stats
+	gir.get<uint8_t>(); // fog of war enabled
+	r.create_initial_units = gir.get<uint8_t>();
+	gir.get<uint8_t>(); // use fixed positions ?
+	gir.get<uint8_t>(); // restriction flags ?
+	gir.get<uint8_t>(); // allies enabled
+	gir.get<uint8_t>(); // teams enabled
+	gir.get<uint8_t>(); // cheats enabled
+	r.tournament_mode = gir.get<uint8_t>(); // tournament mode ?
+	gir.get<uint32_t>(); // victory condition value?
+	r.starting_minerals = gir.get<uint32_t>();
+	r.starting_gas = gir.get<uint32_t>();
+	gir.get<uint8_t>(); // ?
+	
+	auto arr_str = [&](auto& str) {
+		a_string r;
+		for (auto& v : str) {
+			if (!v) break;
+			if ((unsigned char)v >= 21) r += v;
+		}
+		return r;
+	};
+	r.creator_name = arr_str(creator_name);
+	r.game_name = arr_str(game_name);
+	r.map_name = arr_str(map_name);
+	a_string kn;
+	if (korean::korean_locale_to_utf8(r.map_name, kn)) r.map_name = kn;
+	
+	for (auto& v : r.slots) {
+		gir.get<uint32_t>(); // slot ?
+		v.player_id = gir.get<uint32_t>();
+		v.controller = gir.get<uint8_t>();
+		v.race = gir.get<uint8_t>();
+		v.force = gir.get<uint8_t>();
+		auto name = gir.get<std::array<char, 25>>();
+		v.name = arr_str(name);
+	}
+	
+	r.player_color = gir.get<std::array<uint32_t, 8>>();
+	r.create_melee_units_for_player = gir.get<std::array<uint8_t, 8>>();
+
+	return r;
+}
+
+// Reads the identifier and game info sections of a replay from r, which
+// is left at the start of the actions section.
+template<typename reader_T>
+replay_info load_replay_info(reader_T&& r) {
+	uint32_t identifier = r.template get<uint32_t>();
+	if (identifier != 0x53526572) error("load_replay_info: invalid identifier %#x", identifier);
+
+	std::array<uint8_t, 633> game_info_buffer;
+	r.get_bytes(game_info_buffer.data(), game_info_buffer.size());
+	return parse_replay_game_info(game_info_buffer);
+}
+
+// Reads the actions section of a replay from r, which must be at its start,
+// as left by load_replay_info.
+template<typename reader_T>
+a_vector<uint8_t> load_replay_actions(reader_T&& r) {
+	a_vector<uint8_t> data(r.template get<uint32_t>());
+	r.get_bytes(data.data(), data.size());
+	return data;
+}
+
+static inline replay_info load_replay_info_file(a_string filename) {
+	auto file_r = data_loading::mapped_file_reader<>(std::move(filename));
+	return load_replay_info(data_loading::make_replay_file_reader(file_r));
+}
+
+static inline replay_info load_replay_info_data(const uint8_t* data, size_t data_size) {
+	auto r = data_loading::data_reader_le(data, data + data_size);
+	return load_replay_info(data_loading::make_replay_file_reader(r));
+}
+
 struct replay_functions: action_functions {
 	replay_state& replay_st;
 	explicit replay_functions(state& st, action_state& action_st, replay_state& replay_st) : action_functions(st, action_st), replay_st(replay_st) {}
 	
 	void load_replay_file(a_string filename, bool initial_processing = true, std::vector<uint8_t>* get_map_data = nullptr) {
-		auto file_r = data_loading::file_reader<>(std::move(filename));
+		auto file_r = data_loading::mapped_file_reader<>(std::move(filename));
 		load_replay(data_loading::make_replay_file_reader(file_r), initial_processing, get_map_data);
 	}
 	void load_replay_data(const uint8_t* data, size_t data_size, bool initial_processing = true, std::vector<uint8_t>* get_map_data = nullptr) {
@@ -104,97 +364,17 @@ struct replay_functions: action_functions {
 	template<typename reader_T>
 	void load_replay(reader_T&& r, bool initial_processing = true, std::vector<uint8_t>* get_map_data = nullptr) {
 		
-		uint32_t identifier = r.template get<uint32_t>();
-		if (identifier != 0x53526572) error("load_replay: invalid identifier %#x", identifier);
+		auto info = load_replay_info(r);
 
-		std::array<uint8_t, 633> game_info_buffer;
-		r.get_bytes(game_info_buffer.data(), game_info_buffer.size());
-		
-		data_loading::data_reader_le gir(game_info_buffer.data(), game_info_buffer.data() + game_info_buffer.size());
-		
-		gir.get<uint8_t>(); // is broodwar
-		auto frame_count = gir.get<uint32_t>();
-		gir.get<uint16_t>(); // campaign id
-		gir.get<uint8_t>(); // command byte ?
-		uint32_t random_seed = gir.get<uint32_t>();
-		gir.get<std::array<uint8_t, 8>>(); // player bytes ?
-		gir.get<uint32_t>(); // ?
-		auto player_name = gir.get<std::array<char, 24>>();
-		gir.get<uint32_t>(); // game flags?
-		gir.get<uint16_t>(); // map width
-		gir.get<uint16_t>(); // map height
-		gir.get<uint8_t>(); // active player acount
-		gir.get<uint8_t>(); // slot count
-		gir.get<uint8_t>(); // game speed
-		gir.get<uint8_t>(); // game state ?
-		auto game_type = gir.get<uint16_t>(); // game type ?
-		gir.get<uint16_t>(); // game sub type ?
-		gir.get<uint32_t>(); // ?
-		gir.get<uint16_t>(); // tileset
-		gir.get<uint8_t>(); // replay autosaved
-		gir.get<uint8_t>(); // computer player count?
-		auto game_name = gir.get<std::array<char, 25>>();
-		auto map_name = gir.get<std::array<char, 32>>();
-		gir.get<uint16_t>(); // game type ?
-		gir.get<uint16_t>(); // game sub type ?
-		gir.get<uint16_t>(); // sub type display ?
-		gir.get<uint16_t>(); // sub type label ?
-		auto victory_condition = gir.get<uint8_t>(); // victory condition
-		int resource_type = gir.get<uint8_t>(); // resource type
-		gir.get<uint8_t>(); // use standard unit stats
-		gir.get<uint8_t>(); // fog of war enabled
-		auto create_initial_units = gir.get<uint8_t>();
-		gir.get<uint8_t>(); // use fixed positions ?
-		gir.get<uint8_t>(); // restriction flags ?
-		gir.get<uint8_t>(); // allies enabled
-		gir.get<uint8_t>(); // teams enabled
-		gir.get<uint8_t>(); // cheats enabled
-		auto tournament_mode = gir.get<uint8_t>(); // tournament mode ?
-		gir.get<uint32_t>(); // victory condition value?
-		auto starting_minerals = gir.get<uint32_t>(); // starting minerals
-		gir.get<uint32_t>(); // starting gas
-		gir.get<uint8_t>(); // ?
-		
-		(void)player_name;
-		(void)game_name;
-		
-		auto arr_str = [&](auto& str) {
-			a_string r;
-			for (auto& v : str) {
-				if (!v) break;
-				if ((unsigned char)v >= 21) r += v;
-			}
-			return r;
-		};
-		replay_st.map_name = arr_str(map_name);
-		a_string kn;
-		if (korean::korean_locale_to_utf8(replay_st.map_name, kn)) replay_st.map_name = kn;
-		
-		std::array<int, 12> slot_player_id;
-		std::array<int, 12> slot_controller;
-		std::array<int, 12> slot_race;
-		std::array<int, 12> slot_force;
-		
+		replay_st.map_name = info.map_name;
 		for (size_t i = 0; i != 12; ++i) {
-			gir.get<uint32_t>(); // slot ?
-			slot_player_id[i] = gir.get<uint32_t>(); // player id
-			slot_controller[i] = gir.get<uint8_t>(); // controller
-			slot_race[i] = gir.get<uint8_t>(); // race
-			slot_force[i] = gir.get<uint8_t>(); // force
-			auto name = gir.get<std::array<char, 25>>(); // player name
-			replay_st.player_name[i] = arr_str(name);
-			
-			action_st.player_id[i] = slot_player_id[i];
+			replay_st.player_name[i] = info.slots[i].name;
+			action_st.player_id[i] = info.slots[i].player_id;
 		}
+		replay_st.end_frame = info.frame_count;
+		replay_st.game_type = info.game_type;
 		
-		auto player_color = gir.get<std::array<uint32_t, 8>>(); // player colors
-		auto create_melee_units_for_player = gir.get<std::array<uint8_t, 8>>();
-		
-		replay_st.end_frame = frame_count;
-		replay_st.game_type = game_type;
-		
-		replay_st.actions_data_buffer.resize(r.template get<uint32_t>());
-		r.get_bytes(replay_st.actions_data_buffer.data(), replay_st.actions_data_buffer.size());
+		replay_st.actions_data_buffer = load_replay_actions(r);
 		
 		a_vector<uint8_t> map_buffer;
 		map_buffer.resize(r.template get<uint32_t>());
@@ -204,21 +384,21 @@ struct replay_functions: action_functions {
 		
 		game_load_functions game_load_funcs(st);
 		game_load_funcs.load_map_data(map_buffer.data(), map_buffer.size(), [&]() {
-			game_load_funcs.setup_info.victory_condition = victory_condition;
-			game_load_funcs.setup_info.starting_units = create_initial_units;
-			game_load_funcs.setup_info.tournament_mode = tournament_mode;
-			game_load_funcs.setup_info.resource_type = resource_type;
-			game_load_funcs.setup_info.starting_minerals = starting_minerals;
+			game_load_funcs.setup_info.victory_condition = info.victory_condition;
+			game_load_funcs.setup_info.starting_units = info.create_initial_units;
+			game_load_funcs.setup_info.tournament_mode = info.tournament_mode;
+			game_load_funcs.setup_info.resource_type = info.resource_type;
+			game_load_funcs.setup_info.starting_minerals = info.starting_minerals;
 			for (size_t i = 0; i != 12; ++i) {
-				st.players[i].controller = slot_controller[i];
-				st.players[i].race = (race_t)slot_race[i];
-				st.players[i].force = slot_force[i];
-				if (victory_condition == 0 && tournament_mode == 0) {
+				st.players[i].controller = info.slots[i].controller;
+				st.players[i].race = (race_t)info.slots[i].race;
+				st.players[i].force = info.slots[i].force;
+				if (info.victory_condition == 0 && info.tournament_mode == 0) {
 					if (i >= 8) game_load_funcs.setup_info.create_melee_units_for_player[i] = false;
-					else game_load_funcs.setup_info.create_melee_units_for_player[i] = create_melee_units_for_player[i] != 0;
+					else game_load_funcs.setup_info.create_melee_units_for_player[i] = info.create_melee_units_for_player[i] != 0;
 				}
 			}
-			st.lcg_rand_state = random_seed;
+			st.lcg_rand_state = info.random_seed;
 		}, initial_processing);
 		
 		std::array<int, 8> source_colors;
@@ -226,7 +406,7 @@ struct replay_functions: action_functions {
 			source_colors[i] = st.players[i].color;
 		}
 		for (size_t i = 0; i != 8; ++i) {
-			st.players[i].color = source_colors.at(player_color[i]);
+			st.players[i].color = source_colors.at(info.player_color[i]);
 		}
 	}
 	
@@ -239,6 +419,11 @@ struct replay_functions: action_functions {
 	bool is_done() {
 		return st.current_frame == replay_st.end_frame;
 	}
+
+	action_index make_replay_action_index() const {
+		auto& buf = replay_st.actions_data_buffer;
+		return make_action_index(buf.data(), buf.data() + buf.size(), action_st.player_id, replay_st.end_frame);
+	}
 	
 };
 
@@ -252,7 +437,7 @@ struct replay_player: game_player {
 	}
 	
 	void load_replay_file(a_string filename, bool initial_processing = true) {
-		auto file_r = data_loading::file_reader<>(std::move(filename));
+		auto file_r = data_loading::mapped_file_reader<>(std::move(filename));
 		load_replay(data_loading::make_replay_file_reader(file_r), initial_processing);
 	}
 	void load_replay_data(uint8_t* data, size_t data_size, bool initial_processing = true) {
@@ -0,0 +1,84 @@
+#ifndef BWGAME_REPLAY_BATCH_H
+#define BWGAME_REPLAY_BATCH_H
+
+#include "bwgame.h"
+#include "actions.h"
+#include "replay.h"
+
+#include <atomic>
+#include <thread>
+
+namespace bwgame {
+
+// Runs a batch of replays concurrently on a pool of threads.
+// All the simulations share the same global_state, which must already be
+// initialized and is only read from; every replay gets its own game_state,
+// state, action_state and replay_state.
+
+struct replay_batch_result {
+	a_string filename;
+	bool success = false;
+	a_string error_message;
+	int end_frame = 0;
+};
+
+// f(index, funcs) is called on the worker thread once the replay at
+// filenames[index] has been loaded, and is responsible for advancing it.
+// It may be called concurrently for different replays. An exception thrown
+// by f or by loading fails that replay only.
+// A thread_count of 0 uses std::thread::hardware_concurrency().
+template<typename F>
+a_vector<replay_batch_result> run_replay_batch(const global_state& global_st, const a_vector<a_string>& filenames, size_t thread_count, F&& f) {
+	a_vector<replay_batch_result> results(filenames.size());
+	if (thread_count == 0) thread_count = std::thread::hardware_concurrency();
+	if (thread_count == 0) thread_count = 1;
+	if (thread_count > filenames.size()) thread_count = filenames.size();
+
+	std::atomic<size_t> next_index{0};
+	auto worker = [&]() {
+		while (true) {
+			size_t index = next_index++;
+			if (index >= filenames.size()) break;
+			auto& r = results[index];
+			r.filename = filenames[index];
+			try {
+				game_state game_st;
+				state st;
+				st.global = &global_st;
+				st.game = &game_st;
+				action_state action_st;
+				replay_state replay_st;
+				replay_functions funcs(st, action_st, replay_st);
+				funcs.load_replay_file(filenames[index]);
+				r.end_frame = replay_st.end_frame;
+				f(index, funcs);
+				r.success = true;
+			} catch (const std::exception& e) {
+				r.error_message = e.what();
+			}
+		}
+	};
+
+	if (thread_count <= 1) {
+		worker();
+		return results;
+	}
+	a_vector<std::thread> threads;
+	threads.reserve(thread_count);
+	for (size_t i = 0; i != thread_count; ++i) {
+		threads.emplace_back(worker);
+	}
+	for (auto& v : threads) v.join();
+	return results;
+}
+
+// Plays every replay to the end.
+static inline a_vector<replay_batch_result> run_replay_batch(const global_state& global_st, const a_vector<a_string>& filenames, size_t thread_count = 0) {
+	return run_replay_batch(global_st, filenames, thread_count, [](size_t, replay_functions& funcs) {
+		while (!funcs.is_done()) funcs.next_frame();
+	});
+}
+
+}
+
+#endif
@@ -177,8 +177,24 @@ auto make_bit_writer(base_writer_T& writer) {
 	return bit_writer<base_writer_T, little_endian>(writer);
 }
 
+// How hard compress searches for matches. Every earlier position that
+// starts with the same two bytes is chained in a hash table; max_chain
+// limits how many of them are compared for each match, and the search stops
+// as soon as a match of nice_length bytes is found.
+struct compress_options {
+	size_t max_chain;
+	size_t nice_length;
+	// Compares every candidate in the window.
+	static compress_options best() {
+		return {4096, 518};
+	}
+	static compress_options fast() {
+		return {16, 32};
+	}
+};
+
 template<bool little_endian = true, typename writer_T>
-void compress(const uint8_t* input, size_t input_size, writer_T& writer) {
+void compress(const uint8_t* input, size_t input_size, writer_T& writer, compress_options options = compress_options::fast()) {
 	
 	auto write_length = [&](auto& w, int v) {
 		switch (v) {
@@ -341,7 +357,21 @@ void compress(const uint8_t* input, size_t input_size, writer_T& writer) {
 	const size_t max_2_distance = (64 << 2) - 1;
 	const size_t max_length = 518;
 	
-	a_vector<a_circular_vector<size_t>> lut(256);
+	const size_t hash_size = 0x1000;
+	const size_t window_size = 0x2000;
+	static_assert(window_size > max_distance + 1, "the window must hold every position within max_distance");
+	const size_t none = ~(size_t)0;
+	a_vector<size_t> head(hash_size, none);
+	a_vector<size_t> prev(window_size);
+	auto hash = [&](const uint8_t* p) {
+		return ((size_t)p[0] << 4 ^ p[1]) & (hash_size - 1);
+	};
+	auto insert = [&](size_t pos) {
+		if (pos + 1 >= input_size) return;
+		size_t h = hash(input + pos);
+		prev[pos & (window_size - 1)] = head[h];
+		head[h] = pos;
+	};
 	
 	auto w = make_bit_writer(writer);
 	
@@ -349,32 +379,34 @@ void compress(const uint8_t* input, size_t input_size, writer_T& writer) {
 	w.template put<uint8_t>(distance_bits);
 	
 	const uint8_t* ptr = input;
-	for (size_t pos = 0; pos != input_size; ++pos, ++ptr) {
+	for (size_t pos = 0; pos != input_size;) {
 		uint8_t c = *ptr;
 		
 		size_t best_length = 0;
 		size_t best_distance = 0;
-		auto& v = lut[c];
-		while (!v.empty() && pos - 1 - v.back() > max_distance) v.pop_back();
-		for (auto i = v.begin(); i != v.end(); ++i) {
-			size_t npos = *i;
-			size_t distance = pos - 1 - npos;
-			size_t length = 1;
-			++npos;
-			for (; pos + length != input_size && ptr[length] == input[npos] && length < max_length; ++length) {
-				++npos;
-				if (npos == pos) npos = *i;
-			}
-			if (length > best_length && (length > 2 || distance <= max_2_distance)) {
-				best_length = length;
-				best_distance = distance;
+		if (pos + 1 < input_size) {
+			size_t max_match_length = std::min(max_length, input_size - pos);
+			size_t chain = options.max_chain;
+			for (size_t i = head[hash(ptr)]; i != none && chain; i = prev[i & (window_size - 1)], --chain) {
+				size_t distance = pos - 1 - i;
+				if (distance > max_distance) break;
+				const uint8_t* match = input + i;
+				if (match[0] != ptr[0] || match[1] != ptr[1]) continue;
+				if (best_length >= 2 && (best_length == max_match_length || match[best_length] != ptr[best_length])) continue;
+				size_t length = 2;
+				while (length != max_match_length && match[length] == ptr[length]) ++length;
+				if (length > best_length && (length > 2 || distance <= max_2_distance)) {
+					best_length = length;
+					best_distance = distance;
+					if (length >= options.nice_length) break;
+				}
 			}
 		}
-		v.push_front(pos);
 		
 		if (best_length < 2) {
 			w.template put_bits<1>(0);
 			w.put(c);
+			best_length = 1;
 		} else {
 			w.template put_bits<1>(1);
 			write_length(w, best_length - 2);
@@ -391,9 +423,10 @@ void compress(const uint8_t* input, size_t input_size, writer_T& writer) {
 				write_distance(w, best_distance >> 6);
 				w.template put_bits<6>(best_distance);
 			}
-			pos += best_length - 1;
-			ptr += best_length - 1;
 		}
+		for (size_t i = 0; i != best_length; ++i) insert(pos + i);
+		pos += best_length;
+		ptr += best_length;
 		
 	}
 	
@@ -406,6 +439,7 @@ template<typename base_writer_T, bool default_little_endian = true>
 struct replay_file_writer {
 	crc32_t crc32;
 	base_writer_T& w;
+	compress_options options = compress_options::fast();
 	replay_file_writer(base_writer_T& w) : w(w) {
 	}
 	template<typename T, bool little_endian = default_little_endian>
@@ -428,7 +462,7 @@ struct replay_file_writer {
 			compressed_data.clear();
 			compressed_data.reserve(4 + 4 + segment_output_size + (segment_output_size - 1) / 2);
 			auto cw = data_loading::make_vector_writer(compressed_data);
-			data_loading::compress(data + output_pos, segment_output_size, cw);
+			data_loading::compress(data + output_pos, segment_output_size, cw, options);
 			if (compressed_data.size() < segment_output_size) {
 				w.template put<uint32_t>(compressed_data.size());
 				w.put_bytes(compressed_data.data(), compressed_data.size());
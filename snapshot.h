@@ -0,0 +1,129 @@
+#ifndef BWGAME_SNAPSHOT_H
+#define BWGAME_SNAPSHOT_H
+
+#include "bwgame.h"
+
+#include <atomic>
+#include <memory>
+
+namespace bwgame {
+
+// Ids of pages stored in snapshots. 0 is never used, as it marks a page of a
+// state that has been written to.
+static inline uint64_t new_snapshot_page_id() {
+	static std::atomic<uint64_t> next_id{1};
+	return next_id++;
+}
+
+// An array stored as fixed size pages that can be shared between copies.
+// Every stored page has an id, and is never changed after it is created.
+// The array being copied comes with one id per page, which is the id of a
+// stored page with the same contents, or 0 if the page has been written to
+// since it was last stored or restored (see state_functions::mark_tile_written).
+// assign shares the pages whose id is unchanged, and restore only writes the
+// pages whose id differs, so neither has to look at the contents of the
+// pages that did not change.
+template<typename T, size_t page_size>
+struct shared_pages {
+	struct page_t {
+		uint64_t id;
+		std::array<T, page_size> data;
+	};
+	a_vector<std::shared_ptr<const page_t>> pages;
+	size_t size = 0;
+
+	// Stores src, whose page ids are in ids. Pages are shared with the pages
+	// this already holds or with prev where the id matches. The ids of the
+	// pages that are copied are written to ids.
+	// If verify is set, every shared page is compared with src, and a page
+	// that was written to without its id being cleared is an error.
+	// Returns the number of pages that were shared.
+	size_t assign(const a_vector<T>& src, a_vector<uint64_t>& ids, const shared_pages* prev, bool verify = false) {
+		size_t page_count = (src.size() + page_size - 1) / page_size;
+		if (ids.size() != page_count) ids.assign(page_count, 0);
+		a_vector<std::shared_ptr<const page_t>> old_pages = std::move(pages);
+		size = src.size();
+		pages.resize(page_count);
+		size_t shared = 0;
+		for (size_t i = 0; i != page_count; ++i) {
+			uint64_t id = ids[i];
+			if (id) {
+				if (i < old_pages.size() && old_pages[i]->id == id) pages[i] = std::move(old_pages[i]);
+				else if (prev && i < prev->pages.size() && prev->pages[i]->id == id) pages[i] = prev->pages[i];
+				if (pages[i]) {
+					if (verify && memcmp(pages[i]->data.data(), src.data() + i * page_size, std::min(page_size, size - i * page_size) * sizeof(T))) {
+						error("shared_pages: page %d was written to, but its id was not cleared", (int)i);
+					}
+					++shared;
+					continue;
+				}
+			} else {
+				id = new_snapshot_page_id();
+				ids[i] = id;
+			}
+			auto page = std::make_shared<page_t>();
+			page->id = id;
+			memcpy(page->data.data(), src.data() + i * page_size, std::min(page_size, size - i * page_size) * sizeof(T));
+			pages[i] = std::move(page);
+		}
+		return shared;
+	}
+
+	// Copies the pages into dst, whose page ids are in ids, only writing the
+	// pages whose id differs. Returns the number of pages written.
+	size_t restore(a_vector<T>& dst, a_vector<uint64_t>& ids) const {
+		if (dst.size() != size || ids.size() != pages.size()) {
+			dst.resize(size);
+			ids.assign(pages.size(), 0);
+		}
+		size_t written = 0;
+		for (size_t i = 0; i != pages.size(); ++i) {
+			if (ids[i] == pages[i]->id) continue;
+			memcpy(dst.data() + i * page_size, pages[i]->data.data(), std::min(page_size, size - i * page_size) * sizeof(T));
+			ids[i] = pages[i]->id;
+			++written;
+		}
+		return written;
+	}
+};
+
+// A copy of a state that shares the unchanged pages of its tile arrays with
+// the snapshot it was taken after. Everything else is copied with
+// state_copier. Snapshots keep their shared pages alive on their own, so
+// they can be destroyed in any order.
+struct state_snapshot {
+	state st;
+	shared_pages<tile_t, state::tile_page_size> tiles;
+	shared_pages<uint16_t, state::tile_page_size> tiles_mega_tile_index;
+	size_t shared_page_count = 0;
+	size_t page_count = 0;
+};
+
+// Stores st in r, sharing tile pages with prev where they are unchanged.
+// prev is usually the previous snapshot of the same game, and may be null.
+// The page ids of st are updated, which is why it is not const.
+// If verify is set, the tile pages that are shared are compared with st, to
+// catch tile writes that did not call state_functions::mark_tile_written.
+static inline void take_snapshot(state& st, state_snapshot& r, const state_snapshot* prev = nullptr, bool verify = false) {
+	state_copier copier(st, r.st);
+	copier.copy_tiles = false;
+	copier();
+	r.shared_page_count = r.tiles.assign(st.tiles, st.tile_page_ids, prev ? &prev->tiles : nullptr, verify);
+	r.shared_page_count += r.tiles_mega_tile_index.assign(st.tiles_mega_tile_index, st.mega_tile_index_page_ids, prev ? &prev->tiles_mega_tile_index : nullptr, verify);
+	r.page_count = r.tiles.pages.size() + r.tiles_mega_tile_index.pages.size();
+}
+
+// Copies the snapshot into st. Only the tile pages that st has written to,
+// or that differ from the snapshot it was last taken from or restored to,
+// are copied, so restoring a nearby snapshot is cheap.
+static inline void restore_snapshot(const state_snapshot& s, state& st) {
+	state_copier copier(s.st, st);
+	copier.copy_tiles = false;
+	copier();
+	s.tiles.restore(st.tiles, st.tile_page_ids);
+	s.tiles_mega_tile_index.restore(st.tiles_mega_tile_index, st.mega_tile_index_page_ids);
+}
+
+}
+
+#endif
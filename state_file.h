@@ -0,0 +1,1088 @@
+#ifndef BWGAME_STATE_FILE_H
+#define BWGAME_STATE_FILE_H
+
+#include "bwgame.h"
+#include "actions.h"
+#include "replay.h"
+#include "replay_saver.h"
+
+#include <atomic>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace bwgame {
+
+// Binary serialization of global_state, game_state, state, action_state and
+// replay_state, for writing games to disk and resuming them in another
+// process.
+//
+// Each section starts with an identifier, the format version and the kind of
+// section, followed by the fields of the structure in declaration order.
+// Integers are stored as variable length (LEB128, signed values zigzag
+// encoded), so the format does not depend on the sizes of the C++ types.
+// Pointers are stored as indices: objects by their container index, paths
+// and thingies by their position in their list, types by their id and data
+// such as regions, triggers and grps by their position in their vector.
+// Intrusive lists are stored as sequences of indices and rebuilt on load.
+//
+// The data is written in length prefixed blocks, ending with an empty
+// block, so it can be read back with sequential reads and each section can
+// check that it consumed exactly what was written.
+//
+// A state can only be loaded with the same global_state and game_state it
+// was saved with, since types and triggers are looked up in them.
+// state_file_version must be incremented whenever the fields written change.
+
+static const std::array<uint8_t, 4> state_file_identifier = {'O', 'B', 'W', 'S'};
+static const int state_file_version = 2;
+
+enum struct state_file_section {
+	global_state,
+	game_state,
+	state,
+	action_state,
+	replay_state
+};
+
+template<typename writer_T>
+struct state_file_output {
+	static const bool saving = true;
+	static const size_t block_size = 0x10000;
+	writer_T& w;
+	a_vector<uint8_t> buffer;
+	explicit state_file_output(writer_T& w) : w(w) {
+		buffer.reserve(block_size);
+	}
+	void bytes(uint8_t* data, size_t n) {
+		if (buffer.size() + n > block_size) {
+			flush();
+			if (n >= block_size) {
+				put_block(data, n);
+				return;
+			}
+		}
+		buffer.insert(buffer.end(), data, data + n);
+	}
+	void byte(uint8_t& v) {
+		if (buffer.size() == block_size) flush();
+		buffer.push_back(v);
+	}
+	void put_block(const uint8_t* data, size_t n) {
+		if ((uint32_t)n != n) error("state_file_output: block too large");
+		w.template put<uint32_t>((uint32_t)n);
+		w.put_bytes(data, n);
+	}
+	void flush() {
+		if (buffer.empty()) return;
+		put_block(buffer.data(), buffer.size());
+		buffer.clear();
+	}
+	void finish() {
+		flush();
+		w.template put<uint32_t>(0);
+	}
+};
+
+template<typename reader_T>
+struct state_file_input {
+	static const bool saving = false;
+	reader_T& r;
+	a_vector<uint8_t> buffer;
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+	size_t pos = 0;
+	explicit state_file_input(reader_T& r) : r(r) {}
+	// Readers over memory, like data_reader, hand out the blocks in place.
+	// Other readers copy them into buffer.
+	template<typename R>
+	auto read_block(R& r, size_t n, int) -> decltype(r.get_n(n)) {
+		return r.get_n(n);
+	}
+	template<typename R>
+	const uint8_t* read_block(R& r, size_t n, long) {
+		buffer.resize(n);
+		if (n) r.get_bytes(buffer.data(), n);
+		return buffer.data();
+	}
+	bool next_block() {
+		uint32_t n = r.template get<uint32_t>();
+		data = read_block(r, n, 0);
+		size = n;
+		pos = 0;
+		return n != 0;
+	}
+	void bytes(uint8_t* dst, size_t n) {
+		while (n) {
+			if (pos == size && !next_block()) error("state file: unexpected end of section");
+			size_t c = std::min(n, size - pos);
+			memcpy(dst, data + pos, c);
+			pos += c;
+			dst += c;
+			n -= c;
+		}
+	}
+	void byte(uint8_t& v) {
+		if (pos == size && !next_block()) error("state file: unexpected end of section");
+		v = data[pos++];
+	}
+	void finish() {
+		if (pos != size || next_block()) error("state file: section is longer than expected");
+	}
+};
+
+// Reads or writes the fields of the game structures through io_T, which is
+// either a state_file_output or a state_file_input. The same code does both,
+// so the two can not disagree about the format. When saving, the structures
+// are only read; they are held by non-const pointers so that loading can
+// share the code.
+template<typename io_T>
+struct state_serializer {
+	static const bool saving = io_T::saving;
+	io_T& io;
+	global_state* global_st = nullptr;
+	game_state* game_st = nullptr;
+	state* st = nullptr;
+	const state_functions* funcs = nullptr;
+
+	explicit state_serializer(io_T& io) : io(io) {}
+
+	void varint(uint64_t& v) {
+		if (saving) {
+			uint64_t n = v;
+			while (n >= 0x80) {
+				uint8_t b = (uint8_t)(n | 0x80);
+				io.byte(b);
+				n >>= 7;
+			}
+			uint8_t b = (uint8_t)n;
+			io.byte(b);
+		} else {
+			v = 0;
+			for (int shift = 0;; shift += 7) {
+				if (shift > 63) error("state file: invalid integer");
+				uint8_t b;
+				io.byte(b);
+				v |= (uint64_t)(b & 0x7f) << shift;
+				if (~b & 0x80) break;
+			}
+		}
+	}
+
+	template<typename T, typename std::enable_if<std::is_integral<T>::value>::type* = nullptr>
+	void value(T& v) {
+		uint64_t n = 0;
+		if (saving) {
+			if (std::is_signed<T>::value) n = (uint64_t)(int64_t)v << 1 ^ (uint64_t)((int64_t)v >> 63);
+			else n = (uint64_t)v;
+		}
+		varint(n);
+		if (!saving) {
+			if (std::is_signed<T>::value) {
+				int64_t s = (int64_t)(n >> 1 ^ (~(n & 1) + 1));
+				v = (T)s;
+				if ((int64_t)v != s) error("state file: value out of range");
+			} else {
+				v = (T)n;
+				if ((uint64_t)v != n) error("state file: value out of range");
+			}
+		}
+	}
+	void value(bool& v) {
+		uint8_t n = v ? 1 : 0;
+		value(n);
+		v = n != 0;
+	}
+	template<typename T, typename std::enable_if<std::is_enum<T>::value>::type* = nullptr>
+	void value(T& v) {
+		auto n = (typename std::underlying_type<T>::type)v;
+		value(n);
+		v = (T)n;
+	}
+	template<size_t integer_bits, size_t fractional_bits, bool is_signed, bool exact_integer_bits>
+	void value(fixed_point<integer_bits, fractional_bits, is_signed, exact_integer_bits>& v) {
+		value(v.raw_value);
+	}
+	template<typename T>
+	void value(xy_t<T>& v) {
+		values(v.x, v.y);
+	}
+	template<typename T>
+	void value(rect_t<T>& v) {
+		values(v.from, v.to);
+	}
+	template<typename T>
+	void value(unit_id_t<T>& v) {
+		value(v.raw_value);
+	}
+	void value(tile_id& v) {
+		value(v.raw_value);
+	}
+	template<typename A, typename B>
+	void value(std::pair<A, B>& v) {
+		values(v.first, v.second);
+	}
+	template<typename T, size_t N>
+	void value(std::array<T, N>& v) {
+		for (auto& x : v) value(x);
+	}
+	template<typename T, typename index_T, size_t N>
+	void value(type_indexed_array<T, index_T, N>& v) {
+		for (auto& x : v) value(x);
+	}
+	void value(a_string& v) {
+		size_t n = v.size();
+		value(n);
+		v.resize(n);
+		if (n) io.bytes((uint8_t*)&v[0], n);
+	}
+	void value(a_vector<uint8_t>& v) {
+		size_t n = v.size();
+		value(n);
+		v.resize(n);
+		if (n) io.bytes(v.data(), n);
+	}
+	template<typename T>
+	void value(a_vector<T>& v) {
+		size_t n = v.size();
+		value(n);
+		v.resize(n);
+		for (auto& x : v) value(x);
+	}
+	template<typename T, size_t N>
+	void value(static_vector<T, N>& v) {
+		size_t n = v.size();
+		value(n);
+		if (n > N) error("state file: too many elements for static_vector");
+		v.resize(n);
+		for (auto& x : v) value(x);
+	}
+	template<typename cont_T>
+	void sequence(cont_T& v) {
+		if (saving) {
+			size_t n = v.size();
+			value(n);
+			for (auto& x : v) value(x);
+		} else {
+			size_t n;
+			value(n);
+			v.clear();
+			for (size_t i = 0; i != n; ++i) {
+				typename cont_T::value_type x{};
+				value(x);
+				v.push_back(std::move(x));
+			}
+		}
+	}
+	template<typename T>
+	void value(a_circular_vector<T>& v) {
+		sequence(v);
+	}
+	template<typename... T>
+	void values(T&... v) {
+		(void)std::initializer_list<int>{(value(v), 0)...};
+	}
+
+	// Pointers to elements of a vector, stored as their position + 1, or 0
+	// for null.
+	template<typename T, typename vec_T>
+	void element(T*& v, vec_T& vec) {
+		size_t n = 0;
+		if (saving && v) {
+			n = (size_t)(v - vec.data());
+			if (n >= vec.size()) error("state file: pointer does not point into its vector");
+			++n;
+		}
+		value(n);
+		if (!saving) {
+			if (n > vec.size()) error("state file: invalid index %d", n - 1);
+			v = n ? &vec[n - 1] : nullptr;
+		}
+	}
+
+	a_vector<flingy_type_t>& type_vector(const flingy_type_t*) {
+		return global_st->flingy_types.vec;
+	}
+	a_vector<sprite_type_t>& type_vector(const sprite_type_t*) {
+		return global_st->sprite_types.vec;
+	}
+	a_vector<image_type_t>& type_vector(const image_type_t*) {
+		return global_st->image_types.vec;
+	}
+	a_vector<order_type_t>& type_vector(const order_type_t*) {
+		return global_st->order_types.vec;
+	}
+	a_vector<unit_type_t>& type_vector(const unit_type_t*) {
+		return game_st->unit_types.vec;
+	}
+	a_vector<weapon_type_t>& type_vector(const weapon_type_t*) {
+		return game_st->weapon_types.vec;
+	}
+	a_vector<upgrade_type_t>& type_vector(const upgrade_type_t*) {
+		return game_st->upgrade_types.vec;
+	}
+	a_vector<tech_type_t>& type_vector(const tech_type_t*) {
+		return game_st->tech_types.vec;
+	}
+
+	template<typename T, typename = id_type_for_t<T>>
+	void value(T*& v) {
+		element(v, type_vector(v));
+	}
+	template<typename T>
+	void value(type_id<T>& v) {
+		using id_T = id_type_for_t<T>;
+		uint64_t n = 0;
+		if (saving) {
+			n = (uint64_t)(size_t)(id_T)v << 1 | (v ? 1 : 0);
+			if (v && (const T*)v != &type_vector((const T*)v)[(size_t)(id_T)v]) error("state file: type pointer does not match its id");
+		}
+		varint(n);
+		if (!saving) {
+			size_t id = (size_t)(n >> 1);
+			if (n & 1) {
+				auto& vec = type_vector((const T*)nullptr);
+				if (id >= vec.size()) error("state file: invalid type id %d", id);
+				v = type_id<T>(&vec[id]);
+			} else v = type_id<T>((id_T)id);
+		}
+	}
+
+	void section(state_file_section kind) {
+		auto identifier = state_file_identifier;
+		io.bytes(identifier.data(), identifier.size());
+		if (identifier != state_file_identifier) error("state file: invalid identifier");
+		int version = state_file_version;
+		value(version);
+		if (version != state_file_version) error("state file: unsupported version %d (expected %d)", version, state_file_version);
+		auto k = kind;
+		value(k);
+		if (k != kind) error("state file: expected section %d, got %d", (int)kind, (int)k);
+	}
+
+	void value(flingy_type_t& v) {
+		values(v.id, v.sprite, v.top_speed, v.acceleration, v.halt_distance, v.turn_rate, v.unused, v.movement_type);
+	}
+	void value(sprite_type_t& v) {
+		values(v.id, v.image, v.health_bar_size, v.unk0, v.visible, v.selection_circle, v.selection_circle_vpos);
+	}
+	void value(image_type_t& v) {
+		values(v.id, v.grp_filename_index, v.has_directional_frames, v.is_clickable, v.has_iscript_animations, v.always_visible);
+		values(v.modifier, v.color_shift, v.iscript_id, v.shield_filename_index, v.attack_filename_index, v.damage_filename_index);
+		values(v.special_filename_index, v.landing_dust_filename_index, v.lift_off_filename_index);
+	}
+	void value(order_type_t& v) {
+		values(v.id, v.label, v.targets_enemies, v.background, v.unused3, v.valid_for_turret, v.unused5, v.can_be_interrupted);
+		values(v.unk7, v.can_be_queued, v.unk9, v.can_be_obstructed, v.unk11, v.unused12, v.weapon, v.tech_type);
+		values(v.animation, v.highlight, v.dep_index, v.target_order);
+	}
+	void value(unit_type_t& v) {
+		values(v.id, v.flingy, v.turret_unit_type, v.subunit2, v.infestation_unit, v.construction_animation, v.unit_direction);
+		values(v.has_shield, v.shield_points, v.hitpoints, v.elevation_level, v.unknown1, v.sublabel, v.computer_ai_idle);
+		values(v.human_ai_idle, v.return_to_idle, v.attack_unit, v.attack_move, v.ground_weapon, v.max_ground_hits, v.air_weapon);
+		values(v.max_air_hits, v.ai_internal, v.flags, v.target_acquisition_range, v.sight_range, v.armor_upgrade, v.unit_size);
+		values(v.armor, v.right_click_action, v.ready_sound, v.first_what_sound, v.last_what_sound, v.first_pissed_sound);
+		values(v.last_pissed_sound, v.first_yes_sound, v.last_yes_sound, v.placement_size, v.addon_position, v.dimensions);
+		values(v.portrait, v.mineral_cost, v.gas_cost, v.build_time, v.unknown2, v.group_flags, v.supply_provided);
+		values(v.supply_required, v.space_required, v.space_provided, v.build_score, v.destroy_score, v.unit_map_string_index);
+		values(v.is_broodwar, v.staredit_availability_flags);
+	}
+	void value(weapon_type_t& v) {
+		values(v.id, v.label, v.flingy, v.unused, v.target_flags, v.min_range, v.max_range, v.damage_upgrade, v.damage_type);
+		values(v.bullet_type, v.lifetime, v.hit_type, v.inner_splash_radius, v.medium_splash_radius, v.outer_splash_radius);
+		values(v.damage_amount, v.damage_bonus, v.cooldown, v.bullet_count, v.attack_angle, v.bullet_heading_offset);
+		values(v.forward_offset, v.upward_offset, v.target_error_message, v.icon);
+	}
+	void value(upgrade_type_t& v) {
+		values(v.id, v.mineral_cost_base, v.mineral_cost_factor, v.gas_cost_base, v.gas_cost_factor, v.time_cost_base);
+		values(v.time_cost_factor, v.unknown, v.icon, v.label, v.race, v.max_level, v.is_broodwar);
+	}
+	void value(tech_type_t& v) {
+		values(v.id, v.mineral_cost, v.gas_cost, v.research_time, v.energy_cost, v.unknown, v.icon, v.label, v.race, v.flags);
+	}
+
+	// Types refer to each other, so the sizes of all the type vectors are
+	// stored before any of the types. type_id takes the id from the type it
+	// points to, so the ids, which are the same as the indices, are set
+	// before the types are loaded.
+	template<typename... T>
+	void type_containers(type_container<T>&... v) {
+		(void)std::initializer_list<int>{(type_container_size(v), 0)...};
+		(void)std::initializer_list<int>{(type_container_values(v), 0)...};
+	}
+	template<typename T>
+	void type_container_size(type_container<T>& v) {
+		size_t n = v.vec.size();
+		value(n);
+		v.vec.resize(n);
+		for (size_t i = 0; i != n; ++i) {
+			if (saving && (size_t)v.vec[i].id != i) error("state file: type %d has id %d", i, (size_t)v.vec[i].id);
+			v.vec[i].id = (id_type_for_t<T>)i;
+		}
+	}
+	template<typename T>
+	void type_container_values(type_container<T>& v) {
+		for (auto& x : v.vec) value(x);
+	}
+
+	void value(grp_t::frame_t& v) {
+		values(v.offset, v.size, v.line_data_offset, v.data_container);
+	}
+	void value(grp_t& v) {
+		values(v.width, v.height, v.frames);
+	}
+	void value(grp_t*& v) {
+		element(v, global_st->grps);
+	}
+	void value(const grp_t*& v) {
+		element(v, global_st->grps);
+	}
+	void value(a_vector<a_vector<xy>>*& v) {
+		element(v, global_st->lo_offsets);
+	}
+	void value(iscript_t& v) {
+		a_vector<int> ids;
+		for (auto& x : v.scripts) ids.push_back(x.first);
+		std::sort(ids.begin(), ids.end());
+		size_t n = ids.size();
+		value(n);
+		if (!saving) v.scripts.clear();
+		for (size_t i = 0; i != n; ++i) {
+			int key = saving ? ids[i] : 0;
+			value(key);
+			auto& s = v.scripts[key];
+			values(s.id, s.animation_pc);
+		}
+		value(v.program_data);
+	}
+	void value(const iscript_t::script*& v) {
+		bool has_script = v != nullptr;
+		value(has_script);
+		int id = has_script && saving ? v->id : 0;
+		if (has_script) value(id);
+		if (!saving) {
+			v = nullptr;
+			if (has_script) {
+				auto i = global_st->iscript.scripts.find(id);
+				if (i == global_st->iscript.scripts.end()) error("state file: iscript %d not found", id);
+				v = &i->second;
+			}
+		}
+	}
+
+	void global() {
+		auto& g = *global_st;
+		type_containers(g.flingy_types, g.sprite_types, g.image_types, g.order_types);
+		values(g.iscript, g.grps, g.image_grp, g.lo_offsets, g.image_lo_offsets);
+		values(g.units_dat, g.weapons_dat, g.upgrades_dat, g.techdata_dat, g.melee_trg, g.tileset_vf4, g.tileset_cv5);
+	}
+
+	void value(game_state::force_t& v) {
+		values(v.name, v.flags);
+	}
+	void value(sight_values_t::maskdat_node_t& v) {
+		values(v.prev, v.prev2, v.relative_tile_index, v.x, v.y);
+	}
+	void value(sight_values_t& v) {
+		values(v.max_width, v.max_height, v.min_width, v.min_height, v.min_mask_size, v.ext_masked_count, v.maskdat);
+	}
+	void value(cv5_entry& v) {
+		values(v.flags, v.mega_tile_index);
+	}
+	void value(vf4_entry& v) {
+		value(v.flags);
+	}
+	void value(regions_t::region*& v) {
+		element(v, game_st->regions.regions);
+	}
+	void value(const regions_t::region*& v) {
+		element(v, game_st->regions.regions);
+	}
+	void value(regions_t::region& v) {
+		values(v.flags, v.index, v.tile_center, v.tile_area, v.center, v.area, v.tile_count, v.group_index);
+		values(v.walkable_neighbors, v.non_walkable_neighbors);
+		value(v.pathfinder_flag);
+		v.pathfinder_node = nullptr;
+	}
+	void value(regions_t::split_region& v) {
+		values(v.mask, v.a, v.b);
+	}
+	void value(regions_t::contour& v) {
+		values(v.v, v.dir, v.flags);
+	}
+	void value(regions_t& v) {
+		values(v.tile_region_index, v.tile_bounding_box);
+		size_t n = v.regions.size();
+		value(n);
+		v.regions.resize(n);
+		for (auto& x : v.regions) value(x);
+		values(v.split_regions, v.contours);
+	}
+	void value(trigger::condition& v) {
+		values(v.location, v.group, v.count_n, v.unit_id, v.num_n, v.type, v.extra_n, v.flags, v.unk);
+	}
+	void value(trigger::action& v) {
+		values(v.location, v.string_index, v.sound_index, v.time_n, v.group_n, v.group2_n, v.extra_n, v.type, v.num_n, v.flags, v.unk);
+	}
+	void value(trigger& v) {
+		values(v.conditions, v.actions, v.execution_flags, v.enabled);
+	}
+
+	void game() {
+		auto& g = *game_st;
+		values(g.map_tile_width, g.map_tile_height, g.map_walk_width, g.map_walk_height, g.map_width, g.map_height);
+		values(g.map_strings, g.scenario_name, g.scenario_description, g.unit_air_strength, g.unit_ground_strength, g.forces, g.sight_values);
+		values(g.tileset_index, g.gfx_tiles, g.cv5, g.vf4, g.mega_tile_flags);
+		type_containers(g.unit_types, g.weapon_types, g.upgrade_types, g.tech_types);
+		values(g.unit_type_allowed, g.max_upgrade_levels, g.tech_available, g.start_locations);
+		values(g.max_unit_width, g.max_unit_height, g.repulse_field_width, g.repulse_field_height, g.regions, g.triggers);
+	}
+
+	void value(player_t& v) {
+		values(v.controller, v.race, v.force, v.color, v.initially_active, v.victory_state);
+	}
+	void value(const trigger*& v) {
+		element(v, game_st->triggers);
+	}
+	void value(running_trigger::action& v) {
+		value(v.flags);
+	}
+	void value(running_trigger& v) {
+		values(v.actions, v.t, v.flags, v.current_action_index);
+	}
+	void value(location& v) {
+		values(v.area, v.elevation_flags);
+	}
+	void value(creep_life_t::entry& v) {
+		values(v.tile_pos, v.n_neighboring_creep_tiles, v.hash_next, v.list_slot);
+	}
+	// count_tree is not written, it is rebuilt from the slots on load.
+	void value(creep_life_t::list_t& v) {
+		size_t capacity = v.count_tree.size() - 1;
+		values(v.slots, v.size, capacity);
+		if (!saving) {
+			if (capacity == 0 || (capacity & (capacity - 1)) || v.slots.size() > capacity) error("state file: invalid creep list capacity %d", capacity);
+			creep_life_t::list_build_counts(v, capacity);
+		}
+	}
+	void value(creep_life_t& v) {
+		values(v.recede_timer, v.check_dead_unit_timer, v.lists, v.free_list, v.table, v.entry_container);
+		if (!saving) {
+			auto check = [&](uint16_t index) {
+				if (index != creep_life_t::none && index >= v.entry_container.size()) error("state file: invalid creep entry index %d", index);
+			};
+			for (auto& l : v.lists) {
+				size_t size = 0;
+				for (auto index : l.slots) {
+					check(index);
+					if (index != creep_life_t::none) ++size;
+				}
+				if (size != l.size) error("state file: creep list size mismatch");
+			}
+			for (auto index : v.free_list) check(index);
+			for (auto index : v.table) check(index);
+			for (auto& e : v.entry_container) {
+				check(e.hash_next);
+				if (e.list_slot != creep_life_t::none) {
+					if (e.n_neighboring_creep_tiles >= v.lists.size() || e.list_slot >= v.lists[e.n_neighboring_creep_tiles].slots.size()) {
+						error("state file: invalid creep list slot %d", e.list_slot);
+					}
+				}
+			}
+		}
+	}
+	void value(tile_t& v) {
+		values(v.visible, v.explored, v.flags);
+	}
+
+	template<typename T, size_t max_size, size_t allocation_granularity>
+	void object(T*& v, object_container<T, max_size, allocation_granularity>& cont) {
+		size_t n = 0;
+		if (saving && v) {
+			if (cont.try_get(v->index) != v) error("state file: object is not in its container");
+			n = v->index + 1;
+		}
+		value(n);
+		if (!saving) {
+			v = nullptr;
+			if (n) {
+				v = cont.try_get(n - 1);
+				if (!v) error("state file: invalid object index %d", n - 1);
+			}
+		}
+	}
+	void value(unit_t*& v) {
+		object(v, st->units_container);
+	}
+	void value(const unit_t*& v) {
+		unit_t* u = const_cast<unit_t*>(v);
+		value(u);
+		v = u;
+	}
+	void value(bullet_t*& v) {
+		object(v, st->bullets_container);
+	}
+	void value(sprite_t*& v) {
+		object(v, st->sprites_container);
+	}
+	void value(image_t*& v) {
+		object(v, st->images_container);
+	}
+	void value(order_t*& v) {
+		object(v, st->orders_container);
+	}
+
+	// Paths and thingies have no index, so they are referred to by their
+	// position in st.paths and st.thingies.
+	template<typename T>
+	struct list_index {
+		a_vector<std::pair<const T*, size_t>> positions;
+		a_vector<T*> pointers;
+		void init(a_list<T>& list) {
+			positions.clear();
+			pointers.clear();
+			for (auto& v : list) {
+				positions.emplace_back(&v, positions.size());
+				pointers.push_back(&v);
+			}
+			std::sort(positions.begin(), positions.end());
+		}
+		size_t position(const T* v) const {
+			auto i = std::lower_bound(positions.begin(), positions.end(), std::make_pair(v, (size_t)0));
+			if (i == positions.end() || i->first != v) error("state file: object is not in its list");
+			return i->second;
+		}
+	};
+	list_index<path_t> paths_index;
+	list_index<thingy_t> thingies_index;
+	template<typename T>
+	void list_element(T*& v, list_index<T>& index) {
+		size_t n = saving && v ? index.position(v) + 1 : 0;
+		value(n);
+		if (!saving) {
+			if (n > index.pointers.size()) error("state file: invalid list index %d", n - 1);
+			v = n ? index.pointers[n - 1] : nullptr;
+		}
+	}
+	void value(path_t*& v) {
+		list_element(v, paths_index);
+	}
+	void value(thingy_t*& v) {
+		list_element(v, thingies_index);
+	}
+
+	template<typename T, typename link_T, std::pair<T*, T*> T::* link_ptr>
+	void value(intrusive_list<T, link_T, link_ptr>& list) {
+		if (saving) {
+			size_t n = 0;
+			for (auto i = list.begin(); i != list.end(); ++i) ++n;
+			value(n);
+			for (auto& x : list) {
+				T* p = &x;
+				value(p);
+			}
+		} else {
+			size_t n;
+			value(n);
+			list.clear();
+			for (size_t i = 0; i != n; ++i) {
+				T* p;
+				value(p);
+				if (!p) error("state file: null list element");
+				list.push_back(*p);
+			}
+		}
+	}
+
+	void value(target_t& v) {
+		values(v.pos, v.unit);
+	}
+	void value(order_target_t& v) {
+		values(v.position, v.unit, v.unit_type);
+	}
+	void value(iscript_state_t& v) {
+		values(v.current_script, v.program_counter, v.return_address, v.animation, v.wait);
+	}
+	void value(state_base_non_copyable::unit_finder_entry& v) {
+		values(v.u, v.value);
+	}
+
+	// The links of intrusive lists are not stored. They are cleared when an
+	// object is loaded, since whether some of them are null tells whether
+	// the object is in the list, and set when the lists are loaded.
+	void clear_link(link_base& v) {
+		if (!saving) v.link = {nullptr, nullptr};
+	}
+	template<typename T>
+	void clear_link(std::pair<T*, T*>& v) {
+		if (!saving) v = {nullptr, nullptr};
+	}
+
+	void thingy_fields(thingy_t& v) {
+		clear_link(v);
+		values(v.hp, v.sprite);
+	}
+	void flingy_fields(flingy_t& v) {
+		thingy_fields(v);
+		values(v.move_target, v.next_movement_waypoint, v.next_target_waypoint, v.movement_flags, v.heading, v.flingy_turn_rate);
+		values(v.next_velocity_direction, v.flingy_type, v.flingy_movement_type, v.position, v.exact_position, v.flingy_top_speed);
+		values(v.current_speed, v.next_speed, v.velocity, v.flingy_acceleration, v.current_velocity_direction, v.desired_velocity_direction);
+		value(v.order_signal);
+	}
+	void value(thingy_t& v) {
+		thingy_fields(v);
+	}
+	void value(bullet_t& v) {
+		flingy_fields(v);
+		values(v.flingy_t::index, v.bullet_state, v.bullet_target, v.bullet_target_pos, v.weapon_type, v.remaining_time, v.hit_flags);
+		values(v.remaining_bounces, v.owner, v.bullet_owner_unit, v.prev_bounce_unit, v.hit_near_target_position_index);
+	}
+	void value(sprite_t& v) {
+		clear_link(v);
+		values(v.sprite_type, v.owner, v.selection_index, v.visibility_flags, v.elevation_level, v.flags, v.selection_timer);
+		values(v.width, v.height, v.position, v.main_image);
+	}
+	void value(image_t& v) {
+		clear_link(v);
+		values(v.image_type, v.modifier, v.frame_index_offset, v.flags, v.offset, v.iscript_state, v.frame_index_base);
+		values(v.frame_index, v.grp, v.modifier_data1, v.modifier_data2, v.sprite, v.frozen_y_value);
+	}
+	void value(order_t& v) {
+		clear_link(v);
+		values(v.order_type, v.target);
+	}
+	void value(path_t& v) {
+		clear_link(v);
+		values(v.delay, v.creation_frame, v.state_flags, v.long_path, v.full_long_path_size, v.short_path);
+		values(v.current_long_path_index, v.current_short_path_index, v.source, v.destination, v.next);
+		values(v.last_collision_unit, v.last_collision_speed, v.slide_free_direction);
+	}
+
+	// The unions in unit_t are stored the same way state_copier remaps them,
+	// by the unit type.
+	void value(unit_t& v) {
+		flingy_fields(v);
+		values(v.owner, v.order_type, v.order_state, v.order_unit_type, v.main_order_timer, v.ground_weapon_cooldown);
+		values(v.air_weapon_cooldown, v.spell_cooldown, v.order_target, v.shield_points, v.unit_type);
+		clear_link(v.player_units_link);
+		values(v.subunit, v.auto_target_unit, v.connected_unit, v.order_queue_count, v.order_process_timer, v.unknown_0x086);
+		values(v.attack_notify_timer, v.previous_unit_type, v.last_event_timer, v.last_event_color, v.rank_increase, v.kill_count);
+		values(v.last_attacking_player, v.secondary_order_timer, v.user_action_flags, v.cloak_counter, v.movement_state);
+		values(v.build_queue, v.energy, v.unit_id_generation, v.secondary_order_type, v.damage_overlay_state);
+		values(v.hp_construction_rate, v.shield_construction_rate, v.remaining_build_time, v.previous_hp, v.loaded_units);
+		if (v.unit_type && (funcs->unit_is(&v, UnitTypes::Protoss_Interceptor) || funcs->unit_is(&v, UnitTypes::Protoss_Scarab))) {
+			values(v.fighter.parent, v.fighter.is_outside);
+			clear_link(v.fighter.fighter_link);
+		} else if (v.unit_type && funcs->unit_is_carrier(&v)) {
+			values(v.carrier.inside_count, v.carrier.outside_count);
+		} else if (v.unit_type && funcs->unit_is_reaver(&v)) {
+			values(v.reaver.inside_count, v.reaver.outside_count);
+		} else if (v.unit_type && funcs->unit_is_ghost(&v)) {
+			value(v.ghost.nuke_dot);
+		} else {
+			value(v.vulture.spider_mine_count);
+		}
+		values(v.worker.powerup, v.worker.target_resource_position, v.worker.target_resource_unit, v.worker.repair_timer);
+		values(v.worker.is_gathering, v.worker.resources_carried, v.worker.gather_target);
+		clear_link(v.worker.gather_link);
+		auto& b = v.building;
+		values(b.addon, b.addon_build_type, b.upgrade_research_time, b.researching_type, b.upgrading_type, b.larva_timer);
+		values(b.is_landing, b.creep_timer, b.upgrading_level, b.rally);
+		if (v.unit_type && funcs->ut_resource(&v)) {
+			values(b.resource.resource_count, b.resource.resource_iscript, b.resource.is_being_gathered);
+		} else if (v.unit_type && funcs->unit_is_nydus(&v)) {
+			value(b.nydus.exit);
+		} else if (v.unit_type && funcs->unit_is(&v, UnitTypes::Terran_Nuclear_Silo)) {
+			values(b.silo.nuke, b.silo.ready);
+		} else if (v.unit_type && funcs->unit_is(&v, UnitTypes::Protoss_Pylon)) {
+			value(b.pylon.psi_field_sprite);
+			clear_link(b.pylon.psionic_matrix_link);
+		} else {
+			value(b.hatchery.larva_spawn_side_values);
+		}
+		values(v.status_flags, v.carrying_flags, v.wireframe_randomizer, v.secondary_order_state, v.move_target_timer);
+		values(v.detected_flags, v.current_build_unit);
+		clear_link(v.cloaked_unit_link);
+		values(v.path, v.pathing_collision_counter, v.pathing_flags, v.unused_0x106, v.is_being_healed, v.terrain_no_collision_bounds);
+		values(v.remove_timer, v.defensive_matrix_hp, v.defensive_matrix_timer, v.stim_timer, v.ensnare_timer, v.lockdown_timer);
+		values(v.irradiate_timer, v.stasis_timer, v.plague_timer, v.storm_timer, v.irradiated_by, v.irradiate_owner);
+		values(v.parasite_flags, v.cycle_counter, v.blinded_by, v.maelstrom_timer, v.acid_spore_count, v.acid_spore_time);
+		values(v.next_hit_near_target_position_index, v.air_strength, v.ground_strength, v.repulse_flags, v.repulse_direction);
+		values(v.repulse_index, v.unit_finder_bounding_box, v.unit_finder_visited, v.unit_finder_index_from, v.unit_finder_index_to);
+	}
+	void unit_lists(unit_t& v) {
+		value(v.order_queue);
+		if (!v.unit_type) return;
+		if (funcs->unit_is_carrier(&v)) values(v.carrier.inside_units, v.carrier.outside_units);
+		else if (funcs->unit_is_reaver(&v)) values(v.reaver.inside_units, v.reaver.outside_units);
+		if (funcs->ut_resource(&v)) value(v.building.resource.gather_queue);
+	}
+
+	template<typename T, size_t max_size, size_t allocation_granularity>
+	void container_size(object_container<T, max_size, allocation_granularity>& cont) {
+		size_t n = cont.size;
+		value(n);
+		if (!saving) {
+			if (n > max_size) error("state file: too many objects");
+			while (cont.size < n) cont.grow(false);
+		}
+	}
+	template<typename T>
+	void list_size(a_list<T>& list) {
+		size_t n = list.size();
+		value(n);
+		if (!saving) list.resize(n);
+	}
+	template<typename T, size_t max_size, size_t allocation_granularity, typename F>
+	void for_each_object(object_container<T, max_size, allocation_granularity>& cont, F&& f) {
+		for (size_t i = 0; i != cont.size; ++i) {
+			f(cont.list[i / allocation_granularity][i % allocation_granularity]);
+		}
+	}
+
+	void state_base() {
+		auto& s = *st;
+		values(s.update_tiles_countdown, s.order_timer_counter, s.secondary_order_timer_counter, s.current_frame, s.players);
+		values(s.alliances, s.upgrade_levels, s.upgrade_upgrading, s.tech_researched, s.tech_researching);
+		values(s.unit_counts, s.completed_unit_counts, s.factory_counts, s.building_counts, s.non_building_counts);
+		values(s.completed_factory_counts, s.completed_building_counts, s.completed_non_building_counts);
+		values(s.total_buildings_ever_completed, s.total_non_buildings_ever_completed, s.unit_score, s.building_score);
+		values(s.supply_used, s.supply_available, s.shared_vision, s.random_counts, s.total_random_counts, s.lcg_rand_state);
+		values(s.last_error, s.trigger_timer, s.running_triggers, s.trigger_wait_timers, s.trigger_waiting);
+		values(s.active_orders_size, s.active_bullets_size, s.active_thingies_size, s.repulse_field);
+		values(s.prev_bullet_heading_offset_clockwise, s.current_minerals, s.current_gas, s.total_minerals_gathered);
+		values(s.total_gas_gathered, s.recent_lurker_hits, s.recent_lurker_hit_current_index, s.creep_life);
+		values(s.update_psionic_matrix, s.disruption_webbed_units, s.cheats_enabled, s.cheat_operation_cwal, s.locations);
+		values(s.tiles, s.tiles_mega_tile_index);
+	}
+
+	void objects() {
+		auto& s = *st;
+		container_size(s.units_container);
+		container_size(s.bullets_container);
+		container_size(s.sprites_container);
+		container_size(s.images_container);
+		container_size(s.orders_container);
+		list_size(s.paths);
+		list_size(s.thingies);
+		paths_index.init(s.paths);
+		thingies_index.init(s.thingies);
+
+		for_each_object(s.units_container, [&](unit_t& v) {value(v);});
+		for_each_object(s.bullets_container, [&](bullet_t& v) {value(v);});
+		for_each_object(s.sprites_container, [&](sprite_t& v) {value(v);});
+		for_each_object(s.images_container, [&](image_t& v) {value(v);});
+		for_each_object(s.orders_container, [&](order_t& v) {value(v);});
+		for (auto& v : s.paths) value(v);
+		for (auto& v : s.thingies) value(v);
+
+		for_each_object(s.units_container, [&](unit_t& v) {unit_lists(v);});
+		for_each_object(s.sprites_container, [&](sprite_t& v) {value(v.images);});
+
+		values(s.free_thingies, s.active_thingies, s.free_paths, s.orders_container.free_list, s.images_container.free_list);
+		values(s.sprites_container.free_list, s.sprites_on_tile_line, s.bullets_container.free_list, s.active_bullets);
+		values(s.cloaked_units, s.psionic_matrix_units, s.player_units, s.units_container.free_list, s.dead_units);
+		values(s.map_revealer_units, s.hidden_units, s.visible_units);
+		values(s.unit_finder_x, s.unit_finder_y, s.consider_collision_with_unit_bug, s.prev_bullet_source_unit);
+	}
+
+	void state_all() {
+		state_functions f(*st);
+		funcs = &f;
+		state_base();
+		objects();
+		funcs = nullptr;
+	}
+
+	void action(action_state& v) {
+		values(v.player_id, v.actions_data_position, v.next_action_frame, v.selection, v.control_groups);
+	}
+	void replay(replay_state& v) {
+		values(v.actions_data_buffer, v.end_frame, v.map_name, v.player_name, v.game_type);
+	}
+};
+
+template<typename writer_T, typename F>
+void save_state_file_section(writer_T& w, state_file_section kind, F&& f) {
+	state_file_output<writer_T> out(w);
+	state_serializer<state_file_output<writer_T>> s(out);
+	s.section(kind);
+	f(s);
+	out.finish();
+}
+
+template<typename reader_T, typename F>
+void load_state_file_section(reader_T& r, state_file_section kind, F&& f) {
+	state_file_input<reader_T> in(r);
+	state_serializer<state_file_input<reader_T>> s(in);
+	s.section(kind);
+	f(s);
+	in.finish();
+}
+
+template<typename writer_T>
+void save_global_state(writer_T& w, const global_state& global_st) {
+	save_state_file_section(w, state_file_section::global_state, [&](auto& s) {
+		s.global_st = const_cast<global_state*>(&global_st);
+		s.global();
+	});
+}
+
+template<typename reader_T>
+void load_global_state(reader_T& r, global_state& global_st) {
+	global_st = global_state();
+	load_state_file_section(r, state_file_section::global_state, [&](auto& s) {
+		s.global_st = &global_st;
+		s.global();
+	});
+}
+
+// Initializes global_st from the cache file cache_filename, which holds a
+// global_state saved with save_global_state. If the file does not exist or
+// can not be loaded (for instance because it was written by another format
+// version), global_st is initialized with global_init instead and the cache
+// file is written for the next time. The cache is not checked against the
+// data files, so it must be deleted when they change. load_grp_pixel_data is
+// passed on to global_init; a cache without pixel data is not used if it is
+// needed, and the pixel data of a cache is dropped if it is not.
+// The cache is written to a temporary file named after the process and then
+// renamed, so processes that start at the same time do not write over each
+// other's files. Failing to write the cache is not an error, since global_st
+// has already been initialized.
+// Returns true if global_st was loaded from the cache.
+template<typename load_data_file_F>
+bool global_init_cached(global_state& global_st, load_data_file_F&& load_data_file, const a_string& cache_filename, bool load_grp_pixel_data = true) {
+	FILE* f = fopen(cache_filename.c_str(), "rb");
+	if (f) {
+		fclose(f);
+		try {
+			data_loading::mapped_file file(cache_filename);
+			auto r = file.reader();
+			load_global_state(r, global_st);
+			bool has_pixel_data = true;
+			for (auto& grp : global_st.grps) {
+				for (auto& f : grp.frames) {
+					if (f.line_data_offset.size() != f.size.y) has_pixel_data = false;
+					if (!load_grp_pixel_data) {
+						f.line_data_offset = {};
+						f.data_container = {};
+					}
+				}
+			}
+			if (has_pixel_data || !load_grp_pixel_data) return true;
+			global_st = global_state();
+		} catch (const std::exception&) {
+			global_st = global_state();
+		}
+	}
+	global_init(global_st, std::forward<load_data_file_F>(load_data_file), load_grp_pixel_data);
+	static std::atomic<int> tmp_counter{0};
+#ifdef _WIN32
+	int pid = _getpid();
+#else
+	int pid = (int)getpid();
+#endif
+	a_string tmp_filename = format("%s.%d.%d.tmp", cache_filename, pid, tmp_counter++);
+	try {
+		{
+			data_loading::file_writer<> w(tmp_filename);
+			save_global_state(w, global_st);
+		}
+#ifdef _WIN32
+		std::remove(cache_filename.c_str());
+#endif
+		if (std::rename(tmp_filename.c_str(), cache_filename.c_str())) std::remove(tmp_filename.c_str());
+	} catch (const std::exception&) {
+		std::remove(tmp_filename.c_str());
+	}
+	return false;
+}
+
+template<typename writer_T>
+void save_game_state(writer_T& w, const game_state& game_st, const global_state& global_st) {
+	save_state_file_section(w, state_file_section::game_state, [&](auto& s) {
+		s.global_st = const_cast<global_state*>(&global_st);
+		s.game_st = const_cast<game_state*>(&game_st);
+		s.game();
+	});
+}
+
+// Loads into game_st. global_st must be the global_state the game_state
+// was saved with.
+template<typename reader_T>
+void load_game_state(reader_T& r, game_state& game_st, const global_state& global_st) {
+	game_st = game_state();
+	load_state_file_section(r, state_file_section::game_state, [&](auto& s) {
+		s.global_st = const_cast<global_state*>(&global_st);
+		s.game_st = &game_st;
+		s.game();
+	});
+}
+
+template<typename writer_T>
+void save_state(writer_T& w, const state& st) {
+	save_state_file_section(w, state_file_section::state, [&](auto& s) {
+		s.global_st = const_cast<global_state*>(st.global);
+		s.game_st = st.game;
+		s.st = const_cast<state*>(&st);
+		s.state_all();
+	});
+}
+
+// Loads into st, replacing everything in it. st.global and st.game must be
+// set to the global_state and game_state the state was saved with.
+template<typename reader_T>
+void load_state(reader_T& r, state& st) {
+	if (!st.global || !st.game) error("load_state: st.global and st.game must be set");
+	(state_base_non_copyable&)st = state_base_non_copyable();
+	load_state_file_section(r, state_file_section::state, [&](auto& s) {
+		s.global_st = const_cast<global_state*>(st.global);
+		s.game_st = st.game;
+		s.st = &st;
+		s.state_all();
+	});
+	size_t tile_page_count = (st.tiles.size() + state::tile_page_size - 1) / state::tile_page_size;
+	st.tile_page_ids.assign(tile_page_count, 0);
+	st.mega_tile_index_page_ids.assign(tile_page_count, 0);
+}
+
+template<typename writer_T>
+void save_action_state(writer_T& w, const action_state& action_st, const state& st) {
+	save_state_file_section(w, state_file_section::action_state, [&](auto& s) {
+		s.st = const_cast<state*>(&st);
+		s.action(const_cast<action_state&>(action_st));
+	});
+}
+
+// st must already be loaded, since the selections refer to its units.
+template<typename reader_T>
+void load_action_state(reader_T& r, action_state& action_st, state& st) {
+	action_st = action_state();
+	load_state_file_section(r, state_file_section::action_state, [&](auto& s) {
+		s.st = &st;
+		s.action(action_st);
+	});
+}
+
+template<typename writer_T>
+void save_replay_state(writer_T& w, const replay_state& replay_st) {
+	save_state_file_section(w, state_file_section::replay_state, [&](auto& s) {
+		s.replay(const_cast<replay_state&>(replay_st));
+	});
+}
+
+template<typename reader_T>
+void load_replay_state(reader_T& r, replay_state& replay_st) {
+	replay_st = replay_state();
+	load_state_file_section(r, state_file_section::replay_state, [&](auto& s) {
+		s.replay(replay_st);
+	});
+}
+
+}
+
+#endif
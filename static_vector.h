@@ -443,6 +443,21 @@ public:
 			i = ni;
 		}
 	}
+	iterator insert(const iterator pos, const T& value) {
+		if (size() == capacity()) throw std::length_error("static_vector resized beyond capacity");
+		if (pos.ptr == m_end) {
+			push_back(value);
+			return pos;
+		}
+		value_type tmp(value);
+		new (ptr_end()) value_type(std::move(*(ptr_end() - 1)));
+		for (pointer i = ptr_end() - 1; i != pos.ptr; --i) {
+			*i = std::move(*(i - 1));
+		}
+		*pos.ptr = std::move(tmp);
+		m_end = ptr_end() + 1;
+		return pos;
+	}
 };
 
 }
@@ -0,0 +1,56 @@
+#ifndef BWGAME_TOOLS_COMMON_H
+#define BWGAME_TOOLS_COMMON_H
+
+#include "util.h"
+#include "containers.h"
+
+#include <algorithm>
+#include <chrono>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+namespace bwgame {
+namespace tools {
+
+template<typename duration_T>
+double seconds(duration_T d) {
+	return std::chrono::duration_cast<std::chrono::duration<double>>(d).count();
+}
+
+static inline bool ends_with_rep(const a_string& fn) {
+	if (fn.size() < 4) return false;
+	a_string ext = fn.substr(fn.size() - 4);
+	for (auto& v : ext) v |= 0x20;
+	return ext == ".rep";
+}
+
+// Adds path to files, or if it is a directory, every .rep file in it in
+// sorted order.
+static inline void add_replay_files(a_vector<a_string>& files, a_string path) {
+#ifndef _WIN32
+	struct stat s;
+	if (stat(path.c_str(), &s) == 0 && S_ISDIR(s.st_mode)) {
+		DIR* dir = opendir(path.c_str());
+		if (!dir) error("failed to open directory %s", path);
+		if (path.empty() || path.back() != '/') path += '/';
+		a_vector<a_string> dir_files;
+		while (dirent* e = readdir(dir)) {
+			a_string fn = e->d_name;
+			if (ends_with_rep(fn)) dir_files.push_back(path + fn);
+		}
+		closedir(dir);
+		std::sort(dir_files.begin(), dir_files.end());
+		for (auto& v : dir_files) files.push_back(std::move(v));
+		return;
+	}
+#endif
+	files.push_back(std::move(path));
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,112 @@
+#include "bwgame.h"
+#include "replay.h"
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace bwgame;
+using namespace bwgame::tools;
+
+// Checks that the crc32_t implementations agree on random inputs, and times
+// each of them over a few buffer sizes: replay section headers, the game info
+// section, a full replay segment and a large buffer.
+
+namespace {
+
+struct implementation {
+	const char* name;
+	uint32_t (*update)(uint32_t, const uint8_t*, size_t);
+};
+
+uint32_t update_pclmul(uint32_t r, const uint8_t* data, size_t data_size) {
+#ifdef BWGAME_CRC32_PCLMUL
+	if (data_size >= 64) {
+		size_t n = data_size & ~(size_t)15;
+		r = data_loading::crc32_t::update_pclmul(r, data, n);
+		data += n;
+		data_size -= n;
+	}
+#endif
+	return data_loading::crc32_t::update_slicing_by_8(r, data, data_size);
+}
+
+const implementation implementations[] = {
+	{"bytewise", data_loading::crc32_t::update_bytewise},
+	{"slicing-by-8", data_loading::crc32_t::update_slicing_by_8},
+	{"pclmul", update_pclmul},
+};
+
+size_t implementation_count() {
+	return data_loading::crc32_has_pclmul() ? 3 : 2;
+}
+
+// Returns the number of inputs on which the implementations disagree.
+size_t check(const a_vector<uint8_t>& data, std::mt19937& rng, size_t n) {
+	size_t failed = 0;
+	for (size_t i = 0; i != n; ++i) {
+		size_t offset = rng() % 64;
+		size_t size = rng() % (i % 16 ? 1024 : data.size() - offset);
+		uint32_t init = (uint32_t)rng();
+		uint32_t expected = implementations[0].update(init, data.data() + offset, size);
+		for (size_t k = 1; k != implementation_count(); ++k) {
+			if (implementations[k].update(init, data.data() + offset, size) != expected) ++failed;
+		}
+	}
+	return failed;
+}
+
+void usage(const char* argv0) {
+	printf("usage: %s [-m megabytes] [-c checks] [-s seed]\n", argv0);
+	printf("  -m  number of megabytes to checksum for each timing (default: 256)\n");
+	printf("  -c  number of random inputs to compare the implementations on (default: 10000)\n");
+	printf("  -s  random seed (default: 1)\n");
+}
+
+}
+
+int main(int argc, const char** argv) {
+
+	size_t megabytes = 256;
+	size_t checks = 10000;
+	unsigned seed = 1;
+
+	for (int i = 1; i < argc; ++i) {
+		a_string arg = argv[i];
+		if (arg == "-m" && i + 1 < argc) megabytes = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-c" && i + 1 < argc) checks = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-s" && i + 1 < argc) seed = (unsigned)std::atoi(argv[++i]);
+		else {
+			usage(argv[0]);
+			return arg == "-h" || arg == "--help" ? 0 : 1;
+		}
+	}
+
+	std::mt19937 rng(seed);
+	a_vector<uint8_t> data(1024 * 1024);
+	for (auto& v : data) v = (uint8_t)rng();
+
+	size_t failed = check(data, rng, checks);
+	printf("pclmul %s\n", data_loading::crc32_has_pclmul() ? "supported" : "not supported");
+	printf("%d of %d inputs checksummed differently\n", (int)failed, (int)checks);
+
+	uint32_t sink = 0xffffffff;
+	for (size_t size : {(size_t)4, (size_t)633, (size_t)8192, data.size()}) {
+		size_t total = megabytes * 1024 * 1024;
+		size_t iterations = (total + size - 1) / size;
+		printf("%d bytes:\n", (int)size);
+		for (size_t k = 0; k != implementation_count(); ++k) {
+			auto& impl = implementations[k];
+			auto start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i != iterations; ++i) sink = impl.update(sink, data.data(), size);
+			double t = seconds(std::chrono::steady_clock::now() - start);
+			double mb = (double)size * iterations / (1024 * 1024);
+			printf("  %-14s %8.3fs %10.1f MB/s\n", impl.name, t, t ? mb / t : 0.0);
+		}
+	}
+	printf("combined checksum %08x\n", sink);
+
+	return failed ? 1 : 0;
+}
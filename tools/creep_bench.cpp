@@ -0,0 +1,236 @@
+#include "bwgame.h"
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace bwgame;
+using namespace bwgame::tools;
+
+// Runs the same synthetic receding creep workload (adding receding tiles,
+// removing them near new creep providers, changing their neighbor counts
+// and picking a random tile to recede on recede_creep's timer) against
+// creep_life_t and against the original pointer-linked implementation,
+// checks that both pick the same tiles in the same order, and times each.
+// The operations mirror state_functions::set_creep_receding,
+// add_creep_provider, set_tile_creep and recede_creep.
+
+namespace {
+
+// creep_life_t as it was with intrusive lists of pointers.
+struct creep_life_reference {
+	struct entry {
+		std::pair<entry*, entry*> hash_link;
+		std::pair<entry*, entry*> list_link;
+		xy_t<size_t> tile_pos;
+		size_t n_neighboring_creep_tiles = 0;
+	};
+	struct entry_hash_table {
+		std::array<intrusive_list<entry, void, &entry::hash_link>, 0x200> buckets;
+		entry* find(xy_t<size_t> tile_pos) {
+			size_t index = (tile_pos.y * 7 + tile_pos.x) % buckets.size();
+			for (auto& v : buckets[index]) {
+				if (v.tile_pos == tile_pos) return &v;
+			}
+			return nullptr;
+		}
+		void remove(entry* v) {
+			size_t index = (v->tile_pos.y * 7 + v->tile_pos.x) % buckets.size();
+			buckets[index].remove(*v);
+		}
+		void insert(entry* v) {
+			size_t index = (v->tile_pos.y * 7 + v->tile_pos.x) % buckets.size();
+			buckets[index].push_front(*v);
+		}
+	};
+	std::array<intrusive_list<entry, void, &entry::list_link>, 9> lists;
+	std::array<size_t, 9> lists_size{};
+	intrusive_list<entry, void, &entry::list_link> free_list;
+	size_t free_list_size = 0;
+	entry_hash_table table;
+
+	a_vector<entry> entry_container = a_vector<entry>(1024);
+
+	creep_life_reference() {
+		for (auto& v : entry_container) {
+			free_list.push_back(v);
+			++free_list_size;
+		}
+	}
+};
+
+struct reference_adapter {
+	using entry = creep_life_reference::entry;
+	creep_life_reference c;
+
+	entry* find(xy_t<size_t> tile_pos) {
+		return c.table.find(tile_pos);
+	}
+	bool add(xy_t<size_t> tile_pos, size_t n_neighbors) {
+		if (c.free_list.empty()) return false;
+		auto* v = &c.free_list.front();
+		c.free_list.pop_front();
+		--c.free_list_size;
+		v->n_neighboring_creep_tiles = n_neighbors;
+		v->tile_pos = tile_pos;
+		c.lists[n_neighbors].push_front(*v);
+		++c.lists_size[n_neighbors];
+		c.table.insert(v);
+		return true;
+	}
+	void remove(entry* v) {
+		c.table.remove(v);
+		c.lists[v->n_neighboring_creep_tiles].remove(*v);
+		--c.lists_size[v->n_neighboring_creep_tiles];
+		v->n_neighboring_creep_tiles = 9;
+		c.free_list.push_front(*v);
+		++c.free_list_size;
+	}
+	void set_n_neighbors(entry* v, size_t n_neighbors) {
+		c.lists[v->n_neighboring_creep_tiles].remove(*v);
+		--c.lists_size[v->n_neighboring_creep_tiles];
+		v->n_neighboring_creep_tiles = n_neighbors;
+		c.lists[n_neighbors].push_front(*v);
+		++c.lists_size[n_neighbors];
+	}
+	size_t list_size(size_t n_neighbors) {
+		return c.lists_size[n_neighbors];
+	}
+	entry* list_at(size_t n_neighbors, size_t index) {
+		auto it = c.lists[n_neighbors].begin();
+		std::advance(it, index);
+		return &*it;
+	}
+	size_t free_list_size() {
+		return c.free_list_size;
+	}
+};
+
+struct creep_life_adapter {
+	using entry = creep_life_t::entry;
+	creep_life_t c;
+
+	entry* find(xy_t<size_t> tile_pos) {
+		return c.find(tile_pos);
+	}
+	bool add(xy_t<size_t> tile_pos, size_t n_neighbors) {
+		return c.add(tile_pos, n_neighbors) != nullptr;
+	}
+	void remove(entry* v) {
+		c.remove(v);
+	}
+	void set_n_neighbors(entry* v, size_t n_neighbors) {
+		c.set_n_neighbors(v, n_neighbors);
+	}
+	size_t list_size(size_t n_neighbors) {
+		return c.lists[n_neighbors].size;
+	}
+	entry* list_at(size_t n_neighbors, size_t index) {
+		return c.list_at(n_neighbors, index);
+	}
+	size_t free_list_size() {
+		return c.free_list_size();
+	}
+};
+
+struct run_result {
+	std::chrono::steady_clock::duration time{};
+	std::chrono::steady_clock::duration recede_time{};
+	uint32_t recede_hash = 2166136261u;
+	size_t receded = 0;
+};
+
+template<typename adapter_T>
+run_result run(size_t map_size, size_t frames, int fixed_neighbors, uint32_t seed) {
+	run_result r;
+	auto c = std::make_unique<adapter_T>();
+	std::mt19937 rng(seed);
+	auto rand_int = [&](int from, int to) {
+		return std::uniform_int_distribution<int>(from, to)(rng);
+	};
+	auto random_neighbors = [&]() {
+		return fixed_neighbors >= 0 ? (size_t)fixed_neighbors : (size_t)rand_int(0, 8);
+	};
+	auto random_pos = [&]() {
+		return xy_t<size_t>((size_t)rand_int(0, (int)map_size - 1), (size_t)rand_int(0, (int)map_size - 1));
+	};
+	int recede_timer = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t frame = 0; frame != frames; ++frame) {
+		for (int i = rand_int(0, 40); i; --i) {
+			auto pos = random_pos();
+			if (!c->find(pos)) c->add(pos, random_neighbors());
+		}
+		for (int i = rand_int(0, 20); i; --i) {
+			if (auto* v = c->find(random_pos())) c->remove(v);
+		}
+		for (int i = rand_int(0, 60); i; --i) {
+			if (auto* v = c->find(random_pos())) c->set_n_neighbors(v, random_neighbors());
+		}
+		if (recede_timer) {
+			--recede_timer;
+			continue;
+		}
+		std::array<int, 9> lut{1, 3, 5, 6, 7, 8, 9, 9, 9};
+		recede_timer = lut.at(c->free_list_size() >> 7);
+		auto recede_start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i != 9; ++i) {
+			size_t size = c->list_size(i);
+			if (!size) continue;
+			auto* v = c->list_at(i, (size_t)rand_int(0, (int)size - 1));
+			r.recede_hash = (r.recede_hash ^ (uint32_t)(v->tile_pos.y * map_size + v->tile_pos.x)) * 16777619u;
+			c->remove(v);
+			++r.receded;
+			break;
+		}
+		r.recede_time += std::chrono::steady_clock::now() - recede_start;
+	}
+	r.time = std::chrono::steady_clock::now() - start;
+	return r;
+}
+
+void usage(const char* argv0) {
+	printf("usage: %s [-m map_size] [-f frames] [-n neighbors] [-s seed]\n", argv0);
+	printf("  -n  give every receding tile this many neighboring creep tiles, as in the middle of a large\n");
+	printf("      area of creep, instead of a random number\n");
+}
+
+}
+
+int main(int argc, const char** argv) {
+
+	size_t map_size = 64;
+	size_t frames = 200000;
+	int fixed_neighbors = -1;
+	uint32_t seed = 42;
+
+	for (int i = 1; i < argc; ++i) {
+		a_string arg = argv[i];
+		if (arg == "-m" && i + 1 < argc) map_size = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-f" && i + 1 < argc) frames = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-n" && i + 1 < argc) fixed_neighbors = std::atoi(argv[++i]);
+		else if (arg == "-s" && i + 1 < argc) seed = (uint32_t)std::atoi(argv[++i]);
+		else {
+			usage(argv[0]);
+			return arg == "-h" || arg == "--help" ? 0 : 1;
+		}
+	}
+
+	if (fixed_neighbors > 8) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	auto reference_r = run<reference_adapter>(map_size, frames, fixed_neighbors, seed);
+	auto creep_life_r = run<creep_life_adapter>(map_size, frames, fixed_neighbors, seed);
+
+	printf("%dx%d tiles, %d frames, %d tiles receded\n", (int)map_size, (int)map_size, (int)frames, (int)creep_life_r.receded);
+	printf("  pointer lists   %10.3fs (recede %.3fs)\n", seconds(reference_r.time), seconds(reference_r.recede_time));
+	printf("  creep_life_t    %10.3fs (recede %.3fs)\n", seconds(creep_life_r.time), seconds(creep_life_r.recede_time));
+
+	bool same = reference_r.recede_hash == creep_life_r.recede_hash && reference_r.receded == creep_life_r.receded;
+	printf("results %s\n", same ? "identical" : "DIFFER");
+	return same ? 0 : 1;
+}
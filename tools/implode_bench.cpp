@@ -0,0 +1,393 @@
+#include "data_loading.h"
+#include "replay_saver.h"
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace bwgame;
+using namespace bwgame::tools;
+
+// Compares data_loading::decompress with the original bit by bit implode
+// decoder below, on sample data compressed with data_loading::compress and
+// on corrupted copies of it, and times both. The two must produce the same
+// output, and must fail on the same inputs.
+
+namespace {
+
+// The implode decoder that data_loading::decompress replaced. Distances that
+// reach before the start of the output are errors here; the original went
+// on to read out of bounds.
+void decompress_reference(const uint8_t* input, size_t input_size, uint8_t* output, size_t output_size) {
+	data_loading::data_reader_le source_r(input, input + input_size);
+	auto r = data_loading::make_bit_reader(source_r);
+	int type = r.get<uint8_t>();
+	int distance_bits = r.get<uint8_t>();
+
+	if (distance_bits != 4 && distance_bits != 5 && distance_bits != 6) error("decompress_reference: invalid distance bits %d", distance_bits);
+
+	auto get_length = [&]() {
+		switch (r.get_bits<2>()) {
+		case 3: return 1;
+		case 0:
+			switch (r.get_bits<2>()) {
+			case 3: return 6;
+			case 0:
+				switch (r.get_bits<6>()) {
+				case 3: return 22;
+				case 7: return 23;
+				case 11: return 24;
+				case 15: return 25;
+				case 19: return 26;
+				case 23: return 27;
+				case 27: return 28;
+				case 31: return 29;
+				case 35: return 30;
+				case 39: return 31;
+				case 43: return 32;
+				case 47: return 33;
+				case 51: return 34;
+				case 55: return 35;
+				case 59: return 36;
+				case 63: return 37;
+				case 0: return 262 + 8 * r.get_bits<5>();
+				case 1: return r.get_bits<1>() ? 54 : 38;
+				case 2: return 70 + 16 * r.get_bits<2>();
+				case 4: return 134 + 8 * r.get_bits<4>();
+				case 5: return r.get_bits<1>() ? 55 : 39;
+				case 6: return 71 + 16 * r.get_bits<2>();
+				case 8: return 263 + 8 * r.get_bits<5>();
+				case 9: return r.get_bits<1>() ? 56 : 40;
+				case 10: return 72 + 16 * r.get_bits<2>();
+				case 12: return 135 + 8 * r.get_bits<4>();
+				case 13: return r.get_bits<1>() ? 57 : 41;
+				case 14: return 73 + 16 * r.get_bits<2>();
+				case 16: return 264 + 8 * r.get_bits<5>();
+				case 17: return r.get_bits<1>() ? 58 : 42;
+				case 18: return 74 + 16 * r.get_bits<2>();
+				case 20: return 136 + 8 * r.get_bits<4>();
+				case 21: return r.get_bits<1>() ? 59 : 43;
+				case 22: return 75 + 16 * r.get_bits<2>();
+				case 24: return 265 + 8 * r.get_bits<5>();
+				case 25: return r.get_bits<1>() ? 60 : 44;
+				case 26: return 76 + 16 * r.get_bits<2>();
+				case 28: return 137 + 8 * r.get_bits<4>();
+				case 29: return r.get_bits<1>() ? 61 : 45;
+				case 30: return 77 + 16 * r.get_bits<2>();
+				case 32: return 266 + 8 * r.get_bits<5>();
+				case 33: return r.get_bits<1>() ? 62 : 46;
+				case 34: return 78 + 16 * r.get_bits<2>();
+				case 36: return 138 + 8 * r.get_bits<4>();
+				case 37: return r.get_bits<1>() ? 63 : 47;
+				case 38: return 79 + 16 * r.get_bits<2>();
+				case 40: return 267 + 8 * r.get_bits<5>();
+				case 41: return r.get_bits<1>() ? 64 : 48;
+				case 42: return 80 + 16 * r.get_bits<2>();
+				case 44: return 139 + 8 * r.get_bits<4>();
+				case 45: return r.get_bits<1>() ? 65 : 49;
+				case 46: return 81 + 16 * r.get_bits<2>();
+				case 48: return 268 + 8 * r.get_bits<5>();
+				case 49: return r.get_bits<1>() ? 66 : 50;
+				case 50: return 82 + 16 * r.get_bits<2>();
+				case 52: return 140 + 8 * r.get_bits<4>();
+				case 53: return r.get_bits<1>() ? 67 : 51;
+				case 54: return 83 + 16 * r.get_bits<2>();
+				case 56: return 269 + 8 * r.get_bits<5>();
+				case 57: return r.get_bits<1>() ? 68 : 52;
+				case 58: return 84 + 16 * r.get_bits<2>();
+				case 60: return 141 + 8 * r.get_bits<4>();
+				case 61: return r.get_bits<1>() ? 69 : 53;
+				case 62: return 85 + 16 * r.get_bits<2>();
+				}
+			case 1:
+				switch (r.get_bits<1>()) {
+				case 1: return 7;
+				case 0: return r.get_bits<1>() ? 9 : 8;
+				}
+			case 2:
+				switch (r.get_bits<3>()) {
+				case 1: return 10;
+				case 3: return 11;
+				case 5: return 12;
+				case 7: return 13;
+				case 0: return r.get_bits<1>() ? 18 : 14;
+				case 2: return r.get_bits<1>() ? 19 : 15;
+				case 4: return r.get_bits<1>() ? 20 : 16;
+				case 6: return r.get_bits<1>() ? 21 : 17;
+				}
+			}
+		case 1: return r.get_bits<1>() ? 0 : 2;
+		case 2:
+			switch (r.get_bits<1>()) {
+			case 1: return 3;
+			case 0: return r.get_bits<1>() ? 4 : 5;
+			}
+		}
+		return -1;
+	};
+
+	auto get_distance = [&]() {
+		switch (r.get_bits<2>()) {
+		case 3: return 0;
+		case 0:
+			switch (r.get_bits<5>()) {
+			case 1: return 39;
+			case 2: return 47;
+			case 3: return 31;
+			case 5: return 35;
+			case 6: return 43;
+			case 7: return 27;
+			case 9: return 37;
+			case 10: return 45;
+			case 11: return 29;
+			case 13: return 33;
+			case 14: return 41;
+			case 15: return 25;
+			case 17: return 38;
+			case 18: return 46;
+			case 19: return 30;
+			case 21: return 34;
+			case 22: return 42;
+			case 23: return 26;
+			case 25: return 36;
+			case 26: return 44;
+			case 27: return 28;
+			case 29: return 32;
+			case 30: return 40;
+			case 31: return 24;
+			case 0: return r.get_bits<1>() ? 62 : 63;
+			case 4: return r.get_bits<1>() ? 54 : 55;
+			case 8: return r.get_bits<1>() ? 58 : 59;
+			case 12: return r.get_bits<1>() ? 50 : 51;
+			case 16: return r.get_bits<1>() ? 60 : 61;
+			case 20: return r.get_bits<1>() ? 52 : 53;
+			case 24: return r.get_bits<1>() ? 56 : 57;
+			case 28: return r.get_bits<1>() ? 48 : 49;
+			}
+		case 1:
+			switch (r.get_bits<2>()) {
+			case 1: return 2;
+			case 3: return 1;
+			case 0: return r.get_bits<1>() ? 5 : 6;
+			case 2: return r.get_bits<1>() ? 3 : 4;
+			}
+		case 2:
+			switch (r.get_bits<4>()) {
+			case 1: return 14;
+			case 2: return 18;
+			case 3: return 10;
+			case 4: return 20;
+			case 5: return 12;
+			case 6: return 16;
+			case 7: return 8;
+			case 8: return 21;
+			case 9: return 13;
+			case 10: return 17;
+			case 11: return 9;
+			case 12: return 19;
+			case 13: return 11;
+			case 14: return 15;
+			case 15: return 7;
+			case 0: return r.get_bits<1>() ? 22 : 23;
+			}
+		}
+		return -1;
+	};
+
+
+	size_t out_pos = 0;
+
+	if (type == 0) {
+
+		while (out_pos != output_size) {
+			if (r.get_bits<1>()) {
+
+				size_t len = 2 + get_length();
+				size_t distance = 0;
+
+				if (len == 519) error("decompress_reference: eof marker found too early");
+
+				if (len == 2) {
+					distance = get_distance() << 2;
+					distance |= r.get_bits<2>();
+				} else {
+					distance = get_distance() << distance_bits;
+					if (distance_bits == 4) distance |= r.get_bits<4>();
+					else if (distance_bits == 5) distance |= r.get_bits<5>();
+					else distance |= r.get_bits<6>();
+				}
+				size_t src_pos = out_pos - 1 - distance;
+				if (src_pos > output_size) {
+					error("decompress_reference: distance out of range");
+				}
+				if (src_pos + len > output_size) {
+					len = output_size - src_pos;
+				}
+				if (out_pos + len > output_size) {
+					len = output_size - out_pos;
+				}
+				for (size_t i = 0; i != len; ++i) {
+					output[out_pos + i] = output[src_pos + i];
+				}
+				out_pos += len;
+
+			} else {
+				output[out_pos] = r.get<uint8_t>();
+				++out_pos;
+			}
+		}
+
+	} else error("decompress_reference: type %d not supported", type);
+}
+
+struct sample {
+	a_vector<uint8_t> compressed;
+	size_t size;
+};
+
+// Splits data into segments of up to 8192 bytes, like replays do, and
+// compresses each.
+void add_samples(a_vector<sample>& samples, const a_vector<uint8_t>& data) {
+	for (size_t pos = 0; pos < data.size(); pos += 8192) {
+		size_t n = std::min(data.size() - pos, (size_t)8192);
+		sample s;
+		s.size = n;
+		s.compressed.reserve(4 + 4 + n + (n - 1) / 2);
+		auto w = data_loading::make_vector_writer(s.compressed);
+		data_loading::compress(data.data() + pos, n, w);
+		samples.push_back(std::move(s));
+	}
+}
+
+// Random data with a mix of literals and repeats of recent data.
+a_vector<uint8_t> random_sample_data(std::mt19937& rng, size_t size) {
+	a_vector<uint8_t> r;
+	int alphabet = 1 + rng() % 256;
+	while (r.size() < size) {
+		if (r.size() > 4 && rng() % 2) {
+			size_t distance = 1 + rng() % std::min(r.size(), (size_t)4096);
+			size_t len = 2 + rng() % (rng() % 8 ? 16 : 600);
+			for (size_t i = 0; i != len && r.size() < size; ++i) r.push_back(r[r.size() - distance]);
+		} else r.push_back((uint8_t)(rng() % alphabet));
+	}
+	return r;
+}
+
+template<typename F>
+bool try_decompress(F&& f, const a_vector<uint8_t>& input, a_vector<uint8_t>& output) {
+	try {
+		f(input.data(), input.size(), output.data(), output.size());
+		return true;
+	} catch (const std::exception&) {
+		return false;
+	}
+}
+
+// Returns the number of inputs on which the decoders disagree.
+size_t check(const a_vector<sample>& samples, std::mt19937& rng, size_t corruptions) {
+	size_t failed = 0;
+	a_vector<uint8_t> a, b;
+	auto compare = [&](const a_vector<uint8_t>& input, size_t size) {
+		a.assign(size, 0);
+		b.assign(size, 0);
+		bool a_ok = try_decompress(decompress_reference, input, a);
+		bool b_ok = try_decompress(data_loading::decompress<>, input, b);
+		if (a_ok != b_ok || (a_ok && a != b)) ++failed;
+	};
+	for (auto& s : samples) {
+		compare(s.compressed, s.size);
+		for (size_t i = 0; i != corruptions; ++i) {
+			auto input = s.compressed;
+			switch (rng() % 3) {
+			case 0:
+				input[rng() % input.size()] ^= (uint8_t)(1 << rng() % 8);
+				break;
+			case 1:
+				input.resize(rng() % input.size());
+				break;
+			case 2:
+				for (size_t n = 1 + rng() % 8; n; --n) input[rng() % input.size()] = (uint8_t)rng();
+				break;
+			}
+			compare(input, s.size);
+		}
+	}
+	return failed;
+}
+
+template<typename F>
+double time_decompress(F&& f, const a_vector<sample>& samples, size_t repeat) {
+	a_vector<uint8_t> output(8192);
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i != repeat; ++i) {
+		for (auto& s : samples) f(s.compressed.data(), s.compressed.size(), output.data(), s.size);
+	}
+	return seconds(std::chrono::steady_clock::now() - start);
+}
+
+void usage(const char* argv0) {
+	printf("usage: %s [-n samples] [-c corruptions] [-r repeat] [-s seed] [file]...\n", argv0);
+	printf("  -n  number of random samples of 8192 bytes (default: 1000)\n");
+	printf("  -c  number of corrupted copies of each sample to compare (default: 10)\n");
+	printf("  -r  number of times to decompress all samples when timing (default: 10)\n");
+	printf("  -s  random seed (default: 1)\n");
+	printf("  files are added as samples too\n");
+}
+
+}
+
+int main(int argc, const char** argv) {
+
+	size_t random_samples = 1000;
+	size_t corruptions = 10;
+	size_t repeat = 10;
+	unsigned seed = 1;
+	a_vector<a_string> files;
+
+	for (int i = 1; i < argc; ++i) {
+		a_string arg = argv[i];
+		if (arg == "-n" && i + 1 < argc) random_samples = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-c" && i + 1 < argc) corruptions = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-r" && i + 1 < argc) repeat = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-s" && i + 1 < argc) seed = (unsigned)std::atoi(argv[++i]);
+		else if (arg == "-h" || arg == "--help") {
+			usage(argv[0]);
+			return 0;
+		} else files.push_back(std::move(arg));
+	}
+
+	try {
+		std::mt19937 rng(seed);
+		a_vector<sample> samples;
+		for (size_t i = 0; i != random_samples; ++i) add_samples(samples, random_sample_data(rng, 1 + rng() % 8192));
+		for (auto& fn : files) {
+			data_loading::mapped_file file(fn);
+			add_samples(samples, a_vector<uint8_t>(file.data, file.data + file.size));
+		}
+
+		size_t compressed_size = 0;
+		size_t size = 0;
+		for (auto& s : samples) {
+			compressed_size += s.compressed.size();
+			size += s.size;
+		}
+		printf("%d samples, %d bytes compressed to %d\n", (int)samples.size(), (int)size, (int)compressed_size);
+
+		size_t failed = check(samples, rng, corruptions);
+		printf("%d of %d inputs decoded differently\n", (int)failed, (int)(samples.size() * (1 + corruptions)));
+
+		double mb = (double)size * repeat / (1024 * 1024);
+		double reference = time_decompress(decompress_reference, samples, repeat);
+		double table = time_decompress(data_loading::decompress<>, samples, repeat);
+		printf("reference: %.3fs (%.1f MB/s)\n", reference, reference ? mb / reference : 0.0);
+		printf("table:     %.3fs (%.1f MB/s)\n", table, table ? mb / table : 0.0);
+		if (failed) return 1;
+	} catch (const std::exception& e) {
+		printf("error: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
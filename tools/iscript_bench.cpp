@@ -0,0 +1,132 @@
+#include "bwgame.h"
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+
+using namespace bwgame;
+using namespace bwgame::tools;
+
+// Steps every animation of every iscript script through iscript_execute in
+// noop mode, as update_unit_speed does for walking animations, and times
+// the interpreter. The waits, return values and rng state seen along the way
+// are hashed; the hash must be the same for every build given the same data
+// files, so it shows whether a change to the interpreter or the iscript
+// loader changed what the scripts do.
+
+namespace {
+
+struct bench_result {
+	std::chrono::steady_clock::duration time{};
+	size_t animations = 0;
+	size_t steps = 0;
+	size_t errors = 0;
+	uint32_t hash = 2166136261u;
+	void add(uint32_t v) {
+		hash ^= v;
+		hash *= 16777619u;
+	}
+};
+
+bench_result run(const global_state& global_st, size_t steps_per_animation) {
+	bench_result r;
+
+	game_state game_st;
+	state st;
+	st.global = &global_st;
+	st.game = &game_st;
+	st.random_counts.fill(0);
+	st.total_random_counts = 0;
+	st.lcg_rand_state = 42;
+	state_functions funcs(st);
+
+	a_vector<const iscript_t::script*> scripts;
+	for (auto& v : global_st.iscript.scripts) scripts.push_back(&v.second);
+	std::sort(scripts.begin(), scripts.end(), [](auto* a, auto* b) {
+		return a->id < b->id;
+	});
+
+	auto start = std::chrono::steady_clock::now();
+	for (auto* script : scripts) {
+		for (size_t anim = 0; anim != script->animation_pc.size(); ++anim) {
+			if (!script->animation_pc[anim]) continue;
+			++r.animations;
+			image_t image{};
+			iscript_state_t& s = image.iscript_state;
+			s.current_script = script;
+			s.animation = (int)anim;
+			s.program_counter = script->animation_pc[anim];
+			s.return_address = 0;
+			s.wait = 0;
+			try {
+				for (size_t i = 0; i != steps_per_animation; ++i) {
+					r.add(funcs.iscript_execute(&image, s, true) ? 1 : 0);
+					r.add((uint32_t)s.wait);
+					++r.steps;
+				}
+			} catch (const std::exception&) {
+				++r.errors;
+				r.add(0xffffffff);
+			}
+			r.add(st.lcg_rand_state);
+		}
+	}
+	r.time = std::chrono::steady_clock::now() - start;
+	return r;
+}
+
+void usage(const char* argv0) {
+	printf("usage: %s [-d data_path] [-n steps] [-r repeat]\n", argv0);
+	printf("  -d  directory containing StarDat.mpq, BrooDat.mpq and Patch_rt.mpq (default: .)\n");
+	printf("  -n  number of frames to step each animation (default: 1000)\n");
+	printf("  -r  number of times to run all animations (default: 10)\n");
+}
+
+}
+
+int main(int argc, const char** argv) {
+
+	a_string data_path = ".";
+	size_t steps = 1000;
+	size_t repeat = 10;
+
+	for (int i = 1; i < argc; ++i) {
+		a_string arg = argv[i];
+		if (arg == "-d" && i + 1 < argc) data_path = argv[++i];
+		else if (arg == "-n" && i + 1 < argc) steps = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-r" && i + 1 < argc) repeat = (size_t)std::atoi(argv[++i]);
+		else {
+			usage(argv[0]);
+			return arg == "-h" || arg == "--help" ? 0 : 1;
+		}
+	}
+
+	try {
+		global_state global_st;
+		global_init(global_st, data_loading::data_files_directory(data_path), false);
+
+		bench_result first;
+		std::chrono::steady_clock::duration total_time{};
+		for (size_t i = 0; i != repeat; ++i) {
+			auto r = run(global_st, steps);
+			if (i == 0) first = r;
+			else if (r.hash != first.hash) {
+				printf("error: run %d hash %08x differs from the first run %08x\n", (int)i, r.hash, first.hash);
+				return 1;
+			}
+			total_time += r.time;
+		}
+
+		double s = seconds(total_time);
+		size_t total_steps = first.steps * repeat;
+		printf("%d animations, %d steps per run, %d errors\n", (int)first.animations, (int)first.steps, (int)first.errors);
+		printf("%d runs in %.3fs (%.1fns per step)\n", (int)repeat, s, total_steps ? s * 1e9 / total_steps : 0.0);
+		printf("hash %08x\n", first.hash);
+	} catch (const std::exception& e) {
+		printf("error: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include "bwgame.h"
+#include "replay.h"
+#include "replay_batch.h"
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+
+using namespace bwgame;
+using namespace bwgame::tools;
+
+namespace {
+
+void usage(const char* argv0) {
+	printf("usage: %s [-d data_path] [-j threads] [-q] <replay file or directory>...\n", argv0);
+	printf("  -d  directory containing StarDat.mpq, BrooDat.mpq and Patch_rt.mpq (default: .)\n");
+	printf("  -j  number of replays to simulate concurrently (default: number of hardware threads)\n");
+	printf("  -q  only print failures and the summary\n");
+}
+
+}
+
+int main(int argc, const char** argv) {
+
+	a_string data_path = ".";
+	size_t thread_count = 0;
+	bool quiet = false;
+	a_vector<a_string> files;
+
+	for (int i = 1; i < argc; ++i) {
+		a_string arg = argv[i];
+		if (arg == "-d" && i + 1 < argc) data_path = argv[++i];
+		else if (arg == "-j" && i + 1 < argc) thread_count = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-q") quiet = true;
+		else if (arg == "-h" || arg == "--help") {
+			usage(argv[0]);
+			return 0;
+		} else add_replay_files(files, std::move(arg));
+	}
+	if (files.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	try {
+		auto load_start = std::chrono::steady_clock::now();
+		global_state global_st;
+		global_init(global_st, data_loading::data_files_directory(data_path), false);
+		printf("global_init: %.3fs\n", seconds(std::chrono::steady_clock::now() - load_start));
+
+		auto start = std::chrono::steady_clock::now();
+		auto results = run_replay_batch(global_st, files, thread_count);
+		double wall = seconds(std::chrono::steady_clock::now() - start);
+
+		size_t failed = 0;
+		uint64_t frames = 0;
+		for (auto& r : results) {
+			if (r.success) {
+				frames += (uint64_t)r.end_frame;
+				if (!quiet) printf("%s: %d frames\n", r.filename.c_str(), r.end_frame);
+			} else {
+				++failed;
+				printf("%s: error: %s\n", r.filename.c_str(), r.error_message.c_str());
+			}
+		}
+		printf("total: %d replays (%d failed), %llu frames in %.3fs (%.0f frames/s)\n", (int)results.size(), (int)failed, (unsigned long long)frames, wall, wall ? frames / wall : 0.0);
+	} catch (const std::exception& e) {
+		printf("error: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
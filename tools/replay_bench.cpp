@@ -0,0 +1,360 @@
+#include "bwgame.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "state_file.h"
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+
+using namespace bwgame;
+using namespace bwgame::tools;
+
+namespace {
+
+using bench_clock = std::chrono::high_resolution_clock;
+
+struct phase_timings {
+	enum {
+		phase_execute_actions,
+		phase_recede_creep,
+		phase_update_tiles,
+		phase_update_units,
+		phase_update_bullets,
+		phase_update_thingies,
+		phase_process_triggers,
+		phase_count
+	};
+	std::array<bench_clock::duration, phase_count> time{};
+	size_t frames = 0;
+
+	static const char* name(size_t index) {
+		static const std::array<const char*, phase_count> names = {
+			"execute_actions", "recede_creep", "update_tiles", "update_units", "update_bullets", "update_thingies", "process_triggers"
+		};
+		return names.at(index);
+	}
+
+	bench_clock::duration total() const {
+		bench_clock::duration r{};
+		for (auto& v : time) r += v;
+		return r;
+	}
+
+	void add(const phase_timings& n) {
+		for (size_t i = 0; i != phase_count; ++i) time[i] += n.time[i];
+		frames += n.frames;
+	}
+};
+
+// Mirrors replay_functions::next_frame and state_functions::process_frame,
+// but times each phase separately.
+struct bench_replay_functions : replay_functions {
+	phase_timings& timings;
+	bench_replay_functions(state& st, action_state& action_st, replay_state& replay_st, phase_timings& timings) : replay_functions(st, action_st, replay_st), timings(timings) {}
+
+	template<typename F>
+	void timed(size_t phase, F&& f) {
+		auto start = bench_clock::now();
+		f();
+		timings.time[phase] += bench_clock::now() - start;
+	}
+
+	void next_frame() {
+		if (st.current_frame == replay_st.end_frame) error("replay: attempt to play past end");
+		timed(phase_timings::phase_execute_actions, [&]() {
+			execute_actions(replay_st.actions_data_buffer.data(), replay_st.actions_data_buffer.data() + replay_st.actions_data_buffer.size());
+		});
+		++st.current_frame;
+		timed(phase_timings::phase_recede_creep, [&]() {recede_creep();});
+		timed(phase_timings::phase_update_tiles, [&]() {update_tiles_timer();});
+		timed(phase_timings::phase_update_units, [&]() {update_units();});
+		timed(phase_timings::phase_update_bullets, [&]() {update_bullets();});
+		timed(phase_timings::phase_update_thingies, [&]() {update_thingies();});
+		timed(phase_timings::phase_process_triggers, [&]() {process_triggers();});
+		++timings.frames;
+	}
+};
+
+// An FNV-1a hash over the parts of the game state that any simulation
+// difference quickly shows up in. Builds with different containers or
+// optimizations must produce the same hash for the same replay.
+struct state_hasher {
+	uint32_t hash = 2166136261u;
+	void add(uint32_t v) {
+		hash ^= v;
+		hash *= 16777619u;
+	}
+	void add_frame(const state& st) {
+		add((uint32_t)st.current_frame);
+		add(st.lcg_rand_state);
+		for (auto v : st.current_minerals) add(v);
+		for (auto v : st.current_gas) add(v);
+		add(st.active_orders_size);
+		add(st.active_bullets_size);
+		add(st.active_thingies_size);
+		auto add_units = [&](auto& list) {
+			for (const unit_t* u : ptr(list)) {
+				add((uint32_t)u->index);
+				add((uint32_t)u->order_type->id);
+				add(u->hp.raw_value);
+				add(u->shield_points.raw_value);
+				add(u->exact_position.x.raw_value);
+				add(u->exact_position.y.raw_value);
+			}
+		};
+		add_units(st.visible_units);
+		add_units(st.hidden_units);
+		for (auto& v : st.unit_finder_x) {
+			add((uint32_t)v.u->index);
+			add(v.value);
+		}
+	}
+};
+
+void print_timings(const phase_timings& t, bench_clock::duration wall_time) {
+	double total = seconds(t.total());
+	for (size_t i = 0; i != phase_timings::phase_count; ++i) {
+		double s = seconds(t.time[i]);
+		printf("  %-18s %10.3fs %6.2f%%\n", phase_timings::name(i), s, total ? s * 100.0 / total : 0.0);
+	}
+	double wall = seconds(wall_time);
+	printf("  %d frames in %.3fs (%.0f frames/s)\n", (int)t.frames, wall, wall ? t.frames / wall : 0.0);
+}
+
+// Holds a saved state file in memory, to be read back with a data_reader_le.
+struct memory_writer {
+	a_vector<uint8_t> data;
+	template<typename T>
+	void put(T v) {
+		static_assert(std::is_integral<T>::value, "memory_writer: don't know how to write this type");
+		put_bytes((const uint8_t*)&v, sizeof(v));
+	}
+	void put_bytes(const uint8_t* src, size_t n) {
+		data.insert(data.end(), src, src + n);
+	}
+};
+
+void print_cache(const char* name, size_t hits, size_t misses) {
+	size_t total = hits + misses;
+	printf("  %s cache: %d hits, %d misses (%.1f%% hit rate)\n", name, (int)hits, (int)misses, total ? hits * 100.0 / total : 0.0);
+}
+
+#ifdef OPENBW_ENABLE_PROFILER
+void print_profiler_counters(const char* title, const char* label, const profiler_counter* begin, const profiler_counter* end, size_t max_lines) {
+	a_vector<size_t> indices;
+	uint64_t total_cycles = 0;
+	for (auto* i = begin; i != end; ++i) {
+		total_cycles += i->cycles;
+		if (i->calls) indices.push_back(i - begin);
+	}
+	std::sort(indices.begin(), indices.end(), [&](size_t a, size_t b) {
+		return begin[a].cycles > begin[b].cycles;
+	});
+	if (indices.size() > max_lines) indices.resize(max_lines);
+	printf("  %s:\n", title);
+	for (size_t i : indices) {
+		auto& c = begin[i];
+		printf("    %s %3d %14llu calls %16llu cycles %6.2f%% %10.0f cycles/call\n", label, (int)i, (unsigned long long)c.calls, (unsigned long long)c.cycles, total_cycles ? c.cycles * 100.0 / total_cycles : 0.0, (double)c.cycles / c.calls);
+	}
+}
+
+void print_profiler(const profiler_state& p) {
+	printf("profiler:\n");
+	print_profiler_counters("execute_main_order by order id", "order", p.orders.data(), p.orders.data() + p.orders.size(), 30);
+	print_profiler_counters("iscript_execute by opcode", "opcode", p.iscript_opcodes.data(), p.iscript_opcodes.data() + p.iscript_opcodes.size(), 30);
+	auto print_counter = [&](const char* name, const profiler_counter& c) {
+		printf("  %-18s %14llu calls %16llu cycles %10.0f cycles/call\n", name, (unsigned long long)c.calls, (unsigned long long)c.cycles, c.calls ? (double)c.cycles / c.calls : 0.0);
+	};
+	print_counter("pathfinder_find", p.pathfinder_find);
+	print_counter("reveal_sight_at", p.reveal_sight_at);
+	print_counter("unit_finder_search", p.unit_finder_search);
+}
+#endif
+
+void usage(const char* argv0) {
+	printf("usage: %s [-d data_path] [-g cache_file] [-q] [-s] [-c] [-k frames] [-r frame] <replay file or directory>...\n", argv0);
+	printf("  -d  directory containing StarDat.mpq, BrooDat.mpq and Patch_rt.mpq (default: .)\n");
+	printf("  -g  load the global state from this cache file, or write it there if it does not exist\n");
+	printf("  -q  only print the summary\n");
+	printf("  -s  print a hash of the game state over every frame of each replay\n");
+	printf("  -c  cross-check cached sight footprints against the uncached reveal_sight_at, and with -k, check\n");
+	printf("      that the tile pages shared by each snapshot have not been written to\n");
+	printf("  -k  every this many frames, take a snapshot of the game state and continue from it, and check\n");
+	printf("      that restoring the previous snapshot and then this one into another state gives the tiles the\n");
+	printf("      game had when the snapshot was taken\n");
+	printf("  -r  save the state, action state and replay state at this frame, and after the replay is done, load\n");
+	printf("      them and play the rest again, checking that the state hash of the frames after it is the same\n");
+}
+
+}
+
+int main(int argc, const char** argv) {
+
+	a_string data_path = ".";
+	a_string global_cache_filename;
+	bool quiet = false;
+	bool hash_state = false;
+	bool cross_check = false;
+	int copy_interval = 0;
+	int round_trip_frame = 0;
+	a_vector<a_string> files;
+
+	for (int i = 1; i < argc; ++i) {
+		a_string arg = argv[i];
+		if (arg == "-d" && i + 1 < argc) data_path = argv[++i];
+		else if (arg == "-g" && i + 1 < argc) global_cache_filename = argv[++i];
+		else if (arg == "-q") quiet = true;
+		else if (arg == "-s") hash_state = true;
+		else if (arg == "-c") cross_check = true;
+		else if (arg == "-k" && i + 1 < argc) copy_interval = std::atoi(argv[++i]);
+		else if (arg == "-r" && i + 1 < argc) round_trip_frame = std::atoi(argv[++i]);
+		else if (arg == "-h" || arg == "--help") {
+			usage(argv[0]);
+			return 0;
+		} else add_replay_files(files, std::move(arg));
+	}
+	if (files.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	try {
+		auto load_start = bench_clock::now();
+		global_state global_st;
+		bool from_cache = false;
+		if (!global_cache_filename.empty()) from_cache = global_init_cached(global_st, data_loading::data_files_directory(data_path), global_cache_filename, false);
+		else global_init(global_st, data_loading::data_files_directory(data_path), false);
+		printf("global_init: %.3fs%s\n", seconds(bench_clock::now() - load_start), from_cache ? " (from cache)" : "");
+
+		phase_timings total_timings;
+#ifdef OPENBW_ENABLE_PROFILER
+		profiler_state total_profiler;
+#endif
+		bench_clock::duration total_load_time{};
+		size_t total_sight_footprint_cache_hits = 0;
+		size_t total_sight_footprint_cache_misses = 0;
+		bench_clock::duration total_wall_time{};
+		size_t failed = 0;
+
+		for (auto& fn : files) {
+			phase_timings timings;
+			try {
+				game_state game_st;
+				state st;
+				st.global = &global_st;
+				st.game = &game_st;
+				action_state action_st;
+				replay_state replay_st;
+				bench_replay_functions funcs(st, action_st, replay_st, timings);
+				funcs.cross_check_sight_footprints = cross_check;
+#ifdef OPENBW_ENABLE_PROFILER
+				profiler_state profiler;
+				funcs.profiler = &profiler;
+#endif
+
+				auto start = bench_clock::now();
+				funcs.load_replay_file(fn);
+				auto load_time = bench_clock::now() - start;
+
+				state_hasher hasher;
+				state_hasher round_trip_hasher;
+				memory_writer saved;
+				std::array<state_snapshot, 2> snapshots;
+				size_t snapshot_index = 0;
+				state check_st;
+				check_st.global = &global_st;
+				check_st.game = &game_st;
+				a_vector<tile_t> live_tiles;
+				a_vector<uint16_t> live_tiles_mega_tile_index;
+				start = bench_clock::now();
+				while (!funcs.is_done()) {
+					funcs.next_frame();
+					if (copy_interval > 0 && st.current_frame % copy_interval == 0) {
+						auto& prev = snapshots[snapshot_index];
+						snapshot_index ^= 1;
+						live_tiles = st.tiles;
+						live_tiles_mega_tile_index = st.tiles_mega_tile_index;
+						take_snapshot(st, snapshots[snapshot_index], &prev, cross_check);
+						restore_snapshot(snapshots[snapshot_index], st);
+						if (!prev.tiles.pages.empty()) restore_snapshot(prev, check_st);
+						restore_snapshot(snapshots[snapshot_index], check_st);
+						for (state* s : {&check_st, &st}) {
+							if (s->tiles.size() != live_tiles.size() || memcmp(s->tiles.data(), live_tiles.data(), live_tiles.size() * sizeof(tile_t))) {
+								error("frame %d: tiles restored from snapshot differ", st.current_frame);
+							}
+							if (s->tiles_mega_tile_index != live_tiles_mega_tile_index) {
+								error("frame %d: mega tile indices restored from snapshot differ", st.current_frame);
+							}
+						}
+					}
+					if (hash_state) hasher.add_frame(st);
+					if (round_trip_frame > 0 && st.current_frame > round_trip_frame) round_trip_hasher.add_frame(st);
+					if (round_trip_frame > 0 && st.current_frame == round_trip_frame) {
+						save_state(saved, st);
+						save_action_state(saved, action_st, st);
+						save_replay_state(saved, replay_st);
+					}
+				}
+				auto wall_time = bench_clock::now() - start;
+
+				if (round_trip_frame > 0) {
+					if (saved.data.empty()) error("the replay ends before frame %d", round_trip_frame);
+					state loaded_st;
+					loaded_st.global = &global_st;
+					loaded_st.game = &game_st;
+					action_state loaded_action_st;
+					replay_state loaded_replay_st;
+					data_loading::data_reader_le r(saved.data.data(), saved.data.data() + saved.data.size());
+					load_state(r, loaded_st);
+					load_action_state(r, loaded_action_st, loaded_st);
+					load_replay_state(r, loaded_replay_st);
+					phase_timings loaded_timings;
+					bench_replay_functions loaded_funcs(loaded_st, loaded_action_st, loaded_replay_st, loaded_timings);
+					loaded_funcs.cross_check_sight_footprints = cross_check;
+					state_hasher loaded_hasher;
+					while (!loaded_funcs.is_done()) {
+						loaded_funcs.next_frame();
+						loaded_hasher.add_frame(loaded_st);
+					}
+					if (loaded_st.current_frame != st.current_frame || loaded_hasher.hash != round_trip_hasher.hash) {
+						error("state loaded at frame %d ends at frame %d with hash %08x, expected frame %d with hash %08x", round_trip_frame, loaded_st.current_frame, loaded_hasher.hash, st.current_frame, round_trip_hasher.hash);
+					}
+					printf("%s: state saved and loaded at frame %d (%d bytes) plays the same\n", fn.c_str(), round_trip_frame, (int)saved.data.size());
+				}
+
+				total_load_time += load_time;
+				total_sight_footprint_cache_hits += st.sight_footprint_cache.hits;
+				total_sight_footprint_cache_misses += st.sight_footprint_cache.misses;
+				total_wall_time += wall_time;
+				total_timings.add(timings);
+#ifdef OPENBW_ENABLE_PROFILER
+				total_profiler.add(profiler);
+#endif
+
+				if (!quiet) {
+					printf("%s: load %.3fs\n", fn.c_str(), seconds(load_time));
+					print_timings(timings, wall_time);
+					print_cache("sight footprint", st.sight_footprint_cache.hits, st.sight_footprint_cache.misses);
+				}
+				if (hash_state) printf("%s: state hash %08x\n", fn.c_str(), hasher.hash);
+			} catch (const std::exception& e) {
+				++failed;
+				printf("%s: error: %s\n", fn.c_str(), e.what());
+			}
+		}
+
+		printf("total: %d replays (%d failed), load %.3fs\n", (int)files.size(), (int)failed, seconds(total_load_time));
+		print_timings(total_timings, total_wall_time);
+		print_cache("sight footprint", total_sight_footprint_cache_hits, total_sight_footprint_cache_misses);
+#ifdef OPENBW_ENABLE_PROFILER
+		print_profiler(total_profiler);
+#endif
+	} catch (const std::exception& e) {
+		printf("error: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,132 @@
+#include "bwgame.h"
+#include "replay.h"
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+
+using namespace bwgame;
+using namespace bwgame::tools;
+
+// Prints the game info of replays without loading them, which needs no data
+// files: one line per replay with the frame count, the map and the players.
+// The actions can be indexed too, for actions per minute and build orders.
+
+namespace {
+
+const char* race_name(int race) {
+	switch (race) {
+	case (int)race_t::zerg: return "Z";
+	case (int)race_t::terran: return "T";
+	case (int)race_t::protoss: return "P";
+	default: return "?";
+	}
+}
+
+bool is_player(int controller) {
+	return controller == player_t::controller_occupied || controller == player_t::controller_computer || controller == player_t::controller_computer_game;
+}
+
+// A frame lasts 42ms at the fastest game speed, which replays are played at.
+double frames_to_minutes(int frames) {
+	return frames * 42 / 60000.0;
+}
+
+void print_actions_per_minute(const replay_info& info, const action_index& index) {
+	std::array<size_t, 12> counts{};
+	for (auto& v : index.actions) ++counts[v.owner];
+	double minutes = frames_to_minutes(info.frame_count);
+	for (size_t i = 0; i != 12; ++i) {
+		if (!is_player(info.slots[i].controller)) continue;
+		printf("  %s: %d actions, %.0f apm\n", info.slots[i].name.c_str(), (int)counts[i], minutes ? counts[i] / minutes : 0.0);
+	}
+}
+
+void print_build_order(const replay_info& info, const action_index& index, const a_vector<uint8_t>& actions_data) {
+	for (auto& v : index.actions) {
+		data_loading::data_reader_le r(actions_data.data() + v.offset + 2, actions_data.data() + actions_data.size());
+		const char* name = nullptr;
+		int id = 0;
+		switch (v.action_id) {
+		case 12:
+			name = "build";
+			r.skip(5);
+			id = r.get<uint16_t>();
+			break;
+		case 31: name = "train"; id = r.get<uint16_t>(); break;
+		case 35: name = "morph"; id = r.get<uint16_t>(); break;
+		case 53: name = "morph building"; id = r.get<uint16_t>(); break;
+		case 48: name = "research"; id = r.get<uint8_t>(); break;
+		case 50: name = "upgrade"; id = r.get<uint8_t>(); break;
+		default: continue;
+		}
+		int time = v.frame * 42 / 1000;
+		printf("  %d:%02d %s: %s %d\n", time / 60, time % 60, info.slots[v.owner].name.c_str(), name, id);
+	}
+}
+
+void usage(const char* argv0) {
+	printf("usage: %s [-q] [-a] [-b] <replay file or directory>...\n", argv0);
+	printf("  -q  only print failures and the summary\n");
+	printf("  -a  index the actions and print the actions per minute of each player\n");
+	printf("  -b  index the actions and print the build, train, research and upgrade actions\n");
+}
+
+}
+
+int main(int argc, const char** argv) {
+
+	bool quiet = false;
+	bool apm = false;
+	bool build_order = false;
+	a_vector<a_string> files;
+
+	for (int i = 1; i < argc; ++i) {
+		a_string arg = argv[i];
+		if (arg == "-q") quiet = true;
+		else if (arg == "-a") apm = true;
+		else if (arg == "-b") build_order = true;
+		else if (arg == "-h" || arg == "--help") {
+			usage(argv[0]);
+			return 0;
+		} else add_replay_files(files, std::move(arg));
+	}
+	if (files.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	size_t failed = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (auto& fn : files) {
+		try {
+			auto file_r = data_loading::mapped_file_reader<>(fn);
+			auto r = data_loading::make_replay_file_reader(file_r);
+			auto info = load_replay_info(r);
+			a_vector<uint8_t> actions_data;
+			action_index index;
+			if (apm || build_order) {
+				actions_data = load_replay_actions(r);
+				std::array<int, 12> player_id;
+				for (size_t i = 0; i != 12; ++i) player_id[i] = info.slots[i].player_id;
+				index = make_action_index(actions_data.data(), actions_data.data() + actions_data.size(), player_id, info.frame_count);
+			}
+			if (quiet) continue;
+			printf("%s: %d frames, map %s, players", fn.c_str(), info.frame_count, info.map_name.c_str());
+			for (auto& v : info.slots) {
+				if (is_player(v.controller)) printf(" %s (%s)", v.name.c_str(), race_name(v.race));
+			}
+			printf("\n");
+			if (apm) print_actions_per_minute(info, index);
+			if (build_order) print_build_order(info, index, actions_data);
+		} catch (const std::exception& e) {
+			++failed;
+			printf("%s: error: %s\n", fn.c_str(), e.what());
+		}
+	}
+	double wall = seconds(std::chrono::steady_clock::now() - start);
+	printf("total: %d replays (%d failed) in %.3fs (%.0f replays/s)\n", (int)files.size(), (int)failed, wall, wall ? files.size() / wall : 0.0);
+
+	return 0;
+}
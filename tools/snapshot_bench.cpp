@@ -0,0 +1,180 @@
+#include "bwgame.h"
+#include "snapshot.h"
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace bwgame;
+using namespace bwgame::tools;
+
+// Checks and times the tile pages of state snapshots (shared_pages) on a
+// synthetic workload. Units walk around a map and write the tiles around
+// them every frame, and every 100 frames every tile is written, as
+// state_functions::update_tiles_timer does. Every few frames the tiles are
+// stored in a snapshot, along with a full copy. A snapshot from the middle of
+// the chain is then destroyed, and the rest are restored in random order,
+// with more tiles written and new snapshots taken after each restore. Every
+// restore must give back exactly the tiles of the full copy.
+
+namespace {
+
+using pages_t = shared_pages<tile_t, state::tile_page_size>;
+
+// The tiles and page ids of a state.
+struct tiles_t {
+	a_vector<tile_t> tiles;
+	a_vector<uint64_t> page_ids;
+
+	void write(size_t index, tile_t v) {
+		tiles[index] = v;
+		page_ids[index / state::tile_page_size] = 0;
+	}
+};
+
+struct snapshot_t {
+	pages_t pages;
+	a_vector<tile_t> copy;
+};
+
+bool equal(const a_vector<tile_t>& a, const a_vector<tile_t>& b) {
+	return a.size() == b.size() && memcmp(a.data(), b.data(), a.size() * sizeof(tile_t)) == 0;
+}
+
+void usage(const char* argv0) {
+	printf("usage: %s [-m map_size] [-f frames] [-k frames] [-u units] [-s seed]\n", argv0);
+	printf("  -m  width and height of the map in tiles (default: 256)\n");
+	printf("  -f  number of frames to run (default: 4800)\n");
+	printf("  -k  take a snapshot every this many frames (default: 24)\n");
+	printf("  -u  number of units writing tiles (default: 20)\n");
+}
+
+}
+
+int main(int argc, const char** argv) {
+
+	size_t map_size = 256;
+	size_t frames = 4800;
+	size_t interval = 24;
+	size_t unit_count = 20;
+	uint32_t seed = 42;
+
+	for (int i = 1; i < argc; ++i) {
+		a_string arg = argv[i];
+		if (arg == "-m" && i + 1 < argc) map_size = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-f" && i + 1 < argc) frames = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-k" && i + 1 < argc) interval = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-u" && i + 1 < argc) unit_count = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-s" && i + 1 < argc) seed = (uint32_t)std::atoi(argv[++i]);
+		else {
+			usage(argv[0]);
+			return arg == "-h" || arg == "--help" ? 0 : 1;
+		}
+	}
+	if (map_size == 0 || interval == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::mt19937 rng(seed);
+	auto rand_int = [&](int from, int to) {
+		return std::uniform_int_distribution<int>(from, to)(rng);
+	};
+
+	tiles_t st;
+	st.tiles.resize(map_size * map_size);
+	st.page_ids.assign((st.tiles.size() + state::tile_page_size - 1) / state::tile_page_size, 0);
+	for (auto& v : st.tiles) {
+		v.visible = (uint8_t)rng();
+		v.explored = (uint8_t)rng();
+		v.flags = (uint16_t)rng();
+	}
+
+	a_vector<xy_t<int>> units(unit_count);
+	for (auto& v : units) v = {rand_int(0, (int)map_size - 1), rand_int(0, (int)map_size - 1)};
+
+	auto write_around_units = [&]() {
+		for (auto& u : units) {
+			u.x = std::max(0, std::min((int)map_size - 1, u.x + rand_int(-1, 1)));
+			u.y = std::max(0, std::min((int)map_size - 1, u.y + rand_int(-1, 1)));
+			for (int y = std::max(0, u.y - 3); y <= std::min((int)map_size - 1, u.y + 3); ++y) {
+				for (int x = std::max(0, u.x - 3); x <= std::min((int)map_size - 1, u.x + 3); ++x) {
+					size_t index = (size_t)y * map_size + (size_t)x;
+					tile_t v = st.tiles[index];
+					v.visible &= (uint8_t)~(1 << rand_int(0, 7));
+					v.explored &= v.visible;
+					st.write(index, v);
+				}
+			}
+		}
+	};
+
+	bool same = true;
+	size_t shared_page_count = 0;
+	size_t total_pages = 0;
+	std::chrono::steady_clock::duration take_time{};
+	std::chrono::steady_clock::duration copy_time{};
+	std::chrono::steady_clock::duration restore_time{};
+	size_t pages_written = 0;
+	size_t restores = 0;
+
+	auto take = [&](snapshot_t& r, const snapshot_t* prev) {
+		auto start = std::chrono::steady_clock::now();
+		shared_page_count += r.pages.assign(st.tiles, st.page_ids, prev ? &prev->pages : nullptr);
+		take_time += std::chrono::steady_clock::now() - start;
+		total_pages += r.pages.pages.size();
+		start = std::chrono::steady_clock::now();
+		r.copy = st.tiles;
+		copy_time += std::chrono::steady_clock::now() - start;
+	};
+
+	a_list<snapshot_t> snapshots;
+	for (size_t frame = 1; frame <= frames; ++frame) {
+		write_around_units();
+		if (frame % 100 == 0) {
+			for (size_t i = 0; i != st.tiles.size(); ++i) {
+				tile_t v = st.tiles[i];
+				v.visible = 0xff;
+				st.write(i, v);
+			}
+		}
+		if (frame % interval == 0) {
+			const snapshot_t* prev = snapshots.empty() ? nullptr : &snapshots.back();
+			snapshots.emplace_back();
+			take(snapshots.back(), prev);
+		}
+	}
+	size_t chain_length = snapshots.size();
+
+	a_vector<snapshot_t*> order;
+	if (!snapshots.empty()) snapshots.erase(std::next(snapshots.begin(), snapshots.size() / 2));
+	for (auto& v : snapshots) order.push_back(&v);
+	std::shuffle(order.begin(), order.end(), rng);
+
+	for (auto* s : order) {
+		auto start = std::chrono::steady_clock::now();
+		pages_written += s->pages.restore(st.tiles, st.page_ids);
+		restore_time += std::chrono::steady_clock::now() - start;
+		++restores;
+		if (!equal(st.tiles, s->copy)) same = false;
+
+		write_around_units();
+		snapshots.emplace_back();
+		take(snapshots.back(), s);
+
+		tiles_t fresh;
+		snapshots.back().pages.restore(fresh.tiles, fresh.page_ids);
+		if (!equal(fresh.tiles, snapshots.back().copy)) same = false;
+	}
+
+	size_t page_count = (map_size * map_size + state::tile_page_size - 1) / state::tile_page_size;
+	printf("%dx%d tiles (%d pages), %d snapshots, %d restored\n", (int)map_size, (int)map_size, (int)page_count, (int)chain_length, (int)restores);
+	printf("  take          %10.6fs, %d of %d pages shared\n", seconds(take_time), (int)shared_page_count, (int)total_pages);
+	printf("  restore       %10.6fs, %d of %d pages written\n", seconds(restore_time), (int)pages_written, (int)(restores * page_count));
+	printf("  full copies   %10.6fs\n", seconds(copy_time));
+
+	printf("results %s\n", same ? "identical" : "DIFFER");
+	return same ? 0 : 1;
+}
@@ -0,0 +1,510 @@
+#include "bwgame.h"
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace bwgame;
+using namespace bwgame::tools;
+
+// Compares data_loading::decompress_huffman and decompress_adpcm with the
+// original list based Huffman decoder and ADPCM decoder below, and times
+// both. The inputs are the sectors of every sound in sfxdata.dat, as the UI
+// loads them, or if no data path is given, synthetic sound sectors. Corrupted
+// copies of each sector are compared too. The two must produce the same
+// output, and must fail on the same inputs.
+
+namespace {
+
+// The Huffman decoder that data_loading::decompress_huffman replaced.
+size_t decompress_huffman_reference(const uint8_t* input, size_t input_size, uint8_t* output, size_t output_size) {
+	data_loading::data_reader_le source_r(input, input + input_size);
+	auto r = data_loading::make_bit_reader(source_r);
+	size_t weights_index = r.get<uint8_t>();
+	if (weights_index >= 9) error("decompress_huffman_reference: invalid weights index %d", weights_index);
+	const uint8_t* weights = data_loading::huffman_weight_tables[weights_index];
+
+	struct tree_node;
+	using tree_node_iterator = typename a_list<tree_node>::iterator;
+	struct tree_node {
+		tree_node_iterator left;
+		tree_node_iterator parent;
+		int weight;
+		int symbol;
+	};
+	a_list<tree_node> all_nodes;
+	auto end = all_nodes.end();
+	all_nodes.push_back({end, end, 1, 0x101});
+	all_nodes.push_back({end, end, 1, 0x100});
+	for (int i = 256; i != 0;) {
+		--i;
+		int w = weights[i];
+		if (w == 0) continue;
+		all_nodes.push_back({end, end, w, i});
+	}
+
+	all_nodes.sort([&](auto& a, auto& b) {
+		return a.weight < b.weight;
+	});
+
+	for (auto a = all_nodes.begin(); a != end;) {
+		auto b = std::next(a);
+		if (b == end) break;
+
+		int w = a->weight + b->weight;
+		auto it = std::find_if(all_nodes.begin(), all_nodes.end(), [&](auto& v) {
+			return v.weight >= w;
+		});
+		it = all_nodes.insert(it, {a, end, w, -1});
+
+		a->parent = it;
+		b->parent = it;
+
+		a = std::next(b);
+	}
+
+	auto increment_weight = [&](tree_node_iterator n) {
+		for (; n != end; n = n->parent) {
+			++n->weight;
+			int w = n->weight;
+			auto swap_n_next = std::find_if(std::next(n), end, [&](auto& v) {
+				return v.weight >= w;
+			});
+			auto swap_n = std::prev(swap_n_next);
+			if (swap_n == n) continue;
+			all_nodes.splice(n, all_nodes, swap_n);
+			all_nodes.splice(swap_n_next, all_nodes, n);
+
+			if (n->parent->left == n) {
+				if (swap_n->parent->left == swap_n) swap_n->parent->left = n;
+				n->parent->left = swap_n;
+			} else if (swap_n->parent->left == swap_n) swap_n->parent->left = n;
+			std::swap(n->parent, swap_n->parent);
+		}
+	};
+
+	size_t out_pos = 0;
+
+	while (out_pos < output_size) {
+		tree_node_iterator n = std::prev(end);
+		while (n->symbol == -1) {
+			int bit = r.get_bits<1>();
+			if (bit == 0) n = n->left;
+			else n = std::next(n->left);
+		}
+		if (n->symbol == 256) break;
+		uint8_t value;
+		if (n->symbol == 257) {
+			int symbol = r.get_bits<8>();
+			value = symbol;
+
+			n = all_nodes.begin();
+			int n_symbol = n->symbol;
+
+			n->symbol = -1;
+
+			all_nodes.push_front({end, n, 1, n_symbol});
+			all_nodes.push_front({end, n, 0, symbol});
+			n->left = all_nodes.begin();
+			n = n->left;
+
+			increment_weight(n);
+			if (weights_index != 0) increment_weight(n);
+
+		} else value = n->symbol;
+		output[out_pos] = value;
+		++out_pos;
+
+		if (weights_index == 0) increment_weight(n);
+	}
+	return out_pos;
+}
+
+// The ADPCM decoder that data_loading::decompress_adpcm replaced. The
+// original checked for space in the output with out_pos - output_size < 2,
+// and could write a byte past the end.
+size_t decompress_adpcm_reference(const uint8_t* input, size_t input_size, uint8_t* output, size_t output_size, size_t channels) {
+	data_loading::data_reader_le r(input, input + input_size);
+
+	size_t out_pos = 0;
+
+	a_vector<int16_t> previous_sample(channels);
+	a_vector<int> step_index(channels, 44);
+
+	r.get<uint8_t>();
+	auto shift = r.get<uint8_t>();
+
+	for (size_t i = 0; i != channels; ++i) {
+		auto sample = r.get<int16_t>();
+		previous_sample[i] = sample;
+		if (output_size - out_pos < 2) error("decompress_adpcm_reference: attempt to write past end");
+		data_loading::set_value_at<true, int16_t>(output + out_pos, sample);
+		out_pos += 2;
+	}
+
+	while (r.left()) {
+		for (size_t channel = 0; channel != channels; ++channel) {
+			auto in_value = r.get<uint8_t>();
+			if (~in_value & 0x80) {
+				int index = step_index[channel];
+				int32_t step = data_loading::adpcm_step_table[index];
+				int32_t sample = step >> shift;
+				if (in_value & 1) sample += step;
+				if (in_value & 2) sample += step >> 1;
+				if (in_value & 4) sample += step >> 2;
+				if (in_value & 8) sample += step >> 3;
+				if (in_value & 0x10) sample += step >> 4;
+				if (in_value & 0x20) sample += step >> 5;
+				if (in_value & 0x40) {
+					sample = previous_sample[channel] - sample;
+					if (sample < -32768) sample = -32768;
+				} else {
+					sample = previous_sample[channel] + sample;
+					if (sample > 32767) sample = 32767;
+				}
+
+				previous_sample[channel] = sample;
+				if (output_size - out_pos < 2) error("decompress_adpcm_reference: attempt to write past end");
+				data_loading::set_value_at<true, int16_t>(output + out_pos, sample);
+				out_pos += 2;
+
+				index += data_loading::adpcm_index_add_table[in_value & 0x1f];
+				if (index < 0) index = 0;
+				else if (index > 88) index = 88;
+				step_index[channel] = index;
+			} else {
+				int n = in_value & 0x7f;
+				if (n == 0) {
+					if (step_index[channel] != 0) --step_index[channel];
+					if (output_size - out_pos < 2) error("decompress_adpcm_reference: attempt to write past end");
+					data_loading::set_value_at<true, int16_t>(output + out_pos, previous_sample[channel]);
+					out_pos += 2;
+				} else if (n == 1) {
+					if (step_index[channel] >= 88 - 8) step_index[channel] = 88;
+					else step_index[channel] += 8;
+					--channel;
+				} else if (n == 2) {
+					if (step_index[channel] <= 8) step_index[channel] = 0;
+					else step_index[channel] -= 8;
+					--channel;
+				}
+			}
+		}
+	}
+
+	return out_pos;
+}
+
+// A compressed sector: the compression flags, which are some combination of
+// 1 (Huffman), 0x40 (mono ADPCM) and 0x80 (stereo ADPCM), and the data.
+struct sample {
+	int flags;
+	a_vector<uint8_t> compressed;
+	size_t size;
+};
+
+struct decoders {
+	size_t (*huffman)(const uint8_t*, size_t, uint8_t*, size_t);
+	size_t (*adpcm)(const uint8_t*, size_t, uint8_t*, size_t, size_t);
+};
+
+const decoders reference_decoders = {decompress_huffman_reference, decompress_adpcm_reference};
+const decoders table_decoders = {data_loading::decompress_huffman<>, data_loading::decompress_adpcm<>};
+
+// Decompresses a sector in the same order as mpq_archive_file_reader into
+// one of buffers, which must hold at least s.size bytes each, and returns
+// the decompressed size. result is set to the decompressed data.
+size_t decode(const decoders& d, const sample& s, std::array<a_vector<uint8_t>, 2>& buffers, const uint8_t*& result) {
+	const uint8_t* input = s.compressed.data();
+	size_t input_size = s.compressed.size();
+	size_t index = 0;
+	auto stage = [&](auto&& f) {
+		uint8_t* output = buffers[index].data();
+		index ^= 1;
+		input_size = f(output);
+		input = output;
+	};
+	if (s.flags & 1) stage([&](uint8_t* output) {
+		return d.huffman(input, input_size, output, s.size);
+	});
+	if (s.flags & 0x40) stage([&](uint8_t* output) {
+		return d.adpcm(input, input_size, output, s.size, 1);
+	});
+	if (s.flags & 0x80) stage([&](uint8_t* output) {
+		return d.adpcm(input, input_size, output, s.size, 2);
+	});
+	result = input;
+	return input_size;
+}
+
+// Adds every Huffman or ADPCM compressed sector of filename in the loaded
+// archives to samples.
+template<typename loader_T>
+void add_file_samples(a_vector<sample>& samples, loader_T& loader, const a_string& filename) {
+	for (auto& v : loader.mpqs) {
+		if (!v.mpq.file_exists(filename)) continue;
+		auto f = v.mpq.open(filename);
+		if (~f.be.flags & 0x200) return;
+		for (size_t i = 0; i + 1 < f.compressed_sectors.size(); ++i) {
+			size_t compressed_size = f.compressed_sectors[i + 1] - f.compressed_sectors[i];
+			size_t size = std::min(f.sector_size, f.be.size - i * f.sector_size);
+			if (compressed_size == size || compressed_size == 0) continue;
+			a_vector<uint8_t> data(compressed_size);
+			f.r.seek(f.be.data_offset + f.compressed_sectors[i]);
+			if (f.be.flags & 0x10000) data_loading::make_encrypted_reader(f.r, compressed_size, f.key + (uint32_t)i, f.crypt_table).get_bytes(data.data(), compressed_size);
+			else f.r.get_bytes(data.data(), compressed_size);
+			int flags = data[0];
+			if (flags & ~(1 | 0x40 | 0x80) || flags == 0) continue;
+			samples.push_back({flags, a_vector<uint8_t>(data.begin() + 1, data.end()), size});
+		}
+		return;
+	}
+	error("%s: file not found", filename);
+}
+
+// Adds the sectors of every sound in sfxdata.dat.
+void add_sound_samples(a_vector<sample>& samples, const a_string& data_path) {
+	auto loader = data_loading::data_files_directory(data_path);
+	a_vector<uint8_t> data;
+	loader(data, "arr/sfxdata.dat");
+	auto sound_types = data_loading::load_sfxdata_dat(data);
+	string_table_data tbl;
+	loader(tbl.data, "arr/sfxdata.tbl");
+	a_vector<a_string> filenames;
+	for (auto& v : sound_types.vec) {
+		if (v.filename_index == 0) continue;
+		filenames.push_back("sound/" + tbl[v.filename_index]);
+	}
+	std::sort(filenames.begin(), filenames.end());
+	filenames.erase(std::unique(filenames.begin(), filenames.end()), filenames.end());
+	size_t failed = 0;
+	for (auto& fn : filenames) {
+		try {
+			add_file_samples(samples, loader, fn);
+		} catch (const std::exception& e) {
+			++failed;
+			printf("%s: error: %s\n", fn.c_str(), e.what());
+		}
+	}
+	printf("%d sounds (%d failed)\n", (int)filenames.size(), (int)failed);
+}
+
+// An encoder for the adaptive Huffman code that decompress_huffman decodes,
+// which keeps its tree in step with the decoder's.
+a_vector<uint8_t> compress_huffman(const uint8_t* data, size_t size, size_t weights_index) {
+	a_vector<uint8_t> r;
+	uint64_t bits = 0;
+	size_t bits_n = 0;
+	auto put_bits = [&](uint64_t v, size_t n) {
+		bits |= v << bits_n;
+		bits_n += n;
+		while (bits_n >= 8) {
+			r.push_back((uint8_t)bits);
+			bits >>= 8;
+			bits_n -= 8;
+		}
+	};
+	auto tree = data_loading::huffman_tree::initial(weights_index);
+	auto find = [&](int symbol) {
+		for (size_t i = 0; i != tree.nodes.size(); ++i) {
+			if (tree.nodes[i].symbol == symbol) return (uint32_t)i;
+		}
+		return (uint32_t)data_loading::huffman_tree::none;
+	};
+	auto put_symbol = [&](uint32_t n) {
+		a_vector<int> code;
+		for (; n != tree.root(); n = tree.nodes[n].parent) code.push_back(tree.nodes[tree.nodes[n].parent].child[0] == n ? 0 : 1);
+		for (size_t i = code.size(); i != 0;) put_bits(code[--i], 1);
+	};
+	put_bits(weights_index, 8);
+	for (size_t i = 0; i != size; ++i) {
+		uint32_t n = find(data[i]);
+		if (n == data_loading::huffman_tree::none) {
+			put_symbol(find(257));
+			put_bits(data[i], 8);
+			n = tree.add_symbol(data[i]);
+			tree.increment_weight(n);
+			if (weights_index != 0) tree.increment_weight(n);
+		} else put_symbol(n);
+		if (weights_index == 0) tree.increment_weight(n);
+	}
+	put_symbol(find(256));
+	if (bits_n) put_bits(0, 8 - bits_n);
+	return r;
+}
+
+// ADPCM data for a sector of a tone with some noise. ADPCM data can not be
+// invalid, so this does not need an encoder.
+a_vector<uint8_t> random_adpcm_data(std::mt19937& rng, size_t size, size_t channels) {
+	a_vector<uint8_t> r;
+	r.push_back(0);
+	r.push_back((uint8_t)(rng() % 8));
+	for (size_t i = 0; i != channels; ++i) {
+		r.push_back((uint8_t)rng());
+		r.push_back((uint8_t)rng());
+	}
+	int period = 8 + rng() % 64;
+	int amplitude = 1 + rng() % 24;
+	// Step changes (0x81 and 0x82) do not move on to the next channel, and
+	// the data must end after the last channel.
+	size_t channel = 0;
+	bool step_change = false;
+	for (size_t i = 0; r.size() < size || channel != 0 || step_change; ++i) {
+		int noise = (int)(rng() % 5) - 2;
+		int v = std::abs((int)(i % period) - period / 2) * amplitude / period + noise;
+		step_change = false;
+		if (rng() % 64 == 0) {
+			uint8_t control = 0x80 | (uint8_t)(rng() % 3);
+			r.push_back(control);
+			step_change = control != 0x80;
+			if (step_change) continue;
+		} else r.push_back((uint8_t)((v < 0 ? 0x40 : 0) | (std::abs(v) & 0x3f)));
+		channel = (channel + 1) % channels;
+	}
+	return r;
+}
+
+// Random sound sectors: ADPCM data, compressed with Huffman like the
+// sounds in the data files, and plain Huffman data.
+void add_random_samples(a_vector<sample>& samples, std::mt19937& rng, size_t n) {
+	a_vector<uint8_t> output(0x10000);
+	for (size_t i = 0; i != n; ++i) {
+		size_t weights_index = rng() % 9;
+		if (i % 4 == 3) {
+			a_vector<uint8_t> data(1 + rng() % 4096);
+			int alphabet = 1 + rng() % 256;
+			for (auto& v : data) v = (uint8_t)(rng() % alphabet * (rng() % alphabet) / alphabet);
+			samples.push_back({1, compress_huffman(data.data(), data.size(), weights_index), data.size()});
+		} else {
+			size_t channels = 1 + rng() % 2;
+			auto data = random_adpcm_data(rng, 512 + rng() % 1536, channels);
+			size_t size = decompress_adpcm_reference(data.data(), data.size(), output.data(), output.size(), channels);
+			samples.push_back({1 | (channels == 1 ? 0x40 : 0x80), compress_huffman(data.data(), data.size(), weights_index), size});
+		}
+	}
+}
+
+// Returns the number of inputs on which the decoders disagree.
+size_t check(const a_vector<sample>& samples, std::mt19937& rng, size_t corruptions) {
+	size_t failed = 0;
+	std::array<a_vector<uint8_t>, 2> a_buffers;
+	std::array<a_vector<uint8_t>, 2> b_buffers;
+	auto compare = [&](const sample& s) {
+		for (auto& v : a_buffers) v.assign(s.size, 0);
+		for (auto& v : b_buffers) v.assign(s.size, 0);
+		auto try_decode = [&](const decoders& d, std::array<a_vector<uint8_t>, 2>& buffers, const uint8_t*& result, size_t& size) {
+			try {
+				size = decode(d, s, buffers, result);
+				return true;
+			} catch (const std::exception&) {
+				return false;
+			}
+		};
+		const uint8_t* a = nullptr;
+		const uint8_t* b = nullptr;
+		size_t a_size = 0;
+		size_t b_size = 0;
+		bool a_ok = try_decode(reference_decoders, a_buffers, a, a_size);
+		bool b_ok = try_decode(table_decoders, b_buffers, b, b_size);
+		if (a_ok != b_ok || (a_ok && (a_size != b_size || memcmp(a, b, a_size)))) ++failed;
+	};
+	for (auto& s : samples) {
+		compare(s);
+		for (size_t i = 0; i != corruptions; ++i) {
+			sample c = s;
+			if (c.compressed.empty()) continue;
+			switch (rng() % 3) {
+			case 0:
+				c.compressed[rng() % c.compressed.size()] ^= (uint8_t)(1 << rng() % 8);
+				break;
+			case 1:
+				c.compressed.resize(rng() % c.compressed.size());
+				break;
+			case 2:
+				for (size_t n = 1 + rng() % 8; n; --n) c.compressed[rng() % c.compressed.size()] = (uint8_t)rng();
+				break;
+			}
+			compare(c);
+		}
+	}
+	return failed;
+}
+
+double time_decode(const decoders& d, const a_vector<sample>& samples, size_t repeat) {
+	size_t max_size = 0;
+	for (auto& s : samples) max_size = std::max(max_size, s.size);
+	std::array<a_vector<uint8_t>, 2> buffers;
+	for (auto& v : buffers) v.resize(max_size);
+	const uint8_t* result;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i != repeat; ++i) {
+		for (auto& s : samples) decode(d, s, buffers, result);
+	}
+	return seconds(std::chrono::steady_clock::now() - start);
+}
+
+void usage(const char* argv0) {
+	printf("usage: %s [-d data_path] [-n samples] [-c corruptions] [-r repeat] [-s seed]\n", argv0);
+	printf("  -d  directory containing StarDat.mpq, BrooDat.mpq and Patch_rt.mpq; if given, the\n");
+	printf("      samples are the sectors of every sound in sfxdata.dat\n");
+	printf("  -n  number of random samples, if no data path is given (default: 1000)\n");
+	printf("  -c  number of corrupted copies of each sample to compare (default: 10)\n");
+	printf("  -r  number of times to decompress all samples when timing (default: 10)\n");
+	printf("  -s  random seed (default: 1)\n");
+}
+
+}
+
+int main(int argc, const char** argv) {
+
+	a_string data_path;
+	size_t random_samples = 1000;
+	size_t corruptions = 10;
+	size_t repeat = 10;
+	unsigned seed = 1;
+
+	for (int i = 1; i < argc; ++i) {
+		a_string arg = argv[i];
+		if (arg == "-d" && i + 1 < argc) data_path = argv[++i];
+		else if (arg == "-n" && i + 1 < argc) random_samples = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-c" && i + 1 < argc) corruptions = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-r" && i + 1 < argc) repeat = (size_t)std::atoi(argv[++i]);
+		else if (arg == "-s" && i + 1 < argc) seed = (unsigned)std::atoi(argv[++i]);
+		else {
+			usage(argv[0]);
+			return arg == "-h" || arg == "--help" ? 0 : 1;
+		}
+	}
+
+	try {
+		std::mt19937 rng(seed);
+		a_vector<sample> samples;
+		if (!data_path.empty()) add_sound_samples(samples, data_path);
+		else add_random_samples(samples, rng, random_samples);
+
+		size_t compressed_size = 0;
+		size_t size = 0;
+		for (auto& s : samples) {
+			compressed_size += s.compressed.size();
+			size += s.size;
+		}
+		printf("%d samples, %d bytes compressed to %d\n", (int)samples.size(), (int)size, (int)compressed_size);
+
+		size_t failed = check(samples, rng, corruptions);
+		printf("%d of %d inputs decoded differently\n", (int)failed, (int)(samples.size() * (1 + corruptions)));
+
+		double mb = (double)size * repeat / (1024 * 1024);
+		double reference = time_decode(reference_decoders, samples, repeat);
+		double table = time_decode(table_decoders, samples, repeat);
+		printf("reference: %.3fs (%.1f MB/s)\n", reference, reference ? mb / reference : 0.0);
+		printf("table:     %.3fs (%.1f MB/s)\n", table, table ? mb / table : 0.0);
+		if (failed) return 1;
+	} catch (const std::exception& e) {
+		printf("error: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}